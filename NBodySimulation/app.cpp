@@ -17,6 +17,7 @@
 #include "demo2.cpp"
 #include "demo3.cpp"
 #include "demo4.cpp"
+#include "demo5.cpp"
 
 Window::Window() :
 	left(0),
@@ -45,11 +46,12 @@ void Application::Resize(const int width, const int height) {
 
 DemoApplication::DemoApplication() :
 	Application(),
-	multiThreadingActive(true),
-	activeScenarioIndex(0),
-	simulationActive(true),
 	demoIndex(0),
-	demo(nullptr) {
+	demo(nullptr),
+	simulationActive(true),
+	activeScenarioIndex(0),
+	multiThreadingActive(true),
+	activeOptionIndex(0) {
 
 	demoStats.reserve(kDemoCount);
 	benchmarkActive = false;
@@ -57,6 +59,10 @@ DemoApplication::DemoApplication() :
 	activeBenchmarkIteration = nullptr;
 	benchmarkFrameCount = 0;
 	benchmarkIterations.reserve(kBenchmarkIterationCount);
+	dispatchBenchmark = {};
+	layoutBenchmark = {};
+	kernelBenchmark = {};
+	storageBenchmark = {};
 }
 
 void DemoApplication::Init() {
@@ -90,6 +96,7 @@ void DemoApplication::PushDemoStatistics() {
 
 	size_t avgCount = 0;
 	demoStat.min.simulationTime = FLT_MAX;
+	demoStat.min.stats.serialFraction = 1.0f;
 	demoStat.max.simulationTime = 0.0f;
 	demoStat.avg.simulationTime = 0.0f;
 
@@ -114,6 +121,9 @@ void DemoApplication::PushDemoStatistics() {
 			UpdateMin(demoStat.min.stats.time.predict, frameStat->stats.time.predict);
 			UpdateMin(demoStat.min.stats.time.updateGrid, frameStat->stats.time.updateGrid);
 			UpdateMin(demoStat.min.stats.time.viscosityForces, frameStat->stats.time.viscosityForces);
+			UpdateMin(demoStat.min.stats.time.taskGraph, frameStat->stats.time.taskGraph);
+			UpdateMin(demoStat.min.stats.time.taskGraphBuild, frameStat->stats.time.taskGraphBuild);
+			UpdateMin(demoStat.min.stats.serialFraction, frameStat->stats.serialFraction);
 
 			UpdateMax(demoStat.max.simulationTime, frameStat->simulationTime);
 			UpdateMax(demoStat.max.stats.time.collisions, frameStat->stats.time.collisions);
@@ -125,6 +135,9 @@ void DemoApplication::PushDemoStatistics() {
 			UpdateMax(demoStat.max.stats.time.predict, frameStat->stats.time.predict);
 			UpdateMax(demoStat.max.stats.time.updateGrid, frameStat->stats.time.updateGrid);
 			UpdateMax(demoStat.max.stats.time.viscosityForces, frameStat->stats.time.viscosityForces);
+			UpdateMax(demoStat.max.stats.time.taskGraph, frameStat->stats.time.taskGraph);
+			UpdateMax(demoStat.max.stats.time.taskGraphBuild, frameStat->stats.time.taskGraphBuild);
+			UpdateMax(demoStat.max.stats.serialFraction, frameStat->stats.serialFraction);
 
 			Accumulate(demoStat.avg.simulationTime, frameStat->simulationTime);
 			Accumulate(demoStat.avg.stats.time.collisions, frameStat->stats.time.collisions);
@@ -136,6 +149,9 @@ void DemoApplication::PushDemoStatistics() {
 			Accumulate(demoStat.avg.stats.time.predict, frameStat->stats.time.predict);
 			Accumulate(demoStat.avg.stats.time.updateGrid, frameStat->stats.time.updateGrid);
 			Accumulate(demoStat.avg.stats.time.viscosityForces, frameStat->stats.time.viscosityForces);
+			Accumulate(demoStat.avg.stats.time.taskGraph, frameStat->stats.time.taskGraph);
+			Accumulate(demoStat.avg.stats.time.taskGraphBuild, frameStat->stats.time.taskGraphBuild);
+			Accumulate(demoStat.avg.stats.serialFraction, frameStat->stats.serialFraction);
 
 			++avgCount;
 		}
@@ -153,6 +169,9 @@ void DemoApplication::PushDemoStatistics() {
 		demoStat.avg.stats.time.predict *= avg;
 		demoStat.avg.stats.time.updateGrid *= avg;
 		demoStat.avg.stats.time.viscosityForces *= avg;
+		demoStat.avg.stats.time.taskGraph *= avg;
+		demoStat.avg.stats.time.taskGraphBuild *= avg;
+		demoStat.avg.stats.serialFraction *= avg;
 	}
 
 	demoStat.frameCount = maxFrameCount;
@@ -205,6 +224,11 @@ void DemoApplication::RenderBenchmark(OSDState *osdState, const float left, floa
 	DrawOSDLine(osdState, osdBuffer);
 	fplStringFormat(osdBuffer, fplArrayCount(osdBuffer), "CPU: %s", cpuName.c_str());
 	DrawOSDLine(osdState, osdBuffer);
+	for (size_t demoStatIndex = 0; demoStatIndex < demoStats.size(); ++demoStatIndex) {
+		DemoStatistics *demoStat = &demoStats[demoStatIndex];
+		fplStringFormat(osdBuffer, fplArrayCount(osdBuffer), "Demo %llu serial fraction (min / avg / max): %.1f / %.1f / %.1f %%", (demoStatIndex + 1), demoStat->min.stats.serialFraction * 100.0f, demoStat->avg.stats.serialFraction * 100.0f, demoStat->max.stats.serialFraction * 100.0f);
+		DrawOSDLine(osdState, osdBuffer);
+	}
 }
 
 void DemoApplication::DrawOSDLine(OSDState *osdState, const char *str) {
@@ -321,10 +345,64 @@ void DemoApplication::UpdateAndRender(const float frameTime, const uint64_t cycl
 			DrawOSDLine(&osdState, osdBuffer);
 			fplStringFormat(osdBuffer, fplArrayCount(osdBuffer), "Reset (R)");
 			DrawOSDLine(&osdState, osdBuffer);
+			if (dispatchBenchmark.isDone) {
+				fplStringFormat(osdBuffer, fplArrayCount(osdBuffer), "Dispatch benchmark (M): CreateTasks %f us, ParallelFor %f us per batch of %llu tasks, %llu threads", dispatchBenchmark.createTasksTime, dispatchBenchmark.parallelForTime, dispatchBenchmark.taskCount, dispatchBenchmark.threadCount);
+			} else {
+				fplStringFormat(osdBuffer, fplArrayCount(osdBuffer), "Dispatch benchmark (M)");
+			}
+			DrawOSDLine(&osdState, osdBuffer);
+			if (layoutBenchmark.isDone) {
+				fplStringFormat(osdBuffer, fplArrayCount(osdBuffer), "Layout benchmark (L): Demo 4, scenario %llu, %llu frames, neighbor search / density and pressure:", (layoutBenchmark.scenarioIndex + 1), layoutBenchmark.frameCount);
+				DrawOSDLine(&osdState, osdBuffer);
+				for (size_t layoutIndex = 0; layoutIndex < kLayoutBenchmarkLayoutCount; ++layoutIndex) {
+					fplStringFormat(osdBuffer, fplArrayCount(osdBuffer), "\t%s: %f / %f ms", kLayoutBenchmarkLayoutNames[layoutIndex], layoutBenchmark.neighborSearchTime[layoutIndex], layoutBenchmark.densityAndPressureTime[layoutIndex]);
+					DrawOSDLine(&osdState, osdBuffer);
+				}
+			} else {
+				fplStringFormat(osdBuffer, fplArrayCount(osdBuffer), "Layout benchmark (L)");
+				DrawOSDLine(&osdState, osdBuffer);
+			}
+			if (kernelBenchmark.isDone) {
+				fplStringFormat(osdBuffer, fplArrayCount(osdBuffer), "Kernel benchmark (K): Demo 4, scenario %llu, %llu frames, gather solver, viscosity forces / density and pressure / delta positions, max errors (tolerance %g):", (kernelBenchmark.scenarioIndex + 1), kernelBenchmark.frameCount, kSPHKernelTolerance);
+				DrawOSDLine(&osdState, osdBuffer);
+				for (size_t kernelSet = 0; kernelSet <= kernelBenchmark.supportedKernelSet; ++kernelSet) {
+					const bool failed = kernelBenchmark.viscosityError[kernelSet] > kSPHKernelTolerance || kernelBenchmark.densityError[kernelSet] > kSPHKernelTolerance || kernelBenchmark.deltaError[kernelSet] > kSPHKernelTolerance;
+					fplStringFormat(osdBuffer, fplArrayCount(osdBuffer), "\t%s: %f / %f / %f ms, %g / %g / %g%s", kSPHKernelSetNames[kernelSet], kernelBenchmark.viscosityForcesTime[kernelSet], kernelBenchmark.densityAndPressureTime[kernelSet], kernelBenchmark.deltaPositionsTime[kernelSet], kernelBenchmark.viscosityError[kernelSet], kernelBenchmark.densityError[kernelSet], kernelBenchmark.deltaError[kernelSet], (failed ? " FAILED" : ""));
+					DrawOSDLine(&osdState, osdBuffer);
+				}
+			} else {
+				fplStringFormat(osdBuffer, fplArrayCount(osdBuffer), "Kernel benchmark (K)");
+				DrawOSDLine(&osdState, osdBuffer);
+			}
+			if (storageBenchmark.isDone) {
+				fplStringFormat(osdBuffer, fplArrayCount(osdBuffer), "Storage benchmark (S): scenario %llu, %llu frames, %s kernels, neighbor search / density and pressure / delta positions:", (storageBenchmark.scenarioIndex + 1), storageBenchmark.frameCount, kSPHKernelSetNames[storageBenchmark.kernelSet]);
+				DrawOSDLine(&osdState, osdBuffer);
+				for (size_t storageIndex = 0; storageIndex < kStorageBenchmarkStorageCount; ++storageIndex) {
+					fplStringFormat(osdBuffer, fplArrayCount(osdBuffer), "\t%s: %f / %f / %f ms", kStorageBenchmarkStorageNames[storageIndex], storageBenchmark.neighborSearchTime[storageIndex], storageBenchmark.densityAndPressureTime[storageIndex], storageBenchmark.deltaPositionsTime[storageIndex]);
+					DrawOSDLine(&osdState, osdBuffer);
+				}
+			} else {
+				fplStringFormat(osdBuffer, fplArrayCount(osdBuffer), "Storage benchmark (S)");
+				DrawOSDLine(&osdState, osdBuffer);
+			}
+			size_t optionCount = demo->GetOptionCount();
+			if (optionCount > 0) {
+				fplStringFormat(osdBuffer, fplArrayCount(osdBuffer), "Options: select (O), change (V)");
+				DrawOSDLine(&osdState, osdBuffer);
+				for (size_t optionIndex = 0; optionIndex < optionCount; ++optionIndex) {
+					const SPHOption *option = demo->GetOption(optionIndex);
+					fplStringFormat(osdBuffer, fplArrayCount(osdBuffer), "\t%s%s: %s", (optionIndex == activeOptionIndex ? "> " : ""), option->name, option->valueNames[option->value]);
+					DrawOSDLine(&osdState, osdBuffer);
+				}
+			}
 			fplStringFormat(osdBuffer, fplArrayCount(osdBuffer), "Frame time: %f ms, Cycles: %llu", (frameTime * 1000.0f), cycles);
 			DrawOSDLine(&osdState, osdBuffer);
 			fplStringFormat(osdBuffer, fplArrayCount(osdBuffer), "Particles: %llu", demo->GetParticleCount());
 			DrawOSDLine(&osdState, osdBuffer);
+			if (demo->IsParticleRemovalSupported()) {
+				fplStringFormat(osdBuffer, fplArrayCount(osdBuffer), "Removed particles: %llu", demo->GetStats().removedParticleCount);
+				DrawOSDLine(&osdState, osdBuffer);
+			}
 
 			fplStringFormat(osdBuffer, fplArrayCount(osdBuffer), "Stats:");
 			DrawOSDLine(&osdState, osdBuffer);
@@ -349,9 +427,25 @@ void DemoApplication::UpdateAndRender(const float frameTime, const uint64_t cycl
 			DrawOSDLine(&osdState, osdBuffer);
 			fplStringFormat(osdBuffer, fplArrayCount(osdBuffer), "\tTime collisions: %f ms", stats.time.collisions);
 			DrawOSDLine(&osdState, osdBuffer);
+			fplStringFormat(osdBuffer, fplArrayCount(osdBuffer), "\tTime task graph: %f ms (build %f ms)", stats.time.taskGraph, stats.time.taskGraphBuild);
+			DrawOSDLine(&osdState, osdBuffer);
+			fplStringFormat(osdBuffer, fplArrayCount(osdBuffer), "\tBarriers per step: %llu, graph dependencies: %llu", stats.barrierCount, stats.graphEdgeCount);
+			DrawOSDLine(&osdState, osdBuffer);
+			fplStringFormat(osdBuffer, fplArrayCount(osdBuffer), "\tSerial fraction: %.1f %%", stats.serialFraction * 100.0f);
+			DrawOSDLine(&osdState, osdBuffer);
+			fplStringFormat(osdBuffer, fplArrayCount(osdBuffer), "\tGrid sorts: %llu, unsorted particles: %.1f %%", stats.gridSortCount, stats.unsortedFraction * 100.0f);
+			DrawOSDLine(&osdState, osdBuffer);
+			fplStringFormat(osdBuffer, fplArrayCount(osdBuffer), "\tNeighbor lists rebuilt / reused: %llu / %llu steps", stats.neighborRebuildCount, stats.neighborReuseCount);
+			DrawOSDLine(&osdState, osdBuffer);
+			if (stats.distanceFieldSize > 0) {
+				fplStringFormat(osdBuffer, fplArrayCount(osdBuffer), "\tDistance field: %llu KB, baked in %f ms, max error: %f", stats.distanceFieldSize / 1024, stats.distanceFieldBakeTime, stats.distanceFieldMaxError);
+				DrawOSDLine(&osdState, osdBuffer);
+			}
+			fplStringFormat(osdBuffer, fplArrayCount(osdBuffer), "\tTime waited (viscosity / neighbors / density / delta): %f / %f / %f / %f ms", stats.waitTime.viscosityForces, stats.waitTime.neighborSearch, stats.waitTime.densityAndPressure, stats.waitTime.deltaPositions);
+			DrawOSDLine(&osdState, osdBuffer);
 		}
 	} else {
-		fplStringFormat(osdBuffer, fplArrayCount(osdBuffer), "Benchmarking - Demo %llu of %llu, Scenario: %s (Escape)", demoIndex + 1, (size_t)4, activeScenarioName.c_str());
+		fplStringFormat(osdBuffer, fplArrayCount(osdBuffer), "Benchmarking - Demo %llu of %llu, Scenario: %s (Escape)", demoIndex + 1, kDemoCount, activeScenarioName.c_str());
 		DrawOSDLine(&osdState, osdBuffer);
 		fplStringFormat(osdBuffer, fplArrayCount(osdBuffer), "Iteration %llu of %llu", benchmarkIterations.size(), kBenchmarkIterationCount);
 		DrawOSDLine(&osdState, osdBuffer);
@@ -402,10 +496,16 @@ void DemoApplication::LoadDemo(const size_t demoIndex) {
 			demo = new Demo4::ParticleSimulation();
 			demoTitle = Demo4::kDemoName;
 		} break;
+		case 4:
+		{
+			demo = new Demo5::ParticleSimulation();
+			demoTitle = Demo5::kDemoName;
+		} break;
 		default:
 			assert(false);
 	}
 	demo->SetMultiThreading(multiThreadingActive);
+	activeOptionIndex = 0;
 	LoadScenario(activeScenarioIndex);
 }
 
@@ -433,6 +533,213 @@ void DemoApplication::StopBenchmark() {
 	activeBenchmarkIteration = nullptr;
 }
 
+void DemoApplication::RunDispatchBenchmark() {
+	// @NOTE: The tasks do almost nothing, so the measured time is dominated by the dispatch, the call per task and the wait.
+	// A grain of one gives ParallelFor() the same min(itemCount, max chunk count) tasks as CreateTasks(), so both dispatch the same number of tasks.
+	const size_t batchCount = 2000;
+	const size_t itemCount = 4096;
+	std::vector<float> items(itemCount, 1.0f);
+	float *itemsPtr = items.data();
+
+	ThreadPool pool(fplMax(demo->GetWorkerThreadCount(), 1));
+
+	auto startClock = std::chrono::high_resolution_clock::now();
+	for (size_t batchIndex = 0; batchIndex < batchCount; ++batchIndex) {
+		pool.CreateTasks(itemCount, [=](const size_t startIndex, const size_t endIndex, const float deltaTime) {
+			for (size_t index = startIndex; index <= endIndex; ++index) {
+				itemsPtr[index] += deltaTime;
+			}
+		}, 1.0f);
+		pool.WaitUntilDone();
+	}
+	auto deltaClock = std::chrono::high_resolution_clock::now() - startClock;
+	float createTasksTime = std::chrono::duration_cast<std::chrono::nanoseconds>(deltaClock).count() / 1000.0f;
+
+	startClock = std::chrono::high_resolution_clock::now();
+	for (size_t batchIndex = 0; batchIndex < batchCount; ++batchIndex) {
+		const float deltaTime = 1.0f;
+		pool.ParallelFor(itemCount, 1, [&](const size_t startIndex, const size_t endIndex) {
+			for (size_t index = startIndex; index <= endIndex; ++index) {
+				itemsPtr[index] += deltaTime;
+			}
+		});
+	}
+	deltaClock = std::chrono::high_resolution_clock::now() - startClock;
+	float parallelForTime = std::chrono::duration_cast<std::chrono::nanoseconds>(deltaClock).count() / 1000.0f;
+
+	dispatchBenchmark.threadCount = pool.GetThreadCount();
+	dispatchBenchmark.batchCount = batchCount;
+	dispatchBenchmark.taskCount = pool.GetChunkCount(itemCount, 1);
+	dispatchBenchmark.createTasksTime = createTasksTime / (float)batchCount;
+	dispatchBenchmark.parallelForTime = parallelForTime / (float)batchCount;
+	dispatchBenchmark.isDone = true;
+}
+
+void DemoApplication::RunLayoutBenchmark() {
+	// @NOTE: Unsorted keeps the particles in insertion order, the others sort the grid every step with the given cell order
+	const int32_t gridModes[kLayoutBenchmarkLayoutCount] = { Demo4::GridMode_Incremental, Demo4::GridMode_Sorted, Demo4::GridMode_Sorted };
+	const int32_t cellOrders[kLayoutBenchmarkLayoutCount] = { Demo4::CellOrder_RowMajor, Demo4::CellOrder_RowMajor, Demo4::CellOrder_Morton };
+	for (size_t layoutIndex = 0; layoutIndex < kLayoutBenchmarkLayoutCount; ++layoutIndex) {
+		Demo4::ParticleSimulation *simulation = new Demo4::ParticleSimulation();
+		simulation->SetMultiThreading(multiThreadingActive);
+		simulation->GetOption(Demo4::SimulationOption_Grid)->value = gridModes[layoutIndex];
+		simulation->GetOption(Demo4::SimulationOption_CellOrder)->value = cellOrders[layoutIndex];
+		simulation->GetOption(Demo4::SimulationOption_SortPolicy)->value = Demo4::SortPolicy_EveryStep;
+		ApplyScenario(simulation, activeScenarioIndex);
+
+		float neighborSearchTime = 0.0f;
+		float densityAndPressureTime = 0.0f;
+		for (size_t frameIndex = 0; frameIndex < kLayoutBenchmarkFrameCount; ++frameIndex) {
+			simulation->Update(kSPHSubstepDeltaTime);
+			const SPHStatistics &stats = simulation->GetStats();
+			neighborSearchTime += stats.time.neighborSearch;
+			densityAndPressureTime += stats.time.densityAndPressure;
+		}
+		layoutBenchmark.neighborSearchTime[layoutIndex] = neighborSearchTime / (float)kLayoutBenchmarkFrameCount;
+		layoutBenchmark.densityAndPressureTime[layoutIndex] = densityAndPressureTime / (float)kLayoutBenchmarkFrameCount;
+		delete simulation;
+	}
+	layoutBenchmark.scenarioIndex = activeScenarioIndex;
+	layoutBenchmark.frameCount = kLayoutBenchmarkFrameCount;
+	layoutBenchmark.isDone = true;
+}
+
+void DemoApplication::RunKernelBenchmark() {
+	// @NOTE: Only the kernel sets the CPU supports are measured, the others would fall back to the supported one
+	const SPHKernelSet supportedKernelSet = SPHGetSupportedKernelSet();
+
+	// The scenarios have random jitter, so the errors are measured on the same step for all kernel sets
+	{
+		Demo4::ParticleSimulation *simulation = new Demo4::ParticleSimulation();
+		ApplyScenario(simulation, activeScenarioIndex);
+		simulation->Update(kSPHSubstepDeltaTime);
+		const SPHKernelParticles kernelParticles = simulation->GetKernelParticles();
+		const float deltaTime = kSPHSubstepDeltaTime;
+
+		// Force and delta errors are relative to the largest scalar one, the forces and deltas of particles at rest are close to zero
+		float maxForce = 0.0f;
+		float maxDelta = 0.0f;
+		for (size_t particleIndex = 0; particleIndex < simulation->particleCount; ++particleIndex) {
+			const Demo4::ParticleData &particleData = simulation->particleDatas[particleIndex];
+			const uint32_t *neighbors = &simulation->neighborIndices[simulation->neighborOffsets[particleIndex]];
+			const size_t neighborCount = simulation->GetNeighborCount(particleIndex);
+			Vec2f force = Vec2f();
+			kSPHKernelTables[SPHKernelSet_Scalar].viscosityForces(simulation->params, particleData.curPosition, particleData.velocity, kernelParticles, neighbors, neighborCount, &force);
+			maxForce = fplMax(maxForce, Vec2Length(force));
+			Vec2f delta = Vec2f();
+			kSPHKernelTables[SPHKernelSet_Scalar].deltas(simulation->params, particleData.curPosition, particleData.pressures, kernelParticles, neighbors, neighborCount, deltaTime, &delta);
+			maxDelta = fplMax(maxDelta, Vec2Length(delta));
+		}
+
+		for (size_t kernelSet = 0; kernelSet <= supportedKernelSet; ++kernelSet) {
+			float viscosityError = 0.0f;
+			float densityError = 0.0f;
+			float deltaError = 0.0f;
+			for (size_t particleIndex = 0; particleIndex < simulation->particleCount; ++particleIndex) {
+				const Demo4::ParticleData &particleData = simulation->particleDatas[particleIndex];
+				const Vec2f position = particleData.curPosition;
+				const uint32_t *neighbors = &simulation->neighborIndices[simulation->neighborOffsets[particleIndex]];
+				const size_t neighborCount = simulation->GetNeighborCount(particleIndex);
+				Vec2f scalarForce = Vec2f();
+				Vec2f force = Vec2f();
+				kSPHKernelTables[SPHKernelSet_Scalar].viscosityForces(simulation->params, position, particleData.velocity, kernelParticles, neighbors, neighborCount, &scalarForce);
+				kSPHKernelTables[kernelSet].viscosityForces(simulation->params, position, particleData.velocity, kernelParticles, neighbors, neighborCount, &force);
+				viscosityError = fplMax(viscosityError, Vec2Length(force - scalarForce) / fplMax(maxForce, FLT_MIN));
+
+				float scalarDensity[2] = {};
+				float density[2] = {};
+				kSPHKernelTables[SPHKernelSet_Scalar].densities(simulation->params, position, kernelParticles, neighbors, neighborCount, scalarDensity);
+				kSPHKernelTables[kernelSet].densities(simulation->params, position, kernelParticles, neighbors, neighborCount, density);
+				for (size_t index = 0; index < 2; ++index) {
+					densityError = fplMax(densityError, fabsf(density[index] - scalarDensity[index]) / fplMax(fabsf(scalarDensity[index]), 1.0f));
+				}
+
+				Vec2f scalarDelta = Vec2f();
+				Vec2f delta = Vec2f();
+				kSPHKernelTables[SPHKernelSet_Scalar].deltas(simulation->params, position, particleData.pressures, kernelParticles, neighbors, neighborCount, deltaTime, &scalarDelta);
+				kSPHKernelTables[kernelSet].deltas(simulation->params, position, particleData.pressures, kernelParticles, neighbors, neighborCount, deltaTime, &delta);
+				deltaError = fplMax(deltaError, Vec2Length(delta - scalarDelta) / fplMax(maxDelta, FLT_MIN));
+			}
+			kernelBenchmark.viscosityError[kernelSet] = viscosityError;
+			kernelBenchmark.densityError[kernelSet] = densityError;
+			kernelBenchmark.deltaError[kernelSet] = deltaError;
+		}
+		delete simulation;
+	}
+
+	for (size_t kernelSet = 0; kernelSet <= supportedKernelSet; ++kernelSet) {
+		Demo4::ParticleSimulation *simulation = new Demo4::ParticleSimulation();
+		simulation->SetMultiThreading(multiThreadingActive);
+		simulation->GetOption(Demo4::SimulationOption_Kernels)->value = (int32_t)kernelSet;
+		simulation->GetOption(Demo4::SimulationOption_Solver)->value = Demo4::SolverMode_Gather;
+		ApplyScenario(simulation, activeScenarioIndex);
+
+		float viscosityForcesTime = 0.0f;
+		float densityAndPressureTime = 0.0f;
+		float deltaPositionsTime = 0.0f;
+		for (size_t frameIndex = 0; frameIndex < kKernelBenchmarkFrameCount; ++frameIndex) {
+			simulation->Update(kSPHSubstepDeltaTime);
+			const SPHStatistics &stats = simulation->GetStats();
+			viscosityForcesTime += stats.time.viscosityForces;
+			densityAndPressureTime += stats.time.densityAndPressure;
+			deltaPositionsTime += stats.time.deltaPositions;
+		}
+		kernelBenchmark.viscosityForcesTime[kernelSet] = viscosityForcesTime / (float)kKernelBenchmarkFrameCount;
+		kernelBenchmark.densityAndPressureTime[kernelSet] = densityAndPressureTime / (float)kKernelBenchmarkFrameCount;
+		kernelBenchmark.deltaPositionsTime[kernelSet] = deltaPositionsTime / (float)kKernelBenchmarkFrameCount;
+		delete simulation;
+	}
+	kernelBenchmark.scenarioIndex = activeScenarioIndex;
+	kernelBenchmark.frameCount = kKernelBenchmarkFrameCount;
+	kernelBenchmark.supportedKernelSet = supportedKernelSet;
+	kernelBenchmark.isDone = true;
+}
+
+void DemoApplication::RunStorageBenchmark() {
+	const SPHKernelSet kernelSet = SPHGetSupportedKernelSet();
+	const int32_t storageModes[kStorageBenchmarkStorageCount] = { 0, Demo5::StorageMode_Arrays, Demo5::StorageMode_Arrays, Demo5::StorageMode_Blocks };
+	const int32_t neighborModes[kStorageBenchmarkStorageCount] = { 0, Demo5::NeighborMode_Lists, Demo5::NeighborMode_Ranges, Demo5::NeighborMode_Ranges };
+	for (size_t storageIndex = 0; storageIndex < kStorageBenchmarkStorageCount; ++storageIndex) {
+		// @NOTE: Demo 4 sorts the grid every step too, so all storages are in cell order
+		BaseSimulation *simulation;
+		if (storageIndex == 0) {
+			Demo4::ParticleSimulation *aosSimulation = new Demo4::ParticleSimulation();
+			aosSimulation->GetOption(Demo4::SimulationOption_Solver)->value = Demo4::SolverMode_Gather;
+			aosSimulation->GetOption(Demo4::SimulationOption_Grid)->value = Demo4::GridMode_Sorted;
+			aosSimulation->GetOption(Demo4::SimulationOption_SortPolicy)->value = Demo4::SortPolicy_EveryStep;
+			aosSimulation->GetOption(Demo4::SimulationOption_Kernels)->value = (int32_t)kernelSet;
+			simulation = aosSimulation;
+		} else {
+			Demo5::ParticleSimulation *soaSimulation = new Demo5::ParticleSimulation();
+			soaSimulation->GetOption(Demo5::SimulationOption_Storage)->value = storageModes[storageIndex];
+			soaSimulation->GetOption(Demo5::SimulationOption_Neighbors)->value = neighborModes[storageIndex];
+			soaSimulation->GetOption(Demo5::SimulationOption_Kernels)->value = (int32_t)kernelSet;
+			simulation = soaSimulation;
+		}
+		simulation->SetMultiThreading(multiThreadingActive);
+		ApplyScenario(simulation, activeScenarioIndex);
+
+		float neighborSearchTime = 0.0f;
+		float densityAndPressureTime = 0.0f;
+		float deltaPositionsTime = 0.0f;
+		for (size_t frameIndex = 0; frameIndex < kStorageBenchmarkFrameCount; ++frameIndex) {
+			simulation->Update(kSPHSubstepDeltaTime);
+			const SPHStatistics &stats = simulation->GetStats();
+			neighborSearchTime += stats.time.neighborSearch;
+			densityAndPressureTime += stats.time.densityAndPressure;
+			deltaPositionsTime += stats.time.deltaPositions;
+		}
+		storageBenchmark.neighborSearchTime[storageIndex] = neighborSearchTime / (float)kStorageBenchmarkFrameCount;
+		storageBenchmark.densityAndPressureTime[storageIndex] = densityAndPressureTime / (float)kStorageBenchmarkFrameCount;
+		storageBenchmark.deltaPositionsTime[storageIndex] = deltaPositionsTime / (float)kStorageBenchmarkFrameCount;
+		delete simulation;
+	}
+	storageBenchmark.scenarioIndex = activeScenarioIndex;
+	storageBenchmark.frameCount = kStorageBenchmarkFrameCount;
+	storageBenchmark.kernelSet = kernelSet;
+	storageBenchmark.isDone = true;
+}
+
 void DemoApplication::KeyDown(const fplKey key) {
 	if (!benchmarkActive) {
 		if (!benchmarkDone && simulationActive) {
@@ -455,7 +762,7 @@ void DemoApplication::KeyUp(const fplKey key) {
 			} else if (key == fplKey_P) {
 				simulationActive = !simulationActive;
 			} else if (key == fplKey_D) {
-				demoIndex = (demoIndex + 1) % 4;
+				demoIndex = (demoIndex + 1) % kDemoCount;
 				simulationActive = true;
 				LoadDemo(demoIndex);
 			} else if (key == fplKey_R) {
@@ -465,6 +772,19 @@ void DemoApplication::KeyUp(const fplKey key) {
 				demo->SetMultiThreading(multiThreadingActive);
 			} else if (key == fplKey_B) {
 				StartBenchmark();
+			} else if (key == fplKey_M) {
+				RunDispatchBenchmark();
+			} else if (key == fplKey_L) {
+				RunLayoutBenchmark();
+			} else if (key == fplKey_K) {
+				RunKernelBenchmark();
+			} else if (key == fplKey_S) {
+				RunStorageBenchmark();
+			} else if (key == fplKey_O && demo->GetOptionCount() > 0) {
+				activeOptionIndex = (activeOptionIndex + 1) % demo->GetOptionCount();
+			} else if (key == fplKey_V && demo->GetOptionCount() > 0) {
+				SPHOption *option = demo->GetOption(activeOptionIndex);
+				option->value = (option->value + 1) % option->valueCount;
 			}
 		}
 	} else {
@@ -475,14 +795,18 @@ void DemoApplication::KeyUp(const fplKey key) {
 }
 
 void DemoApplication::LoadScenario(size_t scenarioIndex) {
+	activeScenarioName = SPHScenarios[scenarioIndex].name;
+	ApplyScenario(demo, scenarioIndex);
+}
+
+void DemoApplication::ApplyScenario(BaseSimulation *simulation, const size_t scenarioIndex) {
 	SPHScenario *scenario = &SPHScenarios[scenarioIndex];
-	activeScenarioName = scenario->name;
-	demo->ResetStats();
-	demo->ClearBodies();
-	demo->ClearParticles();
-	demo->ClearEmitters();
-	demo->SetGravity(scenario->gravity);
-	demo->SetParams(scenario->parameters);
+	simulation->ResetStats();
+	simulation->ClearBodies();
+	simulation->ClearParticles();
+	simulation->ClearEmitters();
+	simulation->SetGravity(scenario->gravity);
+	simulation->SetParams(scenario->parameters);
 
 	// Bodies
 	for (size_t bodyIndex = 0; bodyIndex < scenario->bodyCount; ++bodyIndex) {
@@ -491,18 +815,18 @@ void DemoApplication::LoadScenario(size_t scenarioIndex) {
 			case SPHScenarioBodyType::SPHScenarioBodyType_Plane:
 			{
 				float distance = Vec2Dot(body->orientation.col1, body->position);
-				demo->AddPlane(body->orientation.col1, distance);
+				simulation->AddPlane(body->orientation.col1, distance);
 			} break;
 			case SPHScenarioBodyType::SPHScenarioBodyType_Circle:
 			{
-				demo->AddCircle(body->position, body->radius);
+				simulation->AddCircle(body->position, body->radius);
 			} break;
 			case SPHScenarioBodyType::SPHScenarioBodyType_LineSegment:
 			{
 				assert(body->vertexCount == 2);
 				Vec2f a = Vec2MultMat2(body->orientation, body->localVerts[0]) + body->position;
 				Vec2f b = Vec2MultMat2(body->orientation, body->localVerts[1]) + body->position;
-				demo->AddLineSegment(a, b);
+				simulation->AddLineSegment(a, b);
 			} break;
 			case SPHScenarioBodyType::SPHScenarioBodyType_Polygon:
 			{
@@ -511,25 +835,30 @@ void DemoApplication::LoadScenario(size_t scenarioIndex) {
 				for (size_t vertexIndex = 0; vertexIndex < body->vertexCount; ++vertexIndex) {
 					verts[vertexIndex] = Vec2MultMat2(body->orientation, body->localVerts[vertexIndex]) + body->position;
 				}
-				demo->AddPolygon(body->vertexCount, verts);
+				simulation->AddPolygon(body->vertexCount, verts);
+			} break;
+			case SPHScenarioBodyType::SPHScenarioBodyType_Sink:
+			{
+				assert(body->vertexCount == 2);
+				simulation->AddSink(body->position + body->localVerts[0], body->position + body->localVerts[1]);
 			} break;
 		}
 	}
 
 	// Volumes
-	const SPHParameters &params = demo->GetParams();
+	const SPHParameters &params = simulation->GetParams();
 	const float spacing = params.particleSpacing;
 	for (size_t volumeIndex = 0; volumeIndex < scenario->bodyCount; ++volumeIndex) {
 		SPHScenarioVolume *volume = &scenario->volumes[volumeIndex];
 		int numX = (int)floor((volume->size.w / spacing));
 		int numY = (int)floor((volume->size.h / spacing));
-		demo->AddVolume(volume->position, volume->force, numX, numY, spacing);
+		simulation->AddVolume(volume->position, volume->force, numX, numY, spacing);
 	}
 
 	// Emitters
 	for (size_t emitterIndex = 0; emitterIndex < scenario->emitterCount; ++emitterIndex) {
 		SPHScenarioEmitter *emitter = &scenario->emitters[emitterIndex];
-		demo->AddEmitter(emitter->position, emitter->direction, emitter->radius, emitter->speed, emitter->rate, emitter->duration);
+		simulation->AddEmitter(emitter->position, emitter->direction, emitter->radius, emitter->speed, emitter->rate, emitter->duration);
 	}
 }
 
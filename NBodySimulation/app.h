@@ -16,7 +16,7 @@
 
 const int kWindowWidth = 1280;
 const int kWindowHeight = 720;
-const char *kAppVersion = "1.4.4";
+const char *kAppVersion = "1.5.0";
 
 #define VERY_SHORT_BENCHMARK 0
 
@@ -27,7 +27,7 @@ const size_t kBenchmarkIterationCount = 16;
 const size_t kBenchmarkFrameCount = 16;
 const size_t kBenchmarkIterationCount = 16;
 #endif
-const size_t kDemoCount = 4;
+const size_t kDemoCount = 5;
 
 struct Window {
 	int left, top;
@@ -102,6 +102,59 @@ struct DemoStatistics {
 	FrameStatistics avg;
 };
 
+// Average cost in microseconds to dispatch and wait for one batch of near-empty tasks
+struct DispatchBenchmark {
+	size_t threadCount;
+	size_t batchCount;
+	size_t taskCount;
+	float createTasksTime;
+	float parallelForTime;
+	bool isDone;
+};
+
+// Average time in ms of the cache sensitive phases of Demo 4 for each particle layout, every layout runs the same scenario from the start
+const size_t kLayoutBenchmarkFrameCount = 120;
+const size_t kLayoutBenchmarkLayoutCount = 3;
+const char *const kLayoutBenchmarkLayoutNames[kLayoutBenchmarkLayoutCount] = { "Unsorted", "Row major", "Morton" };
+struct LayoutBenchmark {
+	size_t scenarioIndex;
+	size_t frameCount;
+	float neighborSearchTime[kLayoutBenchmarkLayoutCount];
+	float densityAndPressureTime[kLayoutBenchmarkLayoutCount];
+	bool isDone;
+};
+
+// Average time in ms of the Demo 4 phases with SIMD kernels for each kernel set, every kernel set runs the same scenario from the start with the gather solver.
+// The errors are the largest relative differences of the viscosity forces, the densities and the delta positions to the scalar kernels, for the neighbors after the first step.
+const size_t kKernelBenchmarkFrameCount = 120;
+struct KernelBenchmark {
+	size_t scenarioIndex;
+	size_t frameCount;
+	SPHKernelSet supportedKernelSet;
+	float viscosityForcesTime[SPHKernelSet_Count];
+	float densityAndPressureTime[SPHKernelSet_Count];
+	float deltaPositionsTime[SPHKernelSet_Count];
+	float viscosityError[SPHKernelSet_Count];
+	float densityError[SPHKernelSet_Count];
+	float deltaError[SPHKernelSet_Count];
+	bool isDone;
+};
+
+// Average time in ms of the neighbor phases for each particle storage with the best supported kernels and the gather solver, every storage runs the same scenario from the start.
+// Demo 4 is the array of structures, the others are Demo 5 with separate arrays or blocks of 8 particles.
+const size_t kStorageBenchmarkFrameCount = 120;
+const size_t kStorageBenchmarkStorageCount = 4;
+const char *const kStorageBenchmarkStorageNames[kStorageBenchmarkStorageCount] = { "AoS", "SoA cell lists", "SoA cell ranges", "AoSoA blocks" };
+struct StorageBenchmark {
+	size_t scenarioIndex;
+	size_t frameCount;
+	SPHKernelSet kernelSet;
+	float neighborSearchTime[kStorageBenchmarkStorageCount];
+	float densityAndPressureTime[kStorageBenchmarkStorageCount];
+	float deltaPositionsTime[kStorageBenchmarkStorageCount];
+	bool isDone;
+};
+
 struct OSDState {
 	float x;
 	float y;
@@ -129,6 +182,12 @@ struct DemoApplication : public Application {
 	std::string activeScenarioName;
 
 	bool multiThreadingActive;
+	size_t activeOptionIndex;
+
+	DispatchBenchmark dispatchBenchmark;
+	LayoutBenchmark layoutBenchmark;
+	KernelBenchmark kernelBenchmark;
+	StorageBenchmark storageBenchmark;
 
 	Font osdFont;
 	Render::TextureHandle osdFontTexture;
@@ -140,6 +199,10 @@ struct DemoApplication : public Application {
 	void PushDemoStatistics();
 	void StartBenchmark();
 	void StopBenchmark();
+	void RunDispatchBenchmark();
+	void RunLayoutBenchmark();
+	void RunKernelBenchmark();
+	void RunStorageBenchmark();
 
 	void DrawOSDLine(OSDState *osdState, const char *str);
 
@@ -152,6 +215,7 @@ struct DemoApplication : public Application {
 	void KeyUp(const fplKey key);
 	void KeyDown(const fplKey key);
 	void LoadScenario(size_t scenarioIndex);
+	static void ApplyScenario(BaseSimulation *simulation, const size_t scenarioIndex);
 };
 
 #endif
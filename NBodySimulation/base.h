@@ -7,6 +7,8 @@
 
 class BaseSimulation {
 public:
+	virtual ~BaseSimulation() {}
+
 	virtual void ResetStats() = 0;
 	virtual void ClearBodies() = 0;
 	virtual void ClearParticles() = 0;
@@ -16,10 +18,13 @@ public:
 	virtual void AddCircle(const Vec2f &pos, const float radius) = 0;
 	virtual void AddLineSegment(const Vec2f &a, const Vec2f &b) = 0;
 	virtual void AddPolygon(const size_t vertexCount, const Vec2f *verts) = 0;
+	virtual void AddSink(const Vec2f &min, const Vec2f &max) = 0;
 
 	virtual size_t AddParticle(const Vec2f &position, const Vec2f &force) = 0;
 	virtual void AddVolume(const Vec2f &center, const Vec2f &force, const int countX, const int countY, const float spacing) = 0;
 	virtual void AddEmitter(const Vec2f &position, const Vec2f &direction, const float radius, const float speed, const float rate, const float duration) = 0;
+	// Marks the particle as removed, it stays in the simulation until the next compaction
+	virtual void RemoveParticle(const size_t particleIndex) = 0;
 
 	virtual void Update(const float deltaTime) = 0;
 	virtual void Render(Render::CommandBuffer *commandBuffer, const float worldToScreenScale) = 0;
@@ -34,8 +39,11 @@ public:
 	virtual void SetParams(const SPHParameters &params) = 0;
 	virtual void SetMultiThreading(const bool value) = 0;
 	virtual bool IsMultiThreadingSupported() = 0;
+	virtual bool IsParticleRemovalSupported() = 0;
 	virtual bool IsMultiThreading() = 0;
 	virtual size_t GetWorkerThreadCount() = 0;
+	virtual size_t GetOptionCount() = 0;
+	virtual SPHOption *GetOption(const size_t index) = 0;
 };
 
 #endif
@@ -349,6 +349,10 @@ namespace Demo1 {
 	void ParticleSimulation::Update(const float deltaTime) {
 		const float invDt = 1.0f / deltaTime;
 		const bool useMultiThreading = _isMultiThreading;
+		_stats.waitTime = {};
+		const size_t barrierCount = _workerPool->GetBarrierCount();
+		const double parallelTime = _workerPool->GetParallelTime();
+		auto updateStartClock = std::chrono::high_resolution_clock::now();
 
 		// Emitters
 		{
@@ -377,10 +381,9 @@ namespace Demo1 {
 		{
 			auto startClock = std::chrono::high_resolution_clock::now();
 			if (useMultiThreading) {
-				_workerPool->CreateTasks(_particles.size(), [=](const size_t startIndex, const size_t endIndex, const float deltaTime) {
+				_stats.waitTime.viscosityForces = _workerPool->ParallelFor(_particles.size(), kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
 					this->ViscosityForces(startIndex, endIndex, deltaTime);
-				}, deltaTime);
-				_workerPool->WaitUntilDone();
+				}).waitTime;
 			} else {
 				this->ViscosityForces(0, _particles.size() - 1, deltaTime);
 			}
@@ -419,10 +422,9 @@ namespace Demo1 {
 		{
 			auto startClock = std::chrono::high_resolution_clock::now();
 			if (useMultiThreading) {
-				_workerPool->CreateTasks(_particles.size(), [=](const size_t startIndex, const size_t endIndex, const float deltaTime) {
+				_stats.waitTime.neighborSearch = _workerPool->ParallelFor(_particles.size(), kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
 					this->NeighborSearch(startIndex, endIndex, deltaTime);
-				}, deltaTime);
-				_workerPool->WaitUntilDone();
+				}).waitTime;
 			} else {
 				this->NeighborSearch(0, _particles.size() - 1, deltaTime);
 			}
@@ -441,10 +443,9 @@ namespace Demo1 {
 		{
 			auto startClock = std::chrono::high_resolution_clock::now();
 			if (useMultiThreading) {
-				_workerPool->CreateTasks(_particles.size(), [=](const size_t startIndex, const size_t endIndex, const float deltaTime) {
+				_stats.waitTime.densityAndPressure = _workerPool->ParallelFor(_particles.size(), kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
 					this->DensityAndPressure(startIndex, endIndex, deltaTime);
-				}, deltaTime);
-				_workerPool->WaitUntilDone();
+				}).waitTime;
 			} else {
 				this->DensityAndPressure(0, _particles.size() - 1, deltaTime);
 			}
@@ -456,10 +457,9 @@ namespace Demo1 {
 		{
 			auto startClock = std::chrono::high_resolution_clock::now();
 			if (useMultiThreading) {
-				_workerPool->CreateTasks(_particles.size(), [=](const size_t startIndex, const size_t endIndex, const float deltaTime) {
+				_stats.waitTime.deltaPositions = _workerPool->ParallelFor(_particles.size(), kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
 					this->DeltaPositions(startIndex, endIndex, deltaTime);
-				}, deltaTime);
-				_workerPool->WaitUntilDone();
+				}).waitTime;
 			} else {
 				this->DeltaPositions(0, _particles.size() - 1, deltaTime);
 			}
@@ -486,6 +486,11 @@ namespace Demo1 {
 			Particle *particle = _particles[particleIndex];
 			particle->UpdateVelocity(invDt);
 		}
+
+		_stats.barrierCount = _workerPool->GetBarrierCount() - barrierCount;
+		auto updateDeltaClock = std::chrono::high_resolution_clock::now() - updateStartClock;
+		float updateTime = std::chrono::duration_cast<std::chrono::nanoseconds>(updateDeltaClock).count() * nanosToMilliseconds;
+		_stats.serialFraction = SPHComputeSerialFraction(updateTime, (float)(_workerPool->GetParallelTime() - parallelTime));
 	}
 
 	void ParticleSimulation::Render(Render::CommandBuffer *commandBuffer, const float worldToScreenScale) {
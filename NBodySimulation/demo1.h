@@ -269,12 +269,26 @@ namespace Demo1 {
 		bool IsMultiThreadingSupported() {
 			return true;
 		}
+		// @NOTE: Sinks and particle removal are not supported, particles are only removed by clearing them all
+		void AddSink(const Vec2f &min, const Vec2f &max) {
+		}
+		void RemoveParticle(const size_t particleIndex) {
+		}
+		bool IsParticleRemovalSupported() {
+			return false;
+		}
 		bool IsMultiThreading() {
 			return _isMultiThreading;
 		}
 		size_t GetWorkerThreadCount() {
 			return _workerPool->GetThreadCount();
 		}
+		size_t GetOptionCount() {
+			return 0;
+		}
+		SPHOption *GetOption(const size_t index) {
+			return nullptr;
+		}
 	};
 };
 
@@ -11,7 +11,7 @@
 namespace Demo2 {
 	ParticleSimulation::ParticleSimulation() :
 		_gravity(Vec2f(0, 0)) {
-		_particles.reserve(kSPHMaxParticleCount);
+		_particles.reserve(kSPHInitialParticleCapacity);
 		_isMultiThreading = _workerPool.GetThreadCount() > 1;
 		_cells.resize(kSPHGridTotalCount);
 		for (size_t cellIndex = 0; cellIndex < kSPHGridTotalCount; ++cellIndex) {
@@ -242,6 +242,10 @@ namespace Demo2 {
 	void ParticleSimulation::Update(const float deltaTime) {
 		const float invDt = 1.0f / deltaTime;
 		const bool useMultiThreading = _isMultiThreading;
+		_stats.waitTime = {};
+		const size_t barrierCount = _workerPool.GetBarrierCount();
+		const double parallelTime = _workerPool.GetParallelTime();
+		auto updateStartClock = std::chrono::high_resolution_clock::now();
 
 		// Emitters
 		{
@@ -271,10 +275,9 @@ namespace Demo2 {
 		{
 			auto startClock = std::chrono::high_resolution_clock::now();
 			if (useMultiThreading) {
-				_workerPool.CreateTasks(_particles.size(), [=](const size_t startIndex, const size_t endIndex, const float deltaTime) {
+				_stats.waitTime.viscosityForces = _workerPool.ParallelFor(_particles.size(), kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
 					this->ViscosityForces(startIndex, endIndex, deltaTime);
-				}, deltaTime);
-				_workerPool.WaitUntilDone();
+				}).waitTime;
 			} else {
 				this->ViscosityForces(0, _particles.size() - 1, deltaTime);
 			}
@@ -314,10 +317,9 @@ namespace Demo2 {
 		{
 			auto startClock = std::chrono::high_resolution_clock::now();
 			if (useMultiThreading) {
-				_workerPool.CreateTasks(_particles.size(), [=](const size_t startIndex, const size_t endIndex, const float deltaTime) {
+				_stats.waitTime.neighborSearch = _workerPool.ParallelFor(_particles.size(), kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
 					this->NeighborSearch(startIndex, endIndex, deltaTime);
-				}, deltaTime);
-				_workerPool.WaitUntilDone();
+				}).waitTime;
 			} else {
 				this->NeighborSearch(0, _particles.size() - 1, deltaTime);
 			}
@@ -337,10 +339,9 @@ namespace Demo2 {
 		{
 			auto startClock = std::chrono::high_resolution_clock::now();
 			if (useMultiThreading) {
-				_workerPool.CreateTasks(_particles.size(), [=](const size_t startIndex, const size_t endIndex, const float deltaTime) {
+				_stats.waitTime.densityAndPressure = _workerPool.ParallelFor(_particles.size(), kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
 					this->DensityAndPressure(startIndex, endIndex, deltaTime);
-				}, deltaTime);
-				_workerPool.WaitUntilDone();
+				}).waitTime;
 			} else {
 				this->DensityAndPressure(0, _particles.size(), deltaTime);
 			}
@@ -352,10 +353,9 @@ namespace Demo2 {
 		{
 			auto startClock = std::chrono::high_resolution_clock::now();
 			if (useMultiThreading) {
-				_workerPool.CreateTasks(_particles.size(), [=](const size_t startIndex, const size_t endIndex, const float deltaTime) {
+				_stats.waitTime.deltaPositions = _workerPool.ParallelFor(_particles.size(), kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
 					this->DeltaPositions(startIndex, endIndex, deltaTime);
-				}, deltaTime);
-				_workerPool.WaitUntilDone();
+				}).waitTime;
 			} else {
 				this->DeltaPositions(0, _particles.size() - 1, deltaTime);
 			}
@@ -382,6 +382,11 @@ namespace Demo2 {
 			Particle &particle = _particles[particleIndex];
 			particle.velocity = (particle.curPosition - particle.prevPosition) * invDt;
 		}
+
+		_stats.barrierCount = _workerPool.GetBarrierCount() - barrierCount;
+		auto updateDeltaClock = std::chrono::high_resolution_clock::now() - updateStartClock;
+		float updateTime = std::chrono::duration_cast<std::chrono::nanoseconds>(updateDeltaClock).count() * nanosToMilliseconds;
+		_stats.serialFraction = SPHComputeSerialFraction(updateTime, (float)(_workerPool.GetParallelTime() - parallelTime));
 	}
 
 	void ParticleSimulation::Render(Render::CommandBuffer *commandBuffer, const float worldToScreenScale) {
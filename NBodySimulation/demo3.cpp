@@ -12,7 +12,7 @@
 namespace Demo3 {
 	ParticleSimulation::ParticleSimulation() :
 		gravity(Vec2f(0, 0)) {
-		particles.reserve(kSPHMaxParticleCount);
+		particles.reserve(kSPHInitialParticleCapacity);
 		cells = new Cell[kSPHGridTotalCount];
 		_isMultiThreading = workerPool.GetThreadCount() > 1;
 	}
@@ -21,7 +21,7 @@ namespace Demo3 {
 		for (size_t bodyIndex = 0; bodyIndex < bodies.size(); ++bodyIndex) {
 			delete bodies[bodyIndex];
 		}
-		delete cells;
+		delete[] cells;
 	}
 
 	void ParticleSimulation::InsertParticleIntoGrid(Particle &particle, const size_t particleIndex) {
@@ -233,6 +233,10 @@ namespace Demo3 {
 	void ParticleSimulation::Update(const float deltaTime) {
 		const float invDt = 1.0f / deltaTime;
 		const bool useMultiThreading = _isMultiThreading;
+		stats.waitTime = {};
+		const size_t barrierCount = workerPool.GetBarrierCount();
+		const double parallelTime = workerPool.GetParallelTime();
+		auto updateStartClock = std::chrono::high_resolution_clock::now();
 
 		// Emitters
 		{
@@ -262,10 +266,9 @@ namespace Demo3 {
 		{
 			auto startClock = std::chrono::high_resolution_clock::now();
 			if (useMultiThreading) {
-				workerPool.CreateTasks(particles.size(), [=](const size_t startIndex, const size_t endIndex, const float deltaTime) {
+				stats.waitTime.viscosityForces = workerPool.ParallelFor(particles.size(), kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
 					this->ViscosityForces(startIndex, endIndex, deltaTime);
-				}, deltaTime);
-				workerPool.WaitUntilDone();
+				}).waitTime;
 			} else {
 				this->ViscosityForces(0, particles.size() - 1, deltaTime);
 			}
@@ -305,10 +308,9 @@ namespace Demo3 {
 		{
 			auto startClock = std::chrono::high_resolution_clock::now();
 			if (useMultiThreading) {
-				workerPool.CreateTasks(particles.size(), [=](const size_t startIndex, const size_t endIndex, const float deltaTime) {
+				stats.waitTime.neighborSearch = workerPool.ParallelFor(particles.size(), kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
 					this->NeighborSearch(startIndex, endIndex, deltaTime);
-				}, deltaTime);
-				workerPool.WaitUntilDone();
+				}).waitTime;
 			} else {
 				this->NeighborSearch(0, particles.size() - 1, deltaTime);
 			}
@@ -328,10 +330,9 @@ namespace Demo3 {
 		{
 			auto startClock = std::chrono::high_resolution_clock::now();
 			if (useMultiThreading) {
-				workerPool.CreateTasks(particles.size(), [=](const size_t startIndex, const size_t endIndex, const float deltaTime) {
+				stats.waitTime.densityAndPressure = workerPool.ParallelFor(particles.size(), kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
 					this->DensityAndPressure(startIndex, endIndex, deltaTime);
-				}, deltaTime);
-				workerPool.WaitUntilDone();
+				}).waitTime;
 			} else {
 				this->DensityAndPressure(0, particles.size(), deltaTime);
 			}
@@ -343,10 +344,9 @@ namespace Demo3 {
 		{
 			auto startClock = std::chrono::high_resolution_clock::now();
 			if (useMultiThreading) {
-				workerPool.CreateTasks(particles.size(), [=](const size_t startIndex, const size_t endIndex, const float deltaTime) {
+				stats.waitTime.deltaPositions = workerPool.ParallelFor(particles.size(), kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
 					this->DeltaPositions(startIndex, endIndex, deltaTime);
-				}, deltaTime);
-				workerPool.WaitUntilDone();
+				}).waitTime;
 			} else {
 				this->DeltaPositions(0, particles.size() - 1, deltaTime);
 			}
@@ -394,6 +394,11 @@ namespace Demo3 {
 			Particle &particle = particles[particleIndex];
 			particle.velocity = (particle.curPosition - particle.prevPosition) * invDt;
 		}
+
+		stats.barrierCount = workerPool.GetBarrierCount() - barrierCount;
+		auto updateDeltaClock = std::chrono::high_resolution_clock::now() - updateStartClock;
+		float updateTime = std::chrono::duration_cast<std::chrono::nanoseconds>(updateDeltaClock).count() * nanosToMilliseconds;
+		stats.serialFraction = SPHComputeSerialFraction(updateTime, (float)(workerPool.GetParallelTime() - parallelTime));
 	}
 
 	void ParticleSimulation::Render(Render::CommandBuffer *commandBuffer, const float worldToScreenScale) {
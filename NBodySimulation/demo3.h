@@ -211,12 +211,26 @@ namespace Demo3 {
 		inline bool IsMultiThreadingSupported() {
 			return true;
 		}
+		// @NOTE: Sinks and particle removal are not supported, particles are only removed by clearing them all
+		inline void AddSink(const Vec2f &min, const Vec2f &max) {
+		}
+		inline void RemoveParticle(const size_t particleIndex) {
+		}
+		inline bool IsParticleRemovalSupported() {
+			return false;
+		}
 		inline bool IsMultiThreading() {
 			return _isMultiThreading;
 		}
 		inline size_t GetWorkerThreadCount() {
 			return workerPool.GetThreadCount();
 		}
+		inline size_t GetOptionCount() {
+			return 0;
+		}
+		inline SPHOption *GetOption(const size_t index) {
+			return nullptr;
+		}
 	};
 };
 
@@ -14,35 +14,366 @@ namespace Demo4 {
 	ParticleSimulation::ParticleSimulation() :
 		gravity(Vec2f(0, 0)),
 		particleCount(0),
+		particleCapacity(0),
+		particleDatas(nullptr),
+		sortedParticleDatas(nullptr),
+		sortedParticleColors(nullptr),
+		sortedRemovedParticles(nullptr),
+		sortedNeighborBuildPositions(nullptr),
+		particleIndexes(nullptr),
+		particleColors(nullptr),
+		particleDeltas(nullptr),
+		removedParticles(nullptr),
+		removedParticleCount(0),
+		neighborOffsets(nullptr),
+		neighborIndices(nullptr),
+		neighborCapacity(0),
+		neighborDistances(nullptr),
+		neighborNormals(nullptr),
+		neighborPairCapacity(0),
+		hasNeighborPairs(false),
+		halfNeighborPairs(false),
+		neighborRadius(0.0f),
+		neighborSkin(0.0f),
+		neighborCellRadius(1),
+		neighborParticleCount(0),
+		neighborListsInvalid(true),
+		neighborBuildPositions(nullptr),
+		maxNeighborDisplacementSquared(0),
 		bodyCount(0),
-		emitterCount(0) {
-		cells = new Cell[kSPHGridTotalCount];
-		particleDatas = new ParticleData[kSPHMaxParticleCount];
-		particleIndexes = new ParticleIndex[kSPHMaxParticleCount];
-		particleColors = new Vec4f[kSPHMaxParticleCount];
+		bodyCellOffsets(nullptr),
+		bodyCellIndices(nullptr),
+		bodyCellIndexCapacity(0),
+		bodyCellsInvalid(true),
+		bodyTypesInvalid(true),
+		distanceField(),
+		distanceFieldInvalid(true),
+		emitterCount(0),
+		grid(),
+		cells(nullptr),
+		cellCount(0),
+		cellCapacity(0),
+		cellSlots(nullptr),
+		cellSlotCount(0),
+		isHashedGrid(false),
+		cellParticleRanges(nullptr),
+		particleCellRanks(nullptr),
+		chunkCellCounts(nullptr),
+		cellStarts(nullptr),
+		sortedCellOrder(-1),
+		stepsSinceGridSort(0),
+		cellColorCount(0),
+		colorCellRadius(0),
+		cellColorsInvalid(true) {
+		for (size_t cellOrder = 0; cellOrder < CellOrder_Count; ++cellOrder) {
+			cellRanks[cellOrder] = nullptr;
+			rankCells[cellOrder] = nullptr;
+		}
+		for (size_t colorIndex = 0; colorIndex < kMaxCellColorCount; ++colorIndex) {
+			colorCells[colorIndex] = nullptr;
+			colorCellCounts[colorIndex] = 0;
+		}
+		ReserveParticles(kSPHInitialParticleCapacity);
+		neighborOffsets[0] = 0;
 		bodies = new Body[kSPHMaxBodyCount];
+		bodyTypeIndices = new uint32_t[kSPHMaxBodyCount];
+		kernelPlanes = new SPHKernelPlane[kSPHMaxBodyCount];
+		distanceField.origin = kSPHGridOrigin - Vec2f(kDistanceFieldBorder);
+		distanceField.spacing = kDistanceFieldSpacing;
+		distanceField.invSpacing = 1.0f / kDistanceFieldSpacing;
+		distanceField.countX = (int)ceilf((kSPHBoundaryWidth + kDistanceFieldBorder * 2.0f) / kDistanceFieldSpacing) + 1;
+		distanceField.countY = (int)ceilf((kSPHBoundaryHeight + kDistanceFieldBorder * 2.0f) / kDistanceFieldSpacing) + 1;
 		emitters = new ParticleEmitter[kSPHMaxEmitterCount];
 		isMultiThreading = workerPool.GetThreadCount() > 1;
+		taskGraph = new ThreadPoolGraph();
+		supportedKernelSet = SPHGetSupportedKernelSet();
+		kernels = &kSPHKernelTables[SPHKernelSet_Scalar];
+
+		options[SimulationOption_TaskGraph] = { "Task graph", kSPHOptionBooleanNames, fplArrayCount(kSPHOptionBooleanNames), 0 };
+		options[SimulationOption_ParallelPasses] = { "Parallel integrate, predict and collisions", kSPHOptionBooleanNames, fplArrayCount(kSPHOptionBooleanNames), 1 };
+		options[SimulationOption_Solver] = { "Solver", kSolverModeNames, fplArrayCount(kSolverModeNames), SolverMode_Scatter };
+		options[SimulationOption_Grid] = { "Grid", kGridModeNames, fplArrayCount(kGridModeNames), GridMode_Incremental };
+		options[SimulationOption_CellOrder] = { "Cell order", kCellOrderNames, fplArrayCount(kCellOrderNames), CellOrder_RowMajor };
+		options[SimulationOption_SortPolicy] = { "Grid sort", kSortPolicyNames, fplArrayCount(kSortPolicyNames), SortPolicy_EveryStep };
+		options[SimulationOption_NeighborList] = { "Neighbor list", kNeighborModeNames, fplArrayCount(kNeighborModeNames), NeighborMode_Cells };
+		options[SimulationOption_NeighborSkin] = { "Neighbor skin", kNeighborSkinNames, fplArrayCount(kNeighborSkinNames), 0 };
+		options[SimulationOption_Kernels] = { "Kernels", kSPHKernelSetNames, fplArrayCount(kSPHKernelSetNames), SPHKernelSet_Scalar };
+		options[SimulationOption_CellSize] = { "Cell size", kCellSizeNames, fplArrayCount(kCellSizeNames), 0 };
+		options[SimulationOption_Collisions] = { "Collisions", kCollisionModeNames, fplArrayCount(kCollisionModeNames), CollisionMode_BodyCells };
+		options[SimulationOption_ContinuousCollisions] = { "Continuous collisions", kSPHOptionBooleanNames, fplArrayCount(kSPHOptionBooleanNames), 0 };
+		options[SimulationOption_GatherRelaxation] = { "Gather relaxation", kSPHGatherRelaxationNames, fplArrayCount(kSPHGatherRelaxationNames), kSPHDefaultGatherRelaxation };
+		UpdateGridSize();
 	}
 
 	ParticleSimulation::~ParticleSimulation() {
-		delete emitters;
-		delete bodies;
-		delete particleColors;
-		delete particleIndexes;
-		delete particleDatas;
-		delete cells;
+		delete[] emitters;
+		delete[] distanceField.gradientsY;
+		delete[] distanceField.gradientsX;
+		delete[] distanceField.distances;
+		delete[] kernelPlanes;
+		delete[] bodyTypeIndices;
+		delete[] bodyCellIndices;
+		delete[] bodyCellOffsets;
+		delete[] bodies;
+		delete[] removedParticles;
+		delete[] particleDeltas;
+		delete[] particleColors;
+		delete[] neighborNormals;
+		delete[] neighborDistances;
+		delete[] neighborIndices;
+		delete[] neighborOffsets;
+		delete[] neighborBuildPositions;
+		delete[] particleIndexes;
+		delete[] particleCellRanks;
+		delete[] sortedNeighborBuildPositions;
+		delete[] sortedRemovedParticles;
+		delete[] sortedParticleColors;
+		delete[] sortedParticleDatas;
+		delete[] particleDatas;
+		delete taskGraph;
+		for (size_t colorIndex = 0; colorIndex < kMaxCellColorCount; ++colorIndex) {
+			delete[] colorCells[colorIndex];
+		}
+		for (size_t cellOrder = 0; cellOrder < CellOrder_Count; ++cellOrder) {
+			delete[] rankCells[cellOrder];
+			delete[] cellRanks[cellOrder];
+		}
+		delete[] cellStarts;
+		delete[] chunkCellCounts;
+		delete[] cellParticleRanges;
+		delete[] cellSlots;
+		for (size_t cellIndex = 0; cellIndex < cellCount; ++cellIndex) {
+			delete[] cells[cellIndex].indices;
+		}
+		delete[] cells;
+	}
+
+	static void ReserveCellParticles(Cell *cell, const size_t capacity) {
+		if (capacity > cell->capacity) {
+			cell->capacity = SPHComputeGrownCapacity(cell->capacity, capacity, kSPHInitialCellParticleCapacity);
+			SPHReallocateArray(&cell->indices, cell->count, cell->capacity);
+		}
+	}
+
+	// Grows all particle arrays to the given capacity at least, the arrays which only hold data of a single step are not copied
+	void ParticleSimulation::ReserveParticles(const size_t capacity) {
+		if (capacity <= particleCapacity) {
+			return;
+		}
+		const size_t newCapacity = SPHComputeGrownCapacity(particleCapacity, capacity, kSPHInitialParticleCapacity);
+		assert(newCapacity <= kMaxParticleCapacity);
+		SPHReallocateArray(&particleDatas, particleCount, newCapacity);
+		SPHReallocateArray(&sortedParticleDatas, 0, newCapacity);
+		SPHReallocateArray(&sortedParticleColors, 0, newCapacity);
+		SPHReallocateArray(&sortedRemovedParticles, 0, newCapacity);
+		SPHReallocateArray(&sortedNeighborBuildPositions, 0, newCapacity);
+		SPHReallocateArray(&particleCellRanks, 0, newCapacity);
+		SPHReallocateArray(&particleIndexes, particleCount, newCapacity);
+		SPHReallocateArray(&neighborBuildPositions, particleCount, newCapacity);
+		SPHReallocateArray(&neighborOffsets, particleCapacity > 0 ? particleCount + 1 : 0, newCapacity + 1);
+		SPHReallocateArray(&particleColors, particleCount, newCapacity);
+		SPHReallocateArray(&particleDeltas, 0, newCapacity);
+		SPHReallocateArray(&removedParticles, particleCount, newCapacity);
+		particleCapacity = newCapacity;
+	}
+
+	// Grows the cells and all arrays with an entry per cell, the colors are rebuilt on the next use
+	void ParticleSimulation::ReserveCells(const size_t capacity) {
+		if (capacity <= cellCapacity) {
+			return;
+		}
+		const size_t newCapacity = SPHComputeGrownCapacity(cellCapacity, capacity, kInitialHashedCellCapacity);
+		SPHReallocateArray(&cells, cellCount, newCapacity);
+		SPHReallocateArray(&cellParticleRanges, 0, newCapacity);
+		for (size_t colorIndex = 0; colorIndex < kMaxCellColorCount; ++colorIndex) {
+			SPHReallocateArray(&colorCells[colorIndex], 0, newCapacity);
+		}
+		cellCapacity = newCapacity;
+		cellColorsInvalid = true;
+	}
+
+	// Drops all empty cells and inserts the remaining ones into a new table with the given number of slots, which must be a power of two
+	void ParticleSimulation::RebuildCellTable(const size_t slotCount) {
+		assert(isHashedGrid);
+		assert((slotCount & (slotCount - 1)) == 0);
+		size_t keptCount = 0;
+		for (size_t cellIndex = 0; cellIndex < cellCount; ++cellIndex) {
+			if (cells[cellIndex].count > 0) {
+				cells[keptCount++] = cells[cellIndex];
+			} else {
+				delete[] cells[cellIndex].indices;
+			}
+		}
+		cellCount = keptCount;
+		if (slotCount != cellSlotCount) {
+			delete[] cellSlots;
+			cellSlots = new uint32_t[slotCount];
+			cellSlotCount = slotCount;
+		}
+		fplMemoryClear(cellSlots, sizeof(uint32_t) * cellSlotCount);
+		const size_t slotMask = cellSlotCount - 1;
+		for (size_t cellIndex = 0; cellIndex < cellCount; ++cellIndex) {
+			size_t slot = SPHComputeCellHash(cells[cellIndex].cellIndex.x, cells[cellIndex].cellIndex.y) & slotMask;
+			while (cellSlots[slot] != 0) {
+				slot = (slot + 1) & slotMask;
+			}
+			cellSlots[slot] = (uint32_t)(cellIndex + 1);
+		}
+		cellColorsInvalid = true;
+	}
+
+	// Index of the cell at the given grid position or kInvalidCell when there is none
+	inline size_t ParticleSimulation::FindCell(const int x, const int y) {
+		if (!isHashedGrid) {
+			return SPHIsPositionInGrid(grid, x, y) ? SPHComputeCellOffset(grid, x, y) : kInvalidCell;
+		}
+		// @NOTE: At most half of the slots are used, so there is always an empty slot which ends the probing
+		const size_t slotMask = cellSlotCount - 1;
+		size_t slot = SPHComputeCellHash(x, y) & slotMask;
+		for (;;) {
+			uint32_t entry = cellSlots[slot];
+			if (entry == 0) {
+				return kInvalidCell;
+			}
+			const Cell *cell = &cells[entry - 1];
+			if (cell->cellIndex.x == x && cell->cellIndex.y == y) {
+				return entry - 1;
+			}
+			slot = (slot + 1) & slotMask;
+		}
+	}
+
+	// Adds an empty cell to the hashed grid. When the table is half full the empty cells are dropped and the table doubles until the rest fills a quarter at most, so cells which are not used anymore do not pile up.
+	size_t ParticleSimulation::AddCell(const Vec2i &cellIndex) {
+		assert(isHashedGrid);
+		assert(FindCell(cellIndex.x, cellIndex.y) == kInvalidCell);
+		if ((cellCount + 1) * 2 > cellSlotCount) {
+			size_t usedCellCount = 0;
+			for (size_t index = 0; index < cellCount; ++index) {
+				if (cells[index].count > 0) {
+					++usedCellCount;
+				}
+			}
+			size_t slotCount = cellSlotCount;
+			while ((usedCellCount + 1) * 4 > slotCount) {
+				slotCount *= 2;
+			}
+			RebuildCellTable(slotCount);
+		}
+		ReserveCells(cellCount + 1);
+		size_t result = cellCount++;
+		Cell *cell = &cells[result];
+		cell->indices = nullptr;
+		cell->count = 0;
+		cell->capacity = 0;
+		cell->cellIndex = cellIndex;
+		const size_t slotMask = cellSlotCount - 1;
+		size_t slot = SPHComputeCellHash(cellIndex.x, cellIndex.y) & slotMask;
+		while (cellSlots[slot] != 0) {
+			slot = (slot + 1) & slotMask;
+		}
+		cellSlots[slot] = (uint32_t)(result + 1);
+		cellColorsInvalid = true;
+		return(result);
+	}
+
+	// Dense grids clamp the particles into the border cells, hashed grids have no bounds
+	inline Vec2i ParticleSimulation::ComputeCellIndex(const Vec2f &position) {
+		Vec2i result = isHashedGrid ? SPHComputeUnboundedCellIndex(grid, position) : SPHComputeCellIndex(grid, position);
+		return(result);
+	}
+
+	// Rebuilds the dense grid arrays and all cells when the kernel height or the cell size has changed
+	void ParticleSimulation::UpdateGridSize() {
+		const SPHGrid newGrid = SPHCreateGrid(params.kernelHeight, kCellSizeScales[options[SimulationOption_CellSize].value]);
+		if (newGrid.cellSize == grid.cellSize && newGrid.countX == grid.countX && newGrid.countY == grid.countY) {
+			return;
+		}
+		grid = newGrid;
+
+		delete[] bodyCellOffsets;
+		bodyCellOffsets = new uint32_t[grid.totalCount + 1];
+		bodyCellsInvalid = true;
+
+		// Counting sort arrays, with the rank of each cell for each cell order
+		delete[] cellStarts;
+		delete[] chunkCellCounts;
+		chunkCellCounts = new uint32_t[workerPool.GetMaxChunkCount() * grid.totalCount];
+		cellStarts = new uint32_t[grid.totalCount + 1];
+		for (size_t cellOrder = 0; cellOrder < CellOrder_Count; ++cellOrder) {
+			delete[] rankCells[cellOrder];
+			delete[] cellRanks[cellOrder];
+			cellRanks[cellOrder] = new uint32_t[grid.totalCount];
+			rankCells[cellOrder] = new uint32_t[grid.totalCount];
+		}
+		for (uint32_t cellOffset = 0; cellOffset < grid.totalCount; ++cellOffset) {
+			rankCells[CellOrder_RowMajor][cellOffset] = cellOffset;
+			rankCells[CellOrder_Morton][cellOffset] = cellOffset;
+		}
+		const uint32_t countX = (uint32_t)grid.countX;
+		std::sort(rankCells[CellOrder_Morton], rankCells[CellOrder_Morton] + grid.totalCount, [countX](const uint32_t a, const uint32_t b) {
+			return SPHComputeMortonCode(a % countX, a / countX) < SPHComputeMortonCode(b % countX, b / countX);
+		});
+		for (size_t cellOrder = 0; cellOrder < CellOrder_Count; ++cellOrder) {
+			for (uint32_t rank = 0; rank < grid.totalCount; ++rank) {
+				cellRanks[cellOrder][rankCells[cellOrder][rank]] = rank;
+			}
+		}
+
+		ResetGrid(isHashedGrid);
+	}
+
+	void ParticleSimulation::SetParams(const SPHParameters &params) {
+		this->params = params;
+		UpdateGridSize();
+	}
+
+	// Drops all cells and inserts all particles again into a dense or hashed grid
+	void ParticleSimulation::ResetGrid(const bool hashed) {
+		for (size_t cellIndex = 0; cellIndex < cellCount; ++cellIndex) {
+			delete[] cells[cellIndex].indices;
+		}
+		cellCount = 0;
+		isHashedGrid = hashed;
+		if (hashed) {
+			RebuildCellTable(kInitialHashedCellCapacity);
+		} else {
+			delete[] cellSlots;
+			cellSlots = nullptr;
+			cellSlotCount = 0;
+			// @NOTE: Cells start without indices, each one grows when particles are inserted
+			ReserveCells(grid.totalCount);
+			for (int cellY = 0; cellY < grid.countY; ++cellY) {
+				for (int cellX = 0; cellX < grid.countX; ++cellX) {
+					Cell *cell = &cells[cellCount++];
+					cell->indices = nullptr;
+					cell->count = 0;
+					cell->capacity = 0;
+					cell->cellIndex = Vec2i(cellX, cellY);
+				}
+			}
+			assert(cellCount == grid.totalCount);
+		}
+		cellColorsInvalid = true;
+		sortedCellOrder = -1;
+		for (size_t particleIndex = 0; particleIndex < particleCount; ++particleIndex) {
+			InsertParticleIntoGrid(particleIndex);
+		}
+		neighborListsInvalid = true;
 	}
 
 	void ParticleSimulation::InsertParticleIntoGrid(const size_t particleIndex) {
 		Vec2f position = particleDatas[particleIndex].curPosition;
-		Vec2i cellIndex = SPHComputeCellIndex(position);
+		Vec2i cellIndex = ComputeCellIndex(position);
 
-		size_t cellOffset = SPHComputeCellOffset(cellIndex.x, cellIndex.y);
+		size_t cellOffset = FindCell(cellIndex.x, cellIndex.y);
+		if (cellOffset == kInvalidCell) {
+			cellOffset = AddCell(cellIndex);
+		}
 		Cell *cell = &cells[cellOffset];
 		assert(cell != nullptr);
 
-		assert(cell->count < kSPHMaxCellParticleCount);
+		ReserveCellParticles(cell, cell->count + 1);
 		size_t indexInCell = cell->count++;
 		cell->indices[indexInCell] = particleIndex;
 		particleIndexes[particleIndex].cellIndex = cellIndex;
@@ -55,7 +386,8 @@ namespace Demo4 {
 
 	void ParticleSimulation::RemoveParticleFromGrid(const size_t particleIndex) {
 		Vec2i cellIndex = particleIndexes[particleIndex].cellIndex;
-		size_t cellOffset = SPHComputeCellOffset(cellIndex.x, cellIndex.y);
+		size_t cellOffset = FindCell(cellIndex.x, cellIndex.y);
+		assert(cellOffset != kInvalidCell);
 
 		Cell *cell = &cells[cellOffset];
 		assert(cell != nullptr);
@@ -75,8 +407,40 @@ namespace Demo4 {
 		stats.maxCellParticleCount = std::max(count, stats.maxCellParticleCount);
 	}
 
+	// Swap-removes all particles marked as removed in one pass, the last particle is moved into the free slot and its cell entry is updated
+	// @NOTE: The particle order changes, so the neighbor lists are rebuilt by the next neighbor search
+	void ParticleSimulation::CompactParticles() {
+		if (removedParticleCount == 0) {
+			return;
+		}
+		size_t particleIndex = 0;
+		while (particleIndex < particleCount) {
+			if (!removedParticles[particleIndex]) {
+				++particleIndex;
+				continue;
+			}
+			RemoveParticleFromGrid(particleIndex);
+			size_t lastIndex = --particleCount;
+			if (particleIndex != lastIndex) {
+				particleDatas[particleIndex] = particleDatas[lastIndex];
+				particleIndexes[particleIndex] = particleIndexes[lastIndex];
+				particleColors[particleIndex] = particleColors[lastIndex];
+				removedParticles[particleIndex] = removedParticles[lastIndex];
+				Vec2i cellIndex = particleIndexes[particleIndex].cellIndex;
+				Cell *cell = &cells[FindCell(cellIndex.x, cellIndex.y)];
+				cell->indices[particleIndexes[particleIndex].indexInCell] = particleIndex;
+			}
+		}
+		stats.removedParticleCount += removedParticleCount;
+		removedParticleCount = 0;
+		neighborListsInvalid = true;
+	}
+
 	void ParticleSimulation::ClearBodies() {
 		bodyCount = 0;
+		bodyCellsInvalid = true;
+		bodyTypesInvalid = true;
+		distanceFieldInvalid = true;
 	}
 
 	void ParticleSimulation::AddPlane(const Vec2f & normal, const float distance) {
@@ -87,6 +451,9 @@ namespace Demo4 {
 		assert(bodyCount < kSPHMaxBodyCount);
 		size_t bodyIndex = bodyCount++;
 		bodies[bodyIndex] = body;
+		bodyCellsInvalid = true;
+		bodyTypesInvalid = true;
+		distanceFieldInvalid = true;
 	}
 
 	void ParticleSimulation::AddCircle(const Vec2f & pos, const float radius) {
@@ -97,6 +464,9 @@ namespace Demo4 {
 		assert(bodyCount < kSPHMaxBodyCount);
 		size_t bodyIndex = bodyCount++;
 		bodies[bodyIndex] = body;
+		bodyCellsInvalid = true;
+		bodyTypesInvalid = true;
+		distanceFieldInvalid = true;
 	}
 
 	void ParticleSimulation::AddLineSegment(const Vec2f & a, const Vec2f & b) {
@@ -107,6 +477,9 @@ namespace Demo4 {
 		assert(bodyCount < kSPHMaxBodyCount);
 		size_t bodyIndex = bodyCount++;
 		bodies[bodyIndex] = body;
+		bodyCellsInvalid = true;
+		bodyTypesInvalid = true;
+		distanceFieldInvalid = true;
 	}
 
 	void ParticleSimulation::AddPolygon(const size_t vertexCount, const Vec2f *verts) {
@@ -117,18 +490,206 @@ namespace Demo4 {
 			body.polygon.verts[vertexIndex] = verts[vertexIndex];
 		}
 		body.polygon.vertexCount = vertexCount;
+		SPHComputePolygonNormals(vertexCount, body.polygon.verts, body.polygon.normals);
+		assert(bodyCount < kSPHMaxBodyCount);
+		size_t bodyIndex = bodyCount++;
+		bodies[bodyIndex] = body;
+		bodyCellsInvalid = true;
+		bodyTypesInvalid = true;
+		distanceFieldInvalid = true;
+	}
+
+	void ParticleSimulation::AddSink(const Vec2f &min, const Vec2f &max) {
+		Body body = Body();
+		body.type = BodyType::BodyType_Sink;
+		body.sink.min = min;
+		body.sink.max = max;
 		assert(bodyCount < kSPHMaxBodyCount);
 		size_t bodyIndex = bodyCount++;
 		bodies[bodyIndex] = body;
+		bodyCellsInvalid = true;
+		bodyTypesInvalid = true;
+		distanceFieldInvalid = true;
+	}
+
+	// Whether any position of the box can collide with the body
+	static bool IsBodyInBox(const Body &body, const Vec2f &boxMin, const Vec2f &boxMax) {
+		switch (body.type) {
+			case BodyType::BodyType_Plane:
+			{
+				const Plane &plane = body.plane;
+				Vec2f corner = Vec2f(plane.normal.x > 0 ? boxMin.x : boxMax.x, plane.normal.y > 0 ? boxMin.y : boxMax.y);
+				return Vec2Dot(corner, plane.normal) - plane.distance <= kSPHParticleCollisionRadius;
+			}
+			case BodyType::BodyType_Circle:
+			{
+				const Circle &circle = body.circle;
+				Vec2f closest = Vec2f(std::min(std::max(circle.pos.x, boxMin.x), boxMax.x), std::min(std::max(circle.pos.y, boxMin.y), boxMax.y));
+				return Vec2DistanceSquared(closest, circle.pos) <= circle.radius * circle.radius;
+			}
+			case BodyType::BodyType_LineSegment:
+			{
+				const LineSegment &lineSegment = body.lineSegment;
+				Vec2f bodyMin = Vec2f(std::min(lineSegment.a.x, lineSegment.b.x), std::min(lineSegment.a.y, lineSegment.b.y));
+				Vec2f bodyMax = Vec2f(std::max(lineSegment.a.x, lineSegment.b.x), std::max(lineSegment.a.y, lineSegment.b.y));
+				return bodyMin.x <= boxMax.x && bodyMax.x >= boxMin.x && bodyMin.y <= boxMax.y && bodyMax.y >= boxMin.y;
+			}
+			case BodyType::BodyType_Polygon:
+			{
+				const Poly &polygon = body.polygon;
+				Vec2f bodyMin = polygon.verts[0];
+				Vec2f bodyMax = polygon.verts[0];
+				for (size_t vertexIndex = 1; vertexIndex < polygon.vertexCount; ++vertexIndex) {
+					bodyMin = Vec2f(std::min(bodyMin.x, polygon.verts[vertexIndex].x), std::min(bodyMin.y, polygon.verts[vertexIndex].y));
+					bodyMax = Vec2f(std::max(bodyMax.x, polygon.verts[vertexIndex].x), std::max(bodyMax.y, polygon.verts[vertexIndex].y));
+				}
+				return bodyMin.x <= boxMax.x && bodyMax.x >= boxMin.x && bodyMin.y <= boxMax.y && bodyMax.y >= boxMin.y;
+			}
+			case BodyType::BodyType_Sink:
+			{
+				const Sink &sink = body.sink;
+				return sink.min.x <= boxMax.x && sink.max.x >= boxMin.x && sink.min.y <= boxMax.y && sink.max.y >= boxMin.y;
+			}
+			default:
+				return false;
+		}
+	}
+
+	// Rasterizes all bodies into the dense grid cells, so a particle only tests the bodies near its cell
+	void ParticleSimulation::UpdateBodyCells() {
+		size_t count = 0;
+		for (int y = 0; y < grid.countY; ++y) {
+			for (int x = 0; x < grid.countX; ++x) {
+				size_t cellOffset = SPHComputeCellOffset(grid, x, y);
+				bodyCellOffsets[cellOffset] = (uint32_t)count;
+				Vec2f cellMin = grid.origin + Vec2f((float)x, (float)y) * grid.cellSize - Vec2f(kBodyCellMargin);
+				Vec2f cellMax = grid.origin + Vec2f((float)(x + 1), (float)(y + 1)) * grid.cellSize + Vec2f(kBodyCellMargin);
+				for (size_t bodyIndex = 0; bodyIndex < bodyCount; ++bodyIndex) {
+					if (!IsBodyInBox(bodies[bodyIndex], cellMin, cellMax)) {
+						continue;
+					}
+					if (count == bodyCellIndexCapacity) {
+						const size_t newCapacity = SPHComputeGrownCapacity(bodyCellIndexCapacity, count + 1, grid.totalCount);
+						SPHReallocateArray(&bodyCellIndices, count, newCapacity);
+						bodyCellIndexCapacity = newCapacity;
+					}
+					bodyCellIndices[count++] = (uint32_t)bodyIndex;
+				}
+			}
+		}
+		bodyCellOffsets[grid.totalCount] = (uint32_t)count;
+		bodyCellsInvalid = false;
+	}
+
+	// Groups the bodies by type with a counting sort, which keeps the body order within each type
+	void ParticleSimulation::UpdateBodyTypes() {
+		fplMemoryClear(bodyTypeOffsets, sizeof(bodyTypeOffsets));
+		for (size_t bodyIndex = 0; bodyIndex < bodyCount; ++bodyIndex) {
+			++bodyTypeOffsets[bodies[bodyIndex].type + 1];
+		}
+		for (size_t type = 0; type < BodyType_Count; ++type) {
+			bodyTypeOffsets[type + 1] += bodyTypeOffsets[type];
+		}
+		uint32_t nextIndices[BodyType_Count];
+		fplMemoryCopy(bodyTypeOffsets, sizeof(nextIndices), nextIndices);
+		for (size_t bodyIndex = 0; bodyIndex < bodyCount; ++bodyIndex) {
+			const Body *body = &bodies[bodyIndex];
+			const uint32_t index = nextIndices[body->type]++;
+			bodyTypeIndices[index] = (uint32_t)bodyIndex;
+			if (body->type == BodyType::BodyType_Plane) {
+				SPHKernelPlane *kernelPlane = &kernelPlanes[index - bodyTypeOffsets[BodyType::BodyType_Plane]];
+				kernelPlane->normal = body->plane.normal;
+				kernelPlane->distance = body->plane.distance;
+			}
+		}
+		bodyTypesInvalid = false;
+	}
+
+	float ParticleSimulation::ComputeBodiesDistance(const Vec2f &position, Vec2f *outGradient) {
+		float result = FLT_MAX;
+		*outGradient = Vec2f(0, 0);
+		for (size_t bodyIndex = 0; bodyIndex < bodyCount; ++bodyIndex) {
+			Body *body = &bodies[bodyIndex];
+			Vec2f gradient;
+			float distance = FLT_MAX;
+			switch (body->type) {
+				case BodyType::BodyType_Plane:
+					distance = SPHComputePlaneDistance(position, body->plane.normal, body->plane.distance, &gradient);
+					break;
+				case BodyType::BodyType_Circle:
+					distance = SPHComputeCircleDistance(position, body->circle.pos, body->circle.radius, &gradient);
+					break;
+				case BodyType::BodyType_LineSegment:
+					distance = SPHComputeLineSegmentDistance(position, body->lineSegment.a, body->lineSegment.b, &gradient);
+					break;
+				case BodyType::BodyType_Polygon:
+					distance = SPHComputePolygonDistance(position, body->polygon.vertexCount, body->polygon.verts, body->polygon.normals, &gradient);
+					break;
+				default:
+					break;
+			}
+			if (distance < result) {
+				result = distance;
+				*outGradient = gradient;
+			}
+		}
+		return(result);
+	}
+
+	// Bakes the distance to the nearest body into every sample of the distance field, the sinks only remove particles and are not part of the field
+	void ParticleSimulation::BakeDistanceField(const bool useMultiThreading) {
+		auto startClock = std::chrono::high_resolution_clock::now();
+		SPHDistanceField *field = &distanceField;
+		const size_t sampleCount = (size_t)field->countX * field->countY;
+		if (field->distances == nullptr) {
+			field->distances = new float[sampleCount];
+			field->gradientsX = new float[sampleCount];
+			field->gradientsY = new float[sampleCount];
+		}
+		ForEachRange(useMultiThreading, field->countY, 1, [&](const size_t startIndex, const size_t endIndex) {
+			for (size_t y = startIndex; y <= endIndex; ++y) {
+				for (int x = 0; x < field->countX; ++x) {
+					size_t sampleIndex = y * field->countX + x;
+					Vec2f position = field->origin + Vec2f((float)x, (float)y) * field->spacing;
+					Vec2f gradient;
+					field->distances[sampleIndex] = ComputeBodiesDistance(position, &gradient);
+					field->gradientsX[sampleIndex] = gradient.x;
+					field->gradientsY[sampleIndex] = gradient.y;
+				}
+			}
+		});
+		auto deltaClock = std::chrono::high_resolution_clock::now() - startClock;
+		stats.distanceFieldBakeTime = std::chrono::duration_cast<std::chrono::nanoseconds>(deltaClock).count() * nanosToMilliseconds;
+		stats.distanceFieldSize = sampleCount * sizeof(float) * 3;
+
+		// @NOTE: Bilinear samples are exact on planes and furthest off in between the samples at corners, so the error is taken at the center of each sample cell near the surface only
+		float maxError = 0.0f;
+		for (int y = 0; y < field->countY - 1; ++y) {
+			for (int x = 0; x < field->countX - 1; ++x) {
+				Vec2f position = field->origin + Vec2f((float)x + 0.5f, (float)y + 0.5f) * field->spacing;
+				Vec2f gradient;
+				float distance = ComputeBodiesDistance(position, &gradient);
+				float sampledDistance;
+				if (fabsf(distance) <= kBodyCellMargin && SPHSampleDistanceField(*field, position, &sampledDistance, &gradient)) {
+					maxError = std::max(maxError, fabsf(sampledDistance - distance));
+				}
+			}
+		}
+		stats.distanceFieldMaxError = maxError;
+		distanceFieldInvalid = false;
 	}
 
 	void ParticleSimulation::ClearParticles() {
-		for (size_t cellIndex = 0; cellIndex < kSPHGridTotalCount; ++cellIndex) {
+		for (size_t cellIndex = 0; cellIndex < cellCount; ++cellIndex) {
 			Cell *cell = &cells[cellIndex];
 			assert(cell != nullptr);
 			cell->count = 0;
 		}
 		particleCount = 0;
+		removedParticleCount = 0;
+		neighborOffsets[0] = 0;
+		neighborListsInvalid = true;
+		sortedCellOrder = -1;
 	}
 
 	void ParticleSimulation::ClearEmitters() {
@@ -140,18 +701,31 @@ namespace Demo4 {
 	}
 
 	size_t ParticleSimulation::AddParticle(const Vec2f &position, const Vec2f &acceleration) {
+		ReserveParticles(particleCount + 1);
 		size_t particleIndex = particleCount++;
 
 		particleDatas[particleIndex] = ParticleData(position);
 		particleDatas[particleIndex].acceleration = acceleration;
 
 		particleIndexes[particleIndex] = ParticleIndex();
+		// New particles have no neighbors until the next neighbor search
+		neighborOffsets[particleIndex + 1] = neighborOffsets[particleIndex];
 		particleColors[particleIndex] = Vec4f();
+		removedParticles[particleIndex] = 0;
 
 		InsertParticleIntoGrid(particleIndex);
 		return particleIndex;
 	}
 
+	// @NOTE: Called from the collision pass for many particles at once, each particle is only marked by the thread which owns it
+	void ParticleSimulation::RemoveParticle(const size_t particleIndex) {
+		assert(particleIndex < particleCount);
+		if (!removedParticles[particleIndex]) {
+			removedParticles[particleIndex] = 1;
+			fplAtomicFetchAndAddU32(&removedParticleCount, 1);
+		}
+	}
+
 	void ParticleSimulation::AddEmitter(const Vec2f &position, const Vec2f &direction, const float radius, const float speed, const float rate, const float duration) {
 		assert(emitterCount < kSPHMaxEmitterCount);
 		ParticleEmitter *emitter = &emitters[emitterCount++];
@@ -167,6 +741,7 @@ namespace Demo4 {
 	}
 
 	void ParticleSimulation::AddVolume(const Vec2f &center, const Vec2f &force, const int countX, const int countY, const float spacing) {
+		ReserveParticles(particleCount + countX * countY);
 		Vec2f offset = Vec2f(countX * spacing, countY * spacing) * 0.5f;
 		for (int yIndex = 0; yIndex < countY; ++yIndex) {
 			for (int xIndex = 0; xIndex < countX; ++xIndex) {
@@ -180,77 +755,380 @@ namespace Demo4 {
 		}
 	}
 
-	void ParticleSimulation::NeighborSearch(const int64_t startIndex, const int64_t endIndex, const float deltaTime) {
-		for (int64_t particleIndexA = startIndex; particleIndexA <= endIndex; ++particleIndexA) {
-			ParticleIndex *particleIndexContainerA = &particleIndexes[particleIndexA];
-			particleIndexContainerA->neighborCount = 0;
-			Vec2i cellIndex = particleIndexContainerA->cellIndex;
-			for (int y = -1; y <= 1; ++y) {
-				for (int x = -1; x <= 1; ++x) {
-					int cellPosX = cellIndex.x + x;
-					int cellPosY = cellIndex.y + y;
-					if (SPHIsPositionInGrid(cellPosX, cellPosY)) {
-						size_t cellOffset = SPHComputeCellOffset(cellPosX, cellPosY);
-						Cell *cell = &cells[cellOffset];
-						assert(cell != nullptr);
-						size_t particleCountInCell = cell->count;
-						for (size_t index = 0; index < particleCountInCell; ++index) {
-							size_t particleIndexB = cell->indices[index];
-							assert(particleIndexContainerA->neighborCount < kSPHMaxParticleNeighborCount);
-							particleIndexContainerA->neighbors[particleIndexContainerA->neighborCount++] = particleIndexB;
+	// Calls func(neighborIndex) for all particles in the cells around the given particle, which are inside the neighbor radius when there is one.
+	// Half lists skip all neighbors with a lower or the same index.
+	template<typename F>
+	inline void ParticleSimulation::ForEachNeighborCandidate(const size_t particleIndex, F &&func) {
+		const Vec2f position = particleDatas[particleIndex].curPosition;
+		const float radiusSquared = neighborRadius * neighborRadius;
+		const Vec2i cellIndex = particleIndexes[particleIndex].cellIndex;
+		for (int y = -neighborCellRadius; y <= neighborCellRadius; ++y) {
+			for (int x = -neighborCellRadius; x <= neighborCellRadius; ++x) {
+				int cellPosX = cellIndex.x + x;
+				int cellPosY = cellIndex.y + y;
+				size_t neighborCellIndex = FindCell(cellPosX, cellPosY);
+				if (neighborCellIndex == kInvalidCell) continue;
+				const Cell *cell = &cells[neighborCellIndex];
+				if (radiusSquared == 0.0f) {
+					for (size_t index = 0; index < cell->count; ++index) {
+						func(cell->indices[index]);
+					}
+					continue;
+				}
+
+				// Skip cells which are farther away than the radius
+				Vec2f cellMin = grid.origin + Vec2f((float)cellPosX, (float)cellPosY) * grid.cellSize;
+				float dx = std::max(std::max(cellMin.x - position.x, position.x - (cellMin.x + grid.cellSize)), 0.0f);
+				float dy = std::max(std::max(cellMin.y - position.y, position.y - (cellMin.y + grid.cellSize)), 0.0f);
+				if ((dx * dx + dy * dy) >= radiusSquared) continue;
+
+				for (size_t index = 0; index < cell->count; ++index) {
+					size_t neighborIndex = cell->indices[index];
+					const Vec2f &neighborPosition = particleDatas[neighborIndex].curPosition;
+					float rx = neighborPosition.x - position.x;
+					float ry = neighborPosition.y - position.y;
+					if ((rx * rx + ry * ry) < radiusSquared && (!halfNeighborPairs || neighborIndex > particleIndex)) {
+						func(neighborIndex);
+					}
+				}
+			}
+		}
+	}
+
+	void ParticleSimulation::CountNeighbors(const int64_t startIndex, const int64_t endIndex, const float deltaTime) {
+		for (int64_t particleIndex = startIndex; particleIndex <= endIndex; ++particleIndex) {
+			uint32_t neighborCount = 0;
+			if (neighborRadius == 0.0f) {
+				// All particles of the neighbor cells are neighbors
+				Vec2i cellIndex = particleIndexes[particleIndex].cellIndex;
+				for (int y = -neighborCellRadius; y <= neighborCellRadius; ++y) {
+					for (int x = -neighborCellRadius; x <= neighborCellRadius; ++x) {
+						int cellPosX = cellIndex.x + x;
+						int cellPosY = cellIndex.y + y;
+						size_t neighborCellIndex = FindCell(cellPosX, cellPosY);
+						if (neighborCellIndex != kInvalidCell) {
+							neighborCount += (uint32_t)cells[neighborCellIndex].count;
 						}
 					}
 				}
+			} else {
+				ForEachNeighborCandidate(particleIndex, [&](const size_t) {
+					++neighborCount;
+				});
 			}
+			neighborOffsets[particleIndex] = neighborCount;
+		}
+	}
+
+	// Turns the neighbor counts into offsets and grows the neighbor indices when needed
+	void ParticleSimulation::UpdateNeighborOffsets(const bool useMultiThreading) {
+		if (useMultiThreading) {
+			workerPool.ParallelFor(particleCount, kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
+				this->CountNeighbors(startIndex, endIndex, 0.0f);
+			});
+		} else {
+			CountNeighbors(0, particleCount - 1, 0.0f);
+		}
+
+		// @NOTE: The extra zero at the end turns into the total neighbor count
+		neighborOffsets[particleCount] = 0;
+		uint64_t totalNeighborCount;
+		if (useMultiThreading) {
+			totalNeighborCount = workerPool.ParallelExclusiveScan<uint32_t, uint64_t>(neighborOffsets, particleCount + 1, kSPHParallelGrainSize * 16);
+		} else {
+			totalNeighborCount = SPHExclusiveScan(neighborOffsets, particleCount + 1);
+		}
+		// @NOTE: The offsets are 32-bit, so the neighbor lists would overlap on overflow. This must hold in release builds as well.
+		fplAlwaysAssert(totalNeighborCount <= UINT32_MAX);
+
+		if (totalNeighborCount > neighborCapacity) {
+			delete[] neighborIndices;
+			neighborCapacity = totalNeighborCount + totalNeighborCount / 2;
+			neighborIndices = new uint32_t[neighborCapacity];
+		}
+		if (hasNeighborPairs && totalNeighborCount > neighborPairCapacity) {
+			delete[] neighborNormals;
+			delete[] neighborDistances;
+			neighborPairCapacity = totalNeighborCount + totalNeighborCount / 2;
+			neighborDistances = new float[neighborPairCapacity];
+			neighborNormals = new Vec2f[neighborPairCapacity];
+		}
+	}
+
+	// Returns true when the neighbor lists have to be rebuilt in this step, the neighbor offsets are updated already then
+	bool ParticleSimulation::BeginNeighborSearch(const bool useMultiThreading) {
+		const bool useVerlet = options[SimulationOption_NeighborList].value == NeighborMode_Verlet;
+		const bool useFiltered = options[SimulationOption_NeighborList].value == NeighborMode_Filtered;
+		const bool useHalf = options[SimulationOption_NeighborList].value == NeighborMode_HalfPairs;
+		const float skin = useVerlet ? params.kernelHeight * kNeighborSkinScales[options[SimulationOption_NeighborSkin].value] : 0.0f;
+		if (useVerlet && !neighborListsInvalid && neighborParticleCount == particleCount && neighborSkin == skin) {
+			// @NOTE: Two particles can move towards each other, so each one may only move half the skin. Delta positions and collisions of the current step are included at the next predict only.
+			union {
+				uint32_t bits;
+				float value;
+			} maxDisplacementSquared;
+			maxDisplacementSquared.bits = fplAtomicLoadU32(&maxNeighborDisplacementSquared);
+			const float maxDisplacement = skin * 0.5f;
+			if (maxDisplacementSquared.value <= maxDisplacement * maxDisplacement) {
+				++stats.neighborReuseCount;
+				return(false);
+			}
+		}
+
+		neighborSkin = skin;
+		neighborRadius = (useVerlet || useFiltered || useHalf) ? params.kernelHeight + skin : 0.0f;
+		// @NOTE: Both particles of a reused pair may move half the skin until the next rebuild, so they can be up to the kernel height plus twice the skin apart.
+		// The colored solver and the task graph neighbor ranges rely on the cell radius to cover all neighbors of the lists, not only the ones found at the build.
+		neighborCellRadius = useVerlet ? (int)ceilf((params.kernelHeight + 2.0f * skin) / grid.cellSize) : grid.cellRadius;
+		hasNeighborPairs = useFiltered;
+		halfNeighborPairs = useHalf;
+		fplAlwaysAssert(neighborCellRadius <= kMaxNeighborCellRadius);
+		UpdateNeighborOffsets(useMultiThreading);
+		neighborParticleCount = particleCount;
+		neighborListsInvalid = false;
+		fplAtomicStoreU32(&maxNeighborDisplacementSquared, 0);
+		++stats.neighborRebuildCount;
+		return(true);
+	}
+
+	void ParticleSimulation::NeighborSearch(const int64_t startIndex, const int64_t endIndex, const float deltaTime) {
+		for (int64_t particleIndexA = startIndex; particleIndexA <= endIndex; ++particleIndexA) {
+			uint32_t *neighbors = &neighborIndices[neighborOffsets[particleIndexA]];
+			size_t neighborCount = 0;
+			if (hasNeighborPairs) {
+				// @NOTE: The particle itself stays in the list with zero distance and normal, so it adds its own density without a special case
+				const Vec2f position = particleDatas[particleIndexA].curPosition;
+				float *distances = &neighborDistances[neighborOffsets[particleIndexA]];
+				Vec2f *normals = &neighborNormals[neighborOffsets[particleIndexA]];
+				ForEachNeighborCandidate(particleIndexA, [&](const size_t particleIndexB) {
+					Vec2f Rij = particleDatas[particleIndexB].curPosition - position;
+					float rij = Vec2Length(Rij);
+					distances[neighborCount] = rij;
+					normals[neighborCount] = Rij * (1.0f / std::max(rij, kSPHCollisionEpsilon));
+					neighbors[neighborCount++] = (uint32_t)particleIndexB;
+				});
+			} else {
+				ForEachNeighborCandidate(particleIndexA, [&](const size_t particleIndexB) {
+					neighbors[neighborCount++] = (uint32_t)particleIndexB;
+				});
+			}
+			assert(neighborCount == GetNeighborCount(particleIndexA));
+			neighborBuildPositions[particleIndexA] = particleDatas[particleIndexA].curPosition;
 		}
 	}
 
 	void ParticleSimulation::DensityAndPressure(const int64_t startIndex, const int64_t endIndex, const float deltaTime) {
+		const SPHKernelParticles kernelParticles = GetKernelParticles();
 		for (int64_t particleIndex = startIndex; particleIndex <= endIndex; ++particleIndex) {
 			ParticleData *particleDataContainer = &particleDatas[particleIndex];
-			ParticleIndex *particleIndexContainer = &particleIndexes[particleIndex];
 			particleDataContainer->density = particleDataContainer->nearDensity = 0;
-			size_t neighborCount = particleIndexContainer->neighborCount;
-			for (size_t index = 0; index < neighborCount; ++index) {
-				size_t neighborIndex = particleIndexContainer->neighbors[index];
-				ParticleData *neighborDataContainer = &particleDatas[neighborIndex];
-				SPHComputeDensity(params, particleDataContainer->curPosition, neighborDataContainer->curPosition, particleDataContainer->densities);
+			size_t neighborCount = GetNeighborCount(particleIndex);
+			if (hasNeighborPairs) {
+				const float *distances = &neighborDistances[neighborOffsets[particleIndex]];
+				for (size_t index = 0; index < neighborCount; ++index) {
+					SPHComputeDensityFromDistance(params, distances[index], particleDataContainer->densities);
+				}
+			} else {
+				const uint32_t *neighbors = &neighborIndices[neighborOffsets[particleIndex]];
+				kernels->densities(params, particleDataContainer->curPosition, kernelParticles, neighbors, neighborCount, particleDataContainer->densities);
 			}
 			SPHComputePressure(params, particleDataContainer->densities, particleDataContainer->pressures);
 		}
 	}
 
-	void ParticleSimulation::ViscosityForces(const int64_t startIndex, const int64_t endIndex, const float deltaTime) {
+	// Half lists: the particle itself adds one to both densities, the pairs are scattered into both particles and the pressures are computed once all pairs are done
+	void ParticleSimulation::ResetDensities(const int64_t startIndex, const int64_t endIndex, const float deltaTime) {
 		for (int64_t particleIndex = startIndex; particleIndex <= endIndex; ++particleIndex) {
 			ParticleData *particleDataContainer = &particleDatas[particleIndex];
-			ParticleIndex *particleIndexContainer = &particleIndexes[particleIndex];
-			size_t neighborCount = particleIndexContainer->neighborCount;
-			for (size_t index = 0; index < neighborCount; ++index) {
-				size_t neighborIndex = particleIndexContainer->neighbors[index];
-				ParticleData *neighborDataContainer = &particleDatas[neighborIndex];
-				Vec2f force = Vec2f();
+			particleDataContainer->density = particleDataContainer->nearDensity = 1.0f;
+		}
+	}
+
+	void ParticleSimulation::DensityPair(const size_t particleIndex, const float deltaTime) {
+		ParticleData *particleDataContainer = &particleDatas[particleIndex];
+		const uint32_t *neighbors = &neighborIndices[neighborOffsets[particleIndex]];
+		size_t neighborCount = GetNeighborCount(particleIndex);
+		for (size_t index = 0; index < neighborCount; ++index) {
+			ParticleData *neighborDataContainer = &particleDatas[neighbors[index]];
+			SPHComputeDensityPair(params, particleDataContainer->curPosition, neighborDataContainer->curPosition, particleDataContainer->densities, neighborDataContainer->densities);
+		}
+	}
+
+	void ParticleSimulation::Pressures(const int64_t startIndex, const int64_t endIndex, const float deltaTime) {
+		for (int64_t particleIndex = startIndex; particleIndex <= endIndex; ++particleIndex) {
+			ParticleData *particleDataContainer = &particleDatas[particleIndex];
+			SPHComputePressure(params, particleDataContainer->densities, particleDataContainer->pressures);
+		}
+	}
+
+	void ParticleSimulation::ViscosityForce(const size_t particleIndex, const float deltaTime) {
+		ParticleData *particleDataContainer = &particleDatas[particleIndex];
+		const uint32_t *neighbors = &neighborIndices[neighborOffsets[particleIndex]];
+		size_t neighborCount = GetNeighborCount(particleIndex);
+		for (size_t index = 0; index < neighborCount; ++index) {
+			size_t neighborIndex = neighbors[index];
+			ParticleData *neighborDataContainer = &particleDatas[neighborIndex];
+			Vec2f force = Vec2f();
+			if (halfNeighborPairs) {
+				// The pair is visited once, so it gets the impulse of both directions
+				SPHComputeViscosityForceClamped(params, particleDataContainer->curPosition, neighborDataContainer->curPosition, particleDataContainer->velocity, neighborDataContainer->velocity, &force);
+				force *= 2.0f;
+			} else if (hasNeighborPairs) {
+				// Positions have changed since the neighbor search, but the pairs are still close
+				SPHComputeViscosityForceClamped(params, particleDataContainer->curPosition, neighborDataContainer->curPosition, particleDataContainer->velocity, neighborDataContainer->velocity, &force);
+			} else {
 				SPHComputeViscosityForce(params, particleDataContainer->curPosition, neighborDataContainer->curPosition, particleDataContainer->velocity, neighborDataContainer->velocity, &force);
-				particleDataContainer->velocity -= force * 0.5f * deltaTime;
-				neighborDataContainer->velocity += force * 0.5f * deltaTime;
 			}
+			particleDataContainer->velocity -= force * 0.5f * deltaTime;
+			neighborDataContainer->velocity += force * 0.5f * deltaTime;
 		}
 	}
 
+	void ParticleSimulation::ViscosityForces(const int64_t startIndex, const int64_t endIndex, const float deltaTime) {
+		for (int64_t particleIndex = startIndex; particleIndex <= endIndex; ++particleIndex) {
+			ViscosityForce(particleIndex, deltaTime);
+		}
+	}
+
+	void ParticleSimulation::DeltaPosition(const size_t particleIndex, const float deltaTime) {
+		ParticleData *particleDataContainer = &particleDatas[particleIndex];
+		const size_t neighborOffset = neighborOffsets[particleIndex];
+		const uint32_t *neighbors = &neighborIndices[neighborOffset];
+		Vec2f dx = Vec2f();
+		size_t neighborCount = GetNeighborCount(particleIndex);
+		for (size_t index = 0; index < neighborCount; ++index) {
+			size_t neighborIndex = neighbors[index];
+			ParticleData *neighborDataContainer = &particleDatas[neighborIndex];
+			Vec2f delta = Vec2f();
+			if (halfNeighborPairs) {
+				SPHComputeDeltaPair(params, particleDataContainer->curPosition, neighborDataContainer->curPosition, particleDataContainer->pressures, neighborDataContainer->pressures, deltaTime, &delta);
+				neighborDataContainer->curPosition += delta;
+				dx -= delta;
+				continue;
+			} else if (hasNeighborPairs) {
+				// @NOTE: Uses the pair geometry of the neighbor search, not the positions which the deltas of this pass have moved already
+				SPHComputeDeltaFromPair(params, neighborDistances[neighborOffset + index], neighborNormals[neighborOffset + index], particleDataContainer->pressures, deltaTime, &delta);
+			} else {
+				SPHComputeDelta(params, particleDataContainer->curPosition, neighborDataContainer->curPosition, particleDataContainer->pressures, deltaTime, &delta);
+			}
+			neighborDataContainer->curPosition += delta * 0.5f;
+			dx -= delta * 0.5f;
+		}
+		particleDataContainer->curPosition += dx;
+	}
+
 	void ParticleSimulation::DeltaPositions(const int64_t startIndex, const int64_t endIndex, const float deltaTime) {
 		for (int64_t particleIndex = startIndex; particleIndex <= endIndex; ++particleIndex) {
-			ParticleData *particleDataContainer = &particleDatas[particleIndex];
-			ParticleIndex *particleIndexContainer = &particleIndexes[particleIndex];
+			DeltaPosition(particleIndex, deltaTime);
+		}
+	}
+
+	// Gather solver: the viscosity of both directions of a pair is the same impulse, so each particle gets the full impulse of all its pairs
+	void ParticleSimulation::GatherViscosityForces(const int64_t startIndex, const int64_t endIndex, const float deltaTime) {
+		const SPHKernelParticles kernelParticles = GetKernelParticles();
+		const float relaxation = kSPHGatherRelaxations[options[SimulationOption_GatherRelaxation].value].viscosity;
+		for (int64_t particleIndex = startIndex; particleIndex <= endIndex; ++particleIndex) {
+			const ParticleData *particleDataContainer = &particleDatas[particleIndex];
+			const uint32_t *neighbors = &neighborIndices[neighborOffsets[particleIndex]];
+			size_t neighborCount = GetNeighborCount(particleIndex);
+			Vec2f forceSum = Vec2f();
+			if (hasNeighborPairs) {
+				for (size_t index = 0; index < neighborCount; ++index) {
+					const ParticleData *neighborDataContainer = &particleDatas[neighbors[index]];
+					Vec2f force = Vec2f();
+					SPHComputeViscosityForceClamped(params, particleDataContainer->curPosition, neighborDataContainer->curPosition, particleDataContainer->velocity, neighborDataContainer->velocity, &force);
+					forceSum += force;
+				}
+			} else {
+				kernels->viscosityForces(params, particleDataContainer->curPosition, particleDataContainer->velocity, kernelParticles, neighbors, neighborCount, &forceSum);
+			}
+			particleDeltas[particleIndex] = forceSum * (-deltaTime * relaxation);
+		}
+	}
+
+	void ParticleSimulation::GatherDeltaPositions(const int64_t startIndex, const int64_t endIndex, const float deltaTime) {
+		const SPHKernelParticles kernelParticles = GetKernelParticles();
+		const float relaxation = kSPHGatherRelaxations[options[SimulationOption_GatherRelaxation].value].delta;
+		for (int64_t particleIndex = startIndex; particleIndex <= endIndex; ++particleIndex) {
+			const ParticleData *particleDataContainer = &particleDatas[particleIndex];
+			const size_t neighborOffset = neighborOffsets[particleIndex];
+			const uint32_t *neighbors = &neighborIndices[neighborOffset];
+			size_t neighborCount = GetNeighborCount(particleIndex);
 			Vec2f dx = Vec2f();
-			size_t neighborCount = particleIndexContainer->neighborCount;
-			for (size_t index = 0; index < neighborCount; ++index) {
-				size_t neighborIndex = particleIndexContainer->neighbors[index];
-				ParticleData *neighborDataContainer = &particleDatas[neighborIndex];
-				Vec2f delta = Vec2f();
-				SPHComputeDelta(params, particleDataContainer->curPosition, neighborDataContainer->curPosition, particleDataContainer->pressures, deltaTime, &delta);
-				neighborDataContainer->curPosition += delta * 0.5f;
-				dx -= delta * 0.5f;
+			if (hasNeighborPairs) {
+				for (size_t index = 0; index < neighborCount; ++index) {
+					const ParticleData *neighborDataContainer = &particleDatas[neighbors[index]];
+					const float pressureSum[2] = { particleDataContainer->pressure + neighborDataContainer->pressure, particleDataContainer->nearPressure + neighborDataContainer->nearPressure };
+					Vec2f delta = Vec2f();
+					SPHComputeDeltaFromPair(params, neighborDistances[neighborOffset + index], neighborNormals[neighborOffset + index], pressureSum, deltaTime, &delta);
+					dx -= delta * 0.5f;
+				}
+			} else {
+				kernels->deltas(params, particleDataContainer->curPosition, particleDataContainer->pressures, kernelParticles, neighbors, neighborCount, deltaTime, &dx);
 			}
-			particleDataContainer->curPosition += dx;
+			particleDeltas[particleIndex] = SPHClampGatherDelta(dx * relaxation);
+		}
+	}
+
+	void ParticleSimulation::ApplyVelocityDeltas(const int64_t startIndex, const int64_t endIndex, const float deltaTime) {
+		for (int64_t particleIndex = startIndex; particleIndex <= endIndex; ++particleIndex) {
+			particleDatas[particleIndex].velocity += particleDeltas[particleIndex];
+		}
+	}
+
+	void ParticleSimulation::ApplyPositionDeltas(const int64_t startIndex, const int64_t endIndex, const float deltaTime) {
+		for (int64_t particleIndex = startIndex; particleIndex <= endIndex; ++particleIndex) {
+			particleDatas[particleIndex].curPosition += particleDeltas[particleIndex];
+		}
+	}
+
+	// Colors the cells by their position modulo (2 * cell radius + 1), so two cells of the same color are never closer than twice the cell radius
+	void ParticleSimulation::UpdateCellColors(const int cellRadius) {
+		if (colorCellRadius == cellRadius && !cellColorsInvalid) return;
+		const int period = 2 * cellRadius + 1;
+		cellColorCount = (size_t)(period * period);
+		assert(cellColorCount <= kMaxCellColorCount);
+		for (size_t colorIndex = 0; colorIndex < cellColorCount; ++colorIndex) {
+			colorCellCounts[colorIndex] = 0;
+		}
+		for (size_t cellIndex = 0; cellIndex < cellCount; ++cellIndex) {
+			// Hashed grids have negative cell positions as well
+			const Vec2i &position = cells[cellIndex].cellIndex;
+			int colorX = ((position.x % period) + period) % period;
+			int colorY = ((position.y % period) + period) % period;
+			size_t colorIndex = (size_t)(colorY * period + colorX);
+			colorCells[colorIndex][colorCellCounts[colorIndex]++] = cellIndex;
+		}
+		colorCellRadius = cellRadius;
+		cellColorsInvalid = false;
+	}
+
+	// Calls func(particleIndex) for all particles, one color at a time. Neighbors are always within the neighbor cell radius, so particles in cells of the same color never share a neighbor.
+	// @NOTE: The order is fixed by the grid, so the results do not depend on the thread timing.
+	template<typename F>
+	void ParticleSimulation::ForEachParticleColored(const bool useMultiThreading, F &&func) {
+		UpdateCellColors(neighborCellRadius);
+		for (size_t colorIndex = 0; colorIndex < cellColorCount; ++colorIndex) {
+			const size_t *cellOffsets = colorCells[colorIndex];
+			auto cellFunc = [&](const size_t startIndex, const size_t endIndex) {
+				for (size_t index = startIndex; index <= endIndex; ++index) {
+					const Cell *cell = &cells[cellOffsets[index]];
+					for (size_t indexInCell = 0; indexInCell < cell->count; ++indexInCell) {
+						func(cell->indices[indexInCell]);
+					}
+				}
+			};
+			ForEachRange(useMultiThreading, colorCellCounts[colorIndex], kSPHParallelCellGrainSize, cellFunc);
+		}
+	}
+
+	// Calls func(startIndex, endIndex) in parallel or for the whole range on the calling thread
+	template<typename F>
+	void ParticleSimulation::ForEachRange(const bool useMultiThreading, const size_t count, const size_t grain, F &&func) {
+		if (useMultiThreading) {
+			workerPool.ParallelFor(count, grain, func);
+		} else if (count > 0) {
+			func(0, count - 1);
 		}
 	}
 
@@ -283,9 +1161,548 @@ namespace Demo4 {
 		}
 	}
 
-	void ParticleSimulation::Update(const float deltaTime) {
+	void ParticleSimulation::IntegrateForces(const int64_t startIndex, const int64_t endIndex, const float deltaTime) {
+		const Vec2f force = gravity + externalForce;
+		for (int64_t particleIndex = startIndex; particleIndex <= endIndex; ++particleIndex) {
+			ParticleData *dataContainer = &particleDatas[particleIndex];
+			dataContainer->acceleration += force;
+			dataContainer->velocity += dataContainer->acceleration * deltaTime;
+			dataContainer->acceleration = Vec2f();
+		}
+	}
+
+	void ParticleSimulation::Predict(const int64_t startIndex, const int64_t endIndex, const float deltaTime) {
+		for (int64_t particleIndex = startIndex; particleIndex <= endIndex; ++particleIndex) {
+			ParticleData *dataContainer = &particleDatas[particleIndex];
+			dataContainer->prevPosition = dataContainer->curPosition;
+			dataContainer->curPosition += dataContainer->velocity * deltaTime;
+		}
+
+		// Largest displacement since the last Verlet list build
+		if (neighborSkin > 0.0f) {
+			union {
+				uint32_t bits;
+				float value;
+			} maxDisplacementSquared;
+			maxDisplacementSquared.value = 0.0f;
+			const int64_t endBuildIndex = std::min(endIndex, (int64_t)neighborParticleCount - 1);
+			for (int64_t particleIndex = startIndex; particleIndex <= endBuildIndex; ++particleIndex) {
+				Vec2f displacement = particleDatas[particleIndex].curPosition - neighborBuildPositions[particleIndex];
+				maxDisplacementSquared.value = std::max(maxDisplacementSquared.value, Vec2Dot(displacement, displacement));
+			}
+			// @NOTE: Positive floats have the same order as their bits, so the maximum can be updated with an integer compare and swap
+			uint32_t oldBits = fplAtomicLoadU32(&maxNeighborDisplacementSquared);
+			while (maxDisplacementSquared.bits > oldBits) {
+				uint32_t currentBits = fplAtomicCompareAndSwapU32(&maxNeighborDisplacementSquared, oldBits, maxDisplacementSquared.bits);
+				if (currentBits == oldBits) break;
+				oldBits = currentBits;
+			}
+		}
+	}
+
+	void ParticleSimulation::UpdateGridIncremental() {
+		for (size_t particleIndex = 0; particleIndex < particleCount; ++particleIndex) {
+			ParticleData *dataContainer = &particleDatas[particleIndex];
+			ParticleIndex *indexContainer = &particleIndexes[particleIndex];
+			Vec2i newCellIndex = ComputeCellIndex(dataContainer->curPosition);
+			Vec2i *oldCellIndex = &indexContainer->cellIndex;
+			if (newCellIndex.x != oldCellIndex->x || newCellIndex.y != oldCellIndex->y) {
+				RemoveParticleFromGrid(particleIndex);
+				InsertParticleIntoGrid(particleIndex);
+			}
+		}
+	}
+
+	// Rebuilds the grid with a counting sort by cell rank and moves the particles into cell order, so the particles of each cell are contiguous in memory
+	// @NOTE: The sort is stable and the chunks only depend on the particle count, so the order does not depend on the thread timing
+	void ParticleSimulation::SortGrid(const bool useMultiThreading, const CellOrder cellOrder) {
+		const uint32_t *ranks = cellRanks[cellOrder];
+		const uint32_t *rankCellOffsets = rankCells[cellOrder];
+		const size_t chunkCount = useMultiThreading ? workerPool.GetChunkCount(particleCount, kSPHParallelGrainSize) : 1;
+		auto chunkStart = [&](const size_t chunkIndex) {
+			return (chunkIndex * particleCount) / chunkCount;
+		};
+
+		// Cell rank of each particle and number of particles per cell rank for each chunk
+		ForEachRange(useMultiThreading, chunkCount, 1, [&](const size_t startChunk, const size_t endChunk) {
+			for (size_t chunkIndex = startChunk; chunkIndex <= endChunk; ++chunkIndex) {
+				uint32_t *cellCounts = &chunkCellCounts[chunkIndex * grid.totalCount];
+				fplMemoryClear(cellCounts, sizeof(uint32_t) * grid.totalCount);
+				for (size_t particleIndex = chunkStart(chunkIndex), end = chunkStart(chunkIndex + 1); particleIndex < end; ++particleIndex) {
+					Vec2i cellIndex = SPHComputeCellIndex(grid, particleDatas[particleIndex].curPosition);
+					uint32_t rank = ranks[SPHComputeCellOffset(grid, cellIndex.x, cellIndex.y)];
+					particleCellRanks[particleIndex] = rank;
+					++cellCounts[rank];
+				}
+			}
+		});
+
+		// First particle of each cell rank
+		ForEachRange(useMultiThreading, grid.totalCount, kSPHParallelCellGrainSize, [&](const size_t startIndex, const size_t endIndex) {
+			for (size_t rank = startIndex; rank <= endIndex; ++rank) {
+				uint32_t count = 0;
+				for (size_t chunkIndex = 0; chunkIndex < chunkCount; ++chunkIndex) {
+					count += chunkCellCounts[chunkIndex * grid.totalCount + rank];
+				}
+				cellStarts[rank] = count;
+			}
+		});
+		cellStarts[grid.totalCount] = 0;
+		SPHExclusiveScan(cellStarts, grid.totalCount + 1);
+		assert(cellStarts[grid.totalCount] == particleCount);
+
+		// First particle of each cell rank per chunk
+		ForEachRange(useMultiThreading, grid.totalCount, kSPHParallelCellGrainSize, [&](const size_t startIndex, const size_t endIndex) {
+			for (size_t rank = startIndex; rank <= endIndex; ++rank) {
+				uint32_t offset = cellStarts[rank];
+				for (size_t chunkIndex = 0; chunkIndex < chunkCount; ++chunkIndex) {
+					uint32_t *cellCount = &chunkCellCounts[chunkIndex * grid.totalCount + rank];
+					uint32_t count = *cellCount;
+					*cellCount = offset;
+					offset += count;
+				}
+			}
+		});
+
+		// Move the particles and all other per particle arrays into cell order, the particle indices are rebuilt below
+		ForEachRange(useMultiThreading, chunkCount, 1, [&](const size_t startChunk, const size_t endChunk) {
+			for (size_t chunkIndex = startChunk; chunkIndex <= endChunk; ++chunkIndex) {
+				uint32_t *cellOffsets = &chunkCellCounts[chunkIndex * grid.totalCount];
+				for (size_t particleIndex = chunkStart(chunkIndex), end = chunkStart(chunkIndex + 1); particleIndex < end; ++particleIndex) {
+					uint32_t sortedIndex = cellOffsets[particleCellRanks[particleIndex]]++;
+					sortedParticleDatas[sortedIndex] = particleDatas[particleIndex];
+					sortedParticleColors[sortedIndex] = particleColors[particleIndex];
+					sortedRemovedParticles[sortedIndex] = removedParticles[particleIndex];
+					sortedNeighborBuildPositions[sortedIndex] = neighborBuildPositions[particleIndex];
+				}
+			}
+		});
+		std::swap(particleDatas, sortedParticleDatas);
+		std::swap(particleColors, sortedParticleColors);
+		std::swap(removedParticles, sortedRemovedParticles);
+		std::swap(neighborBuildPositions, sortedNeighborBuildPositions);
+
+		// Cells and particle indices
+		ForEachRange(useMultiThreading, grid.totalCount, kSPHParallelCellGrainSize, [&](const size_t startIndex, const size_t endIndex) {
+			for (size_t rank = startIndex; rank <= endIndex; ++rank) {
+				uint32_t cellOffset = rankCellOffsets[rank];
+				Cell *cell = &cells[cellOffset];
+				Vec2i cellIndex = Vec2i((int)(cellOffset % grid.countX), (int)(cellOffset / grid.countX));
+				uint32_t cellStart = cellStarts[rank];
+				cell->count = 0;
+				ReserveCellParticles(cell, cellStarts[rank + 1] - cellStart);
+				cell->count = cellStarts[rank + 1] - cellStart;
+				for (size_t indexInCell = 0; indexInCell < cell->count; ++indexInCell) {
+					size_t particleIndex = cellStart + indexInCell;
+					cell->indices[indexInCell] = particleIndex;
+					particleIndexes[particleIndex].cellIndex = cellIndex;
+					particleIndexes[particleIndex].indexInCell = indexInCell;
+				}
+			}
+		});
+
+		for (size_t cellOffset = 0; cellOffset < grid.totalCount; ++cellOffset) {
+			size_t count = cells[cellOffset].count;
+			stats.minCellParticleCount = std::min(count, stats.minCellParticleCount);
+			stats.maxCellParticleCount = std::max(count, stats.maxCellParticleCount);
+		}
+	}
+
+	// Part of the particles which have a lower cell rank than the particle before, this is zero right after a grid sort
+	float ParticleSimulation::ComputeUnsortedFraction(const CellOrder cellOrder) {
+		const uint32_t *ranks = cellRanks[cellOrder];
+		size_t unsortedCount = 0;
+		uint32_t lastRank = 0;
+		for (size_t particleIndex = 0; particleIndex < particleCount; ++particleIndex) {
+			Vec2i cellIndex = particleIndexes[particleIndex].cellIndex;
+			uint32_t rank = ranks[SPHComputeCellOffset(grid, cellIndex.x, cellIndex.y)];
+			if (rank < lastRank) {
+				++unsortedCount;
+			}
+			lastRank = rank;
+		}
+		float result = particleCount > 0 ? unsortedCount / (float)particleCount : 0.0f;
+		return(result);
+	}
+
+	void ParticleSimulation::UpdateGrid(const bool useMultiThreading) {
+		CompactParticles();
+		UpdateGridSize();
+		if (bodyTypesInvalid) {
+			UpdateBodyTypes();
+		}
+		const CollisionMode collisionMode = (CollisionMode)options[SimulationOption_Collisions].value;
+		if (collisionMode == CollisionMode_BodyCells && bodyCellsInvalid) {
+			UpdateBodyCells();
+		} else if (collisionMode == CollisionMode_DistanceField && distanceFieldInvalid) {
+			BakeDistanceField(useMultiThreading);
+		}
+		const bool useHashedGrid = options[SimulationOption_Grid].value == GridMode_Hashed;
+		if (useHashedGrid != isHashedGrid) {
+			ResetGrid(useHashedGrid);
+		}
+		if (options[SimulationOption_Grid].value == GridMode_Sorted) {
+			const CellOrder cellOrder = (CellOrder)options[SimulationOption_CellOrder].value;
+			bool needsSort = sortedCellOrder != (int32_t)cellOrder;
+			switch (options[SimulationOption_SortPolicy].value) {
+				case SortPolicy_EveryStep:
+					needsSort = true;
+					break;
+				case SortPolicy_Interval:
+					needsSort |= stepsSinceGridSort >= kGridSortInterval;
+					break;
+				case SortPolicy_Unsorted:
+					needsSort |= stats.unsortedFraction > kGridMaxUnsortedFraction;
+					break;
+			}
+			if (needsSort) {
+				SortGrid(useMultiThreading, cellOrder);
+				// Neighbor indices refer to the old order
+				neighborListsInvalid = true;
+				sortedCellOrder = (int32_t)cellOrder;
+				stepsSinceGridSort = 0;
+				stats.unsortedFraction = 0.0f;
+				++stats.gridSortCount;
+			} else {
+				// Particles keep their place in memory until the next sort, only the cells are updated
+				UpdateGridIncremental();
+				++stepsSinceGridSort;
+				stats.unsortedFraction = ComputeUnsortedFraction(cellOrder);
+			}
+		} else {
+			UpdateGridIncremental();
+			sortedCellOrder = -1;
+			stats.unsortedFraction = 0.0f;
+		}
+	}
+
+	inline void ParticleSimulation::SolveBodyCollision(const size_t particleIndex, Body *body) {
+		ParticleData *dataContainer = &particleDatas[particleIndex];
+		switch (body->type) {
+			case BodyType::BodyType_Plane:
+			{
+				Plane *plane = &body->plane;
+				SPHSolvePlaneCollision(&dataContainer->curPosition, plane->normal, plane->distance);
+			} break;
+			case BodyType::BodyType_Circle:
+			{
+				Circle *circle = &body->circle;
+				SPHSolveCircleCollision(&dataContainer->curPosition, circle->pos, circle->radius);
+			} break;
+			case BodyType::BodyType_LineSegment:
+			{
+				LineSegment *lineSegment = &body->lineSegment;
+				SPHSolveLineSegmentCollision(&dataContainer->curPosition, lineSegment->a, lineSegment->b);
+			} break;
+			case BodyType::BodyType_Polygon:
+			{
+				Poly *polygon = &body->polygon;
+				SPHSolvePolygonCollision(&dataContainer->curPosition, polygon->vertexCount, polygon->verts, polygon->normals);
+			} break;
+			case BodyType::BodyType_Sink:
+			{
+				Sink *sink = &body->sink;
+				if (SPHIsPositionInSink(dataContainer->curPosition, sink->min, sink->max)) {
+					RemoveParticle(particleIndex);
+				}
+			} break;
+		}
+	}
+
+	// Moves fast particles back along their movement of this step to the first contact with a circle, line segment or polygon, the discrete collisions push them out from there.
+	// Planes are half spaces which cannot be passed through and sinks do not collide, so both are skipped.
+	void ParticleSimulation::SweepCollisions(const int64_t startIndex, const int64_t endIndex) {
+		const uint32_t firstIndex = bodyTypeOffsets[BodyType::BodyType_Circle];
+		const uint32_t lastIndex = bodyTypeOffsets[BodyType::BodyType_Polygon + 1];
+		if (firstIndex == lastIndex) {
+			return;
+		}
+		const float minDisplacementSquared = kContinuousCollisionMinDisplacement * kContinuousCollisionMinDisplacement;
+		const float capsuleRadius = kSPHCollisionMargin + kSPHParticleCollisionRadius;
+		for (int64_t particleIndex = startIndex; particleIndex <= endIndex; ++particleIndex) {
+			ParticleData *dataContainer = &particleDatas[particleIndex];
+			const Vec2f p0 = dataContainer->prevPosition;
+			const Vec2f p1 = dataContainer->curPosition;
+			if (Vec2DistanceSquared(p0, p1) <= minDisplacementSquared) {
+				continue;
+			}
+			float t = 1.0f;
+			for (uint32_t index = firstIndex; index < lastIndex; ++index) {
+				const Body *body = &bodies[bodyTypeIndices[index]];
+				float bodyT;
+				switch (body->type) {
+					case BodyType::BodyType_Circle:
+					{
+						const Circle &circle = body->circle;
+						if (SPHComputeCircleTimeOfImpact(p0, p1, circle.pos, circle.radius + kSPHParticleCollisionRadius, &bodyT)) {
+							t = std::min(t, bodyT);
+						}
+					} break;
+					case BodyType::BodyType_LineSegment:
+					{
+						const LineSegment &lineSegment = body->lineSegment;
+						if (SPHComputeCapsuleTimeOfImpact(p0, p1, lineSegment.a, lineSegment.b, capsuleRadius, &bodyT)) {
+							t = std::min(t, bodyT);
+						}
+					} break;
+					case BodyType::BodyType_Polygon:
+					{
+						// @NOTE: Outside of the polygon the rounded polygon is first touched on one of the capsules around its edges
+						const Poly &polygon = body->polygon;
+						Vec2f gradient;
+						if (SPHComputePolygonDistance(p0, polygon.vertexCount, polygon.verts, polygon.normals, &gradient) <= kSPHParticleCollisionRadius) {
+							if (Vec2Dot(p1 - p0, gradient) < 0.0f) {
+								t = 0.0f;
+							}
+							break;
+						}
+						for (size_t vertexIndex = 0; vertexIndex < polygon.vertexCount; ++vertexIndex) {
+							const Vec2f &a = polygon.verts[vertexIndex];
+							const Vec2f &b = polygon.verts[(vertexIndex + 1) % polygon.vertexCount];
+							if (SPHComputeCapsuleTimeOfImpact(p0, p1, a, b, capsuleRadius, &bodyT)) {
+								t = std::min(t, bodyT);
+							}
+						}
+					} break;
+					default:
+						break;
+				}
+			}
+			if (t < 1.0f) {
+				dataContainer->curPosition = p0 + (p1 - p0) * t;
+			}
+		}
+	}
+
+	void ParticleSimulation::SolveCollisionTypeBatches(const int64_t startIndex, const int64_t endIndex) {
+		const size_t planeCount = bodyTypeOffsets[BodyType::BodyType_Plane + 1] - bodyTypeOffsets[BodyType::BodyType_Plane];
+		if (planeCount > 0) {
+			ParticleData *first = &particleDatas[startIndex];
+			kernels->planeCollisions(&first->curPosition.x, &first->curPosition.y, kParticleStride, (size_t)(endIndex - startIndex + 1), kernelPlanes, planeCount);
+		}
+		for (uint32_t index = bodyTypeOffsets[BodyType::BodyType_Circle]; index < bodyTypeOffsets[BodyType::BodyType_Circle + 1]; ++index) {
+			const Circle *circle = &bodies[bodyTypeIndices[index]].circle;
+			for (int64_t particleIndex = startIndex; particleIndex <= endIndex; ++particleIndex) {
+				SPHSolveCircleCollision(&particleDatas[particleIndex].curPosition, circle->pos, circle->radius);
+			}
+		}
+		for (uint32_t index = bodyTypeOffsets[BodyType::BodyType_LineSegment]; index < bodyTypeOffsets[BodyType::BodyType_LineSegment + 1]; ++index) {
+			const LineSegment *lineSegment = &bodies[bodyTypeIndices[index]].lineSegment;
+			for (int64_t particleIndex = startIndex; particleIndex <= endIndex; ++particleIndex) {
+				SPHSolveLineSegmentCollision(&particleDatas[particleIndex].curPosition, lineSegment->a, lineSegment->b);
+			}
+		}
+		for (uint32_t index = bodyTypeOffsets[BodyType::BodyType_Polygon]; index < bodyTypeOffsets[BodyType::BodyType_Polygon + 1]; ++index) {
+			const Poly *polygon = &bodies[bodyTypeIndices[index]].polygon;
+			for (int64_t particleIndex = startIndex; particleIndex <= endIndex; ++particleIndex) {
+				SPHSolvePolygonCollision(&particleDatas[particleIndex].curPosition, polygon->vertexCount, polygon->verts, polygon->normals);
+			}
+		}
+		for (uint32_t index = bodyTypeOffsets[BodyType::BodyType_Sink]; index < bodyTypeOffsets[BodyType::BodyType_Sink + 1]; ++index) {
+			const Sink *sink = &bodies[bodyTypeIndices[index]].sink;
+			for (int64_t particleIndex = startIndex; particleIndex <= endIndex; ++particleIndex) {
+				if (SPHIsPositionInSink(particleDatas[particleIndex].curPosition, sink->min, sink->max)) {
+					RemoveParticle(particleIndex);
+				}
+			}
+		}
+	}
+
+	void ParticleSimulation::SolveCollisions(const int64_t startIndex, const int64_t endIndex, const float deltaTime) {
+		if (options[SimulationOption_ContinuousCollisions].value) {
+			SweepCollisions(startIndex, endIndex);
+		}
+		const CollisionMode collisionMode = (CollisionMode)options[SimulationOption_Collisions].value;
+		if (collisionMode == CollisionMode_TypeBatches) {
+			SolveCollisionTypeBatches(startIndex, endIndex);
+			return;
+		}
+		for (int64_t particleIndex = startIndex; particleIndex <= endIndex; ++particleIndex) {
+			if (collisionMode == CollisionMode_DistanceField) {
+				if (SPHSolveDistanceFieldCollision(&particleDatas[particleIndex].curPosition, distanceField)) {
+					for (uint32_t index = bodyTypeOffsets[BodyType::BodyType_Sink]; index < bodyTypeOffsets[BodyType::BodyType_Sink + 1]; ++index) {
+						SolveBodyCollision(particleIndex, &bodies[bodyTypeIndices[index]]);
+					}
+					continue;
+				}
+			} else if (collisionMode == CollisionMode_BodyCells) {
+				Vec2i cellIndex = SPHComputeUnboundedCellIndex(grid, particleDatas[particleIndex].curPosition);
+				if (SPHIsPositionInGrid(grid, cellIndex.x, cellIndex.y)) {
+					size_t cellOffset = SPHComputeCellOffset(grid, cellIndex.x, cellIndex.y);
+					for (uint32_t index = bodyCellOffsets[cellOffset]; index < bodyCellOffsets[cellOffset + 1]; ++index) {
+						SolveBodyCollision(particleIndex, &bodies[bodyCellIndices[index]]);
+					}
+					continue;
+				}
+			}
+			for (size_t bodyIndex = 0; bodyIndex < bodyCount; ++bodyIndex) {
+				SolveBodyCollision(particleIndex, &bodies[bodyIndex]);
+			}
+		}
+	}
+
+	void ParticleSimulation::UpdateVelocities(const int64_t startIndex, const int64_t endIndex, const float deltaTime) {
 		const float invDt = 1.0f / deltaTime;
+		for (int64_t particleIndex = startIndex; particleIndex <= endIndex; ++particleIndex) {
+			ParticleData *dataContainer = &particleDatas[particleIndex];
+			dataContainer->velocity = (dataContainer->curPosition - dataContainer->prevPosition) * invDt;
+		}
+	}
+
+	// Updates the particle range of each cell and then the neighbor range of each chunk, in two parallel passes so the main thread only builds the graph
+	void ParticleSimulation::UpdateNeighborRanges(const size_t chunkCount) {
+		assert(chunkCount <= fplArrayCount(chunkNeighborRanges));
+		ForEachRange(true, cellCount, kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
+			for (size_t cellIndex = startIndex; cellIndex <= endIndex; ++cellIndex) {
+				const Cell *cell = &cells[cellIndex];
+				ThreadPoolGraphRange *range = &cellParticleRanges[cellIndex];
+				range->startIndex = SIZE_MAX;
+				range->endIndex = 0;
+				for (size_t index = 0; index < cell->count; ++index) {
+					range->startIndex = std::min(range->startIndex, cell->indices[index]);
+					range->endIndex = std::max(range->endIndex, cell->indices[index]);
+				}
+			}
+		});
+		ForEachRange(true, chunkCount, 1, [&](const size_t startChunk, const size_t endChunk) {
+			for (size_t chunkIndex = startChunk; chunkIndex <= endChunk; ++chunkIndex) {
+				chunkNeighborRanges[chunkIndex] = this->ComputeNeighborRange(ThreadPoolGraph::GetChunkItems(particleCount, chunkCount, chunkIndex));
+			}
+		});
+	}
+
+	// Smallest range of particle indices which contains all possible neighbors of the given particles, based on the current grid
+	ThreadPoolGraphRange ParticleSimulation::ComputeNeighborRange(const ThreadPoolGraphRange &items) {
+		ThreadPoolGraphRange result = items;
+		for (size_t particleIndex = items.startIndex; particleIndex <= items.endIndex; ++particleIndex) {
+			Vec2i cellIndex = particleIndexes[particleIndex].cellIndex;
+			for (int y = -neighborCellRadius; y <= neighborCellRadius; ++y) {
+				for (int x = -neighborCellRadius; x <= neighborCellRadius; ++x) {
+					int cellPosX = cellIndex.x + x;
+					int cellPosY = cellIndex.y + y;
+					size_t neighborCellIndex = FindCell(cellPosX, cellPosY);
+					if (neighborCellIndex != kInvalidCell) {
+						const ThreadPoolGraphRange *cellRange = &cellParticleRanges[neighborCellIndex];
+						result.startIndex = std::min(result.startIndex, cellRange->startIndex);
+						result.endIndex = std::max(result.endIndex, cellRange->endIndex);
+					}
+				}
+			}
+		}
+		return(result);
+	}
+
+	void ParticleSimulation::UpdateWithTaskGraph(const float deltaTime) {
+		// @NOTE: The update is split into two graphs, because the neighbor ranges after the grid update are not known before.
+		// Viscosity scatters into the neighbors of the last step, which are all inside the neighbor cells of the current grid.
+		const size_t chunkCount = std::min(workerPool.GetChunkCount(particleCount, kSPHParallelGrainSize), ThreadPoolGraph::GetMaxChunkCount(kMaxTaskGraphPhaseCount));
+
+		auto integrateFunc = [&](const size_t startIndex, const size_t endIndex) {
+			this->IntegrateForces(startIndex, endIndex, deltaTime);
+		};
+		auto viscosityFunc = [&](const size_t startIndex, const size_t endIndex) {
+			this->ViscosityForces(startIndex, endIndex, deltaTime);
+		};
+		auto predictFunc = [&](const size_t startIndex, const size_t endIndex) {
+			this->Predict(startIndex, endIndex, deltaTime);
+		};
+		auto neighborSearchFunc = [&](const size_t startIndex, const size_t endIndex) {
+			this->NeighborSearch(startIndex, endIndex, deltaTime);
+		};
+		auto densityFunc = [&](const size_t startIndex, const size_t endIndex) {
+			this->DensityAndPressure(startIndex, endIndex, deltaTime);
+		};
+		auto deltaFunc = [&](const size_t startIndex, const size_t endIndex) {
+			this->DeltaPositions(startIndex, endIndex, deltaTime);
+		};
+		auto collisionsFunc = [&](const size_t startIndex, const size_t endIndex) {
+			this->SolveCollisions(startIndex, endIndex, deltaTime);
+			this->UpdateVelocities(startIndex, endIndex, deltaTime);
+		};
+
+		// Integrate forces, viscosity and predict
+		{
+			auto startClock = std::chrono::high_resolution_clock::now();
+			UpdateNeighborRanges(chunkCount);
+			auto buildStartClock = std::chrono::high_resolution_clock::now();
+			taskGraph->Clear();
+			size_t integratePhase = taskGraph->AddPhase(particleCount, chunkCount, integrateFunc);
+			taskGraph->AddAccess(integratePhase, ParticleResource_Velocity, ThreadPoolGraphAccessType::Write);
+			size_t viscosityPhase = taskGraph->AddPhase(particleCount, chunkCount, viscosityFunc);
+			taskGraph->AddAccess(viscosityPhase, ParticleResource_Neighbors, ThreadPoolGraphAccessType::Read);
+			taskGraph->AddChunkAccess(viscosityPhase, ParticleResource_Position, ThreadPoolGraphAccessType::Read, chunkNeighborRanges);
+			taskGraph->AddChunkAccess(viscosityPhase, ParticleResource_Velocity, ThreadPoolGraphAccessType::Write, chunkNeighborRanges);
+			size_t predictPhase = taskGraph->AddPhase(particleCount, chunkCount, predictFunc);
+			taskGraph->AddAccess(predictPhase, ParticleResource_Velocity, ThreadPoolGraphAccessType::Read);
+			taskGraph->AddAccess(predictPhase, ParticleResource_Position, ThreadPoolGraphAccessType::Write);
+			taskGraph->Build();
+			auto buildDeltaClock = std::chrono::high_resolution_clock::now() - buildStartClock;
+			stats.time.taskGraphBuild = std::chrono::duration_cast<std::chrono::nanoseconds>(buildDeltaClock).count() * nanosToMilliseconds;
+			stats.graphEdgeCount = taskGraph->GetEdgeCount();
+			stats.waitTime.viscosityForces = workerPool.RunGraph(*taskGraph).waitTime;
+			auto deltaClock = std::chrono::high_resolution_clock::now() - startClock;
+			stats.time.taskGraph = std::chrono::duration_cast<std::chrono::nanoseconds>(deltaClock).count() * nanosToMilliseconds;
+		}
+
+		// Update grid
+		{
+			auto startClock = std::chrono::high_resolution_clock::now();
+			UpdateGrid(true);
+			auto deltaClock = std::chrono::high_resolution_clock::now() - startClock;
+			stats.time.updateGrid = std::chrono::duration_cast<std::chrono::nanoseconds>(deltaClock).count() * nanosToMilliseconds;
+		}
+
+		// Neighbor search, density and pressure, delta positions, collisions with velocity
+		{
+			auto startClock = std::chrono::high_resolution_clock::now();
+			// @NOTE: The neighbor search may change the neighbor cell radius, so the ranges are updated after it
+			const bool rebuildNeighbors = BeginNeighborSearch(true);
+			UpdateNeighborRanges(chunkCount);
+			auto buildStartClock = std::chrono::high_resolution_clock::now();
+			taskGraph->Clear();
+			if (rebuildNeighbors) {
+				size_t neighborSearchPhase = taskGraph->AddPhase(particleCount, chunkCount, neighborSearchFunc);
+				taskGraph->AddAccess(neighborSearchPhase, ParticleResource_Neighbors, ThreadPoolGraphAccessType::Write);
+				taskGraph->AddChunkAccess(neighborSearchPhase, ParticleResource_Position, ThreadPoolGraphAccessType::Read, chunkNeighborRanges);
+			}
+			size_t densityPhase = taskGraph->AddPhase(particleCount, chunkCount, densityFunc);
+			taskGraph->AddAccess(densityPhase, ParticleResource_Neighbors, ThreadPoolGraphAccessType::Read);
+			taskGraph->AddChunkAccess(densityPhase, ParticleResource_Position, ThreadPoolGraphAccessType::Read, chunkNeighborRanges);
+			taskGraph->AddAccess(densityPhase, ParticleResource_Density, ThreadPoolGraphAccessType::Write);
+			size_t deltaPhase = taskGraph->AddPhase(particleCount, chunkCount, deltaFunc);
+			taskGraph->AddAccess(deltaPhase, ParticleResource_Neighbors | ParticleResource_Density, ThreadPoolGraphAccessType::Read);
+			taskGraph->AddChunkAccess(deltaPhase, ParticleResource_Position, ThreadPoolGraphAccessType::Write, chunkNeighborRanges);
+			size_t collisionsPhase = taskGraph->AddPhase(particleCount, chunkCount, collisionsFunc);
+			taskGraph->AddAccess(collisionsPhase, ParticleResource_Position | ParticleResource_Velocity, ThreadPoolGraphAccessType::Write);
+			taskGraph->Build();
+			auto buildDeltaClock = std::chrono::high_resolution_clock::now() - buildStartClock;
+			stats.time.taskGraphBuild += std::chrono::duration_cast<std::chrono::nanoseconds>(buildDeltaClock).count() * nanosToMilliseconds;
+			stats.graphEdgeCount += taskGraph->GetEdgeCount();
+			stats.waitTime.deltaPositions = workerPool.RunGraph(*taskGraph).waitTime;
+
+			stats.minParticleNeighborCount = kSPHMaxParticleNeighborCount;
+			stats.maxParticleNeighborCount = 0;
+			for (size_t particleIndex = 0; particleIndex < particleCount; ++particleIndex) {
+				size_t neighborCount = GetNeighborCount(particleIndex);
+				stats.minParticleNeighborCount = std::min(neighborCount, stats.minParticleNeighborCount);
+				stats.maxParticleNeighborCount = std::max(neighborCount, stats.maxParticleNeighborCount);
+			}
+			auto deltaClock = std::chrono::high_resolution_clock::now() - startClock;
+			stats.time.taskGraph += std::chrono::duration_cast<std::chrono::nanoseconds>(deltaClock).count() * nanosToMilliseconds;
+		}
+	}
+
+	void ParticleSimulation::Update(const float deltaTime) {
 		const bool useMultiThreading = isMultiThreading;
+		// @NOTE: The colored solver needs one barrier per color and the gather solver a second pass which applies the deltas, so both always run phase by phase
+		const bool useTaskGraph = useMultiThreading && options[SimulationOption_TaskGraph].value && !IsColoredSolver() && options[SimulationOption_Solver].value != SolverMode_Gather;
+		kernels = &kSPHKernelTables[std::min((SPHKernelSet)options[SimulationOption_Kernels].value, supportedKernelSet)];
+		stats.waitTime = {};
+		stats.time = {};
+		stats.graphEdgeCount = 0;
+		const size_t barrierCount = workerPool.GetBarrierCount();
+		const double parallelTime = workerPool.GetParallelTime();
+		auto updateStartClock = std::chrono::high_resolution_clock::now();
 
 		// Emitters
 		{
@@ -298,14 +1715,35 @@ namespace Demo4 {
 			stats.time.emitters = std::chrono::duration_cast<std::chrono::nanoseconds>(deltaClock).count() * nanosToMilliseconds;
 		}
 
+		if (particleCount > 0) {
+			if (useTaskGraph) {
+				UpdateWithTaskGraph(deltaTime);
+			} else {
+				UpdatePhases(deltaTime, useMultiThreading);
+			}
+		}
+
+		stats.barrierCount = workerPool.GetBarrierCount() - barrierCount;
+		auto updateDeltaClock = std::chrono::high_resolution_clock::now() - updateStartClock;
+		float updateTime = std::chrono::duration_cast<std::chrono::nanoseconds>(updateDeltaClock).count() * nanosToMilliseconds;
+		stats.serialFraction = SPHComputeSerialFraction(updateTime, (float)(workerPool.GetParallelTime() - parallelTime));
+	}
+
+	void ParticleSimulation::UpdatePhases(const float deltaTime, const bool useMultiThreading) {
+		// @NOTE: Integrate and predict cannot be fused, because the viscosity in between reads and writes the velocities of the neighbors
+		const bool useParallelPasses = useMultiThreading && options[SimulationOption_ParallelPasses].value;
+		const bool useColored = IsColoredSolver();
+		const bool useGather = options[SimulationOption_Solver].value == SolverMode_Gather;
+
 		// Integrate forces
 		{
 			auto startClock = std::chrono::high_resolution_clock::now();
-			for (size_t particleIndex = 0; particleIndex < particleCount; ++particleIndex) {
-				ParticleData *dataContainer = &particleDatas[particleIndex];
-				dataContainer->acceleration += gravity + externalForce;
-				dataContainer->velocity += dataContainer->acceleration * deltaTime;
-				dataContainer->acceleration = Vec2f();
+			if (useParallelPasses) {
+				workerPool.ParallelFor(particleCount, kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
+					this->IntegrateForces(startIndex, endIndex, deltaTime);
+				});
+			} else {
+				IntegrateForces(0, particleCount - 1, deltaTime);
 			}
 			auto deltaClock = std::chrono::high_resolution_clock::now() - startClock;
 			stats.time.integration = std::chrono::duration_cast<std::chrono::nanoseconds>(deltaClock).count() * nanosToMilliseconds;
@@ -314,11 +1752,21 @@ namespace Demo4 {
 		// Viscosity force
 		{
 			auto startClock = std::chrono::high_resolution_clock::now();
-			if (useMultiThreading) {
-				workerPool.CreateTasks(particleCount, [=](const size_t startIndex, const size_t endIndex, const float deltaTime) {
+			if (useColored) {
+				ForEachParticleColored(useMultiThreading, [&](const size_t particleIndex) {
+					this->ViscosityForce(particleIndex, deltaTime);
+				});
+			} else if (useGather) {
+				ForEachRange(useMultiThreading, particleCount, kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
+					this->GatherViscosityForces(startIndex, endIndex, deltaTime);
+				});
+				ForEachRange(useMultiThreading, particleCount, kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
+					this->ApplyVelocityDeltas(startIndex, endIndex, deltaTime);
+				});
+			} else if (useMultiThreading) {
+				stats.waitTime.viscosityForces = workerPool.ParallelFor(particleCount, kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
 					this->ViscosityForces(startIndex, endIndex, deltaTime);
-				}, deltaTime);
-				workerPool.WaitUntilDone();
+				}).waitTime;
 			} else {
 				this->ViscosityForces(0, particleCount - 1, deltaTime);
 			}
@@ -329,10 +1777,12 @@ namespace Demo4 {
 		// Predict
 		{
 			auto startClock = std::chrono::high_resolution_clock::now();
-			for (size_t particleIndex = 0; particleIndex < particleCount; ++particleIndex) {
-				ParticleData *dataContainer = &particleDatas[particleIndex];
-				dataContainer->prevPosition = dataContainer->curPosition;
-				dataContainer->curPosition += dataContainer->velocity * deltaTime;
+			if (useParallelPasses) {
+				workerPool.ParallelFor(particleCount, kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
+					this->Predict(startIndex, endIndex, deltaTime);
+				});
+			} else {
+				Predict(0, particleCount - 1, deltaTime);
 			}
 			auto deltaClock = std::chrono::high_resolution_clock::now() - startClock;
 			stats.time.predict = std::chrono::duration_cast<std::chrono::nanoseconds>(deltaClock).count() * nanosToMilliseconds;
@@ -341,16 +1791,7 @@ namespace Demo4 {
 		// Update grid
 		{
 			auto startClock = std::chrono::high_resolution_clock::now();
-			for (size_t particleIndex = 0; particleIndex < particleCount; ++particleIndex) {
-				ParticleData *dataContainer = &particleDatas[particleIndex];
-				ParticleIndex *indexContainer = &particleIndexes[particleIndex];
-				Vec2i newCellIndex = SPHComputeCellIndex(dataContainer->curPosition);
-				Vec2i *oldCellIndex = &indexContainer->cellIndex;
-				if (newCellIndex.x != oldCellIndex->x || newCellIndex.y != oldCellIndex->y) {
-					RemoveParticleFromGrid(particleIndex);
-					InsertParticleIntoGrid(particleIndex);
-				}
-			}
+			UpdateGrid(useMultiThreading);
 			auto deltaClock = std::chrono::high_resolution_clock::now() - startClock;
 			stats.time.updateGrid = std::chrono::duration_cast<std::chrono::nanoseconds>(deltaClock).count() * nanosToMilliseconds;
 		}
@@ -358,19 +1799,19 @@ namespace Demo4 {
 		// Neighbor search
 		{
 			auto startClock = std::chrono::high_resolution_clock::now();
-			if (useMultiThreading) {
-				workerPool.CreateTasks(particleCount, [=](const size_t startIndex, const size_t endIndex, const float deltaTime) {
-					this->NeighborSearch(startIndex, endIndex, deltaTime);
-				}, deltaTime);
-				workerPool.WaitUntilDone();
-			} else {
-				this->NeighborSearch(0, particleCount - 1, deltaTime);
+			if (BeginNeighborSearch(useMultiThreading)) {
+				if (useMultiThreading) {
+					stats.waitTime.neighborSearch = workerPool.ParallelFor(particleCount, kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
+						this->NeighborSearch(startIndex, endIndex, deltaTime);
+					}).waitTime;
+				} else {
+					this->NeighborSearch(0, particleCount - 1, deltaTime);
+				}
 			}
 			stats.minParticleNeighborCount = kSPHMaxParticleNeighborCount;
 			stats.maxParticleNeighborCount = 0;
 			for (size_t particleIndex = 0; particleIndex < particleCount; ++particleIndex) {
-				ParticleIndex *particleIndexContainer = &particleIndexes[particleIndex];
-				size_t neighborCount = particleIndexContainer->neighborCount;
+				size_t neighborCount = GetNeighborCount(particleIndex);
 				stats.minParticleNeighborCount = std::min(neighborCount, stats.minParticleNeighborCount);
 				stats.maxParticleNeighborCount = std::max(neighborCount, stats.maxParticleNeighborCount);
 			}
@@ -381,11 +1822,20 @@ namespace Demo4 {
 		// Density and pressure
 		{
 			auto startClock = std::chrono::high_resolution_clock::now();
-			if (useMultiThreading) {
-				workerPool.CreateTasks(particleCount, [=](const size_t startIndex, const size_t endIndex, const float deltaTime) {
+			if (halfNeighborPairs) {
+				ForEachRange(useMultiThreading, particleCount, kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
+					this->ResetDensities(startIndex, endIndex, deltaTime);
+				});
+				ForEachParticleColored(useMultiThreading, [&](const size_t particleIndex) {
+					this->DensityPair(particleIndex, deltaTime);
+				});
+				ForEachRange(useMultiThreading, particleCount, kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
+					this->Pressures(startIndex, endIndex, deltaTime);
+				});
+			} else if (useMultiThreading) {
+				stats.waitTime.densityAndPressure = workerPool.ParallelFor(particleCount, kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
 					this->DensityAndPressure(startIndex, endIndex, deltaTime);
-				}, deltaTime);
-				workerPool.WaitUntilDone();
+				}).waitTime;
 			} else {
 				this->DensityAndPressure(0, particleCount - 1, deltaTime);
 			}
@@ -396,11 +1846,21 @@ namespace Demo4 {
 		// Calculate delta position
 		{
 			auto startClock = std::chrono::high_resolution_clock::now();
-			if (useMultiThreading) {
-				workerPool.CreateTasks(particleCount, [=](const size_t startIndex, const size_t endIndex, const float deltaTime) {
+			if (useColored) {
+				ForEachParticleColored(useMultiThreading, [&](const size_t particleIndex) {
+					this->DeltaPosition(particleIndex, deltaTime);
+				});
+			} else if (useGather) {
+				ForEachRange(useMultiThreading, particleCount, kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
+					this->GatherDeltaPositions(startIndex, endIndex, deltaTime);
+				});
+				ForEachRange(useMultiThreading, particleCount, kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
+					this->ApplyPositionDeltas(startIndex, endIndex, deltaTime);
+				});
+			} else if (useMultiThreading) {
+				stats.waitTime.deltaPositions = workerPool.ParallelFor(particleCount, kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
 					this->DeltaPositions(startIndex, endIndex, deltaTime);
-				}, deltaTime);
-				workerPool.WaitUntilDone();
+				}).waitTime;
 			} else {
 				this->DeltaPositions(0, particleCount - 1, deltaTime);
 			}
@@ -408,46 +1868,21 @@ namespace Demo4 {
 			stats.time.deltaPositions = std::chrono::duration_cast<std::chrono::nanoseconds>(deltaClock).count() * nanosToMilliseconds;
 		}
 
-		// Solve collisions
+		// Solve collisions and recalculate velocity for next frame
 		{
 			auto startClock = std::chrono::high_resolution_clock::now();
-			for (size_t particleIndex = 0; particleIndex < particleCount; ++particleIndex) {
-				ParticleData *dataContainer = &particleDatas[particleIndex];
-				for (size_t bodyIndex = 0; bodyIndex < bodyCount; ++bodyIndex) {
-					Body *body = &bodies[bodyIndex];
-					switch (body->type) {
-						case BodyType::BodyType_Plane:
-						{
-							Plane *plane = &body->plane;
-							SPHSolvePlaneCollision(&dataContainer->curPosition, plane->normal, plane->distance);
-						} break;
-						case BodyType::BodyType_Circle:
-						{
-							Circle *circle = &body->circle;
-							SPHSolveCircleCollision(&dataContainer->curPosition, circle->pos, circle->radius);
-						} break;
-						case BodyType::BodyType_LineSegment:
-						{
-							LineSegment *lineSegment = &body->lineSegment;
-							SPHSolveLineSegmentCollision(&dataContainer->curPosition, lineSegment->a, lineSegment->b);
-						} break;
-						case BodyType::BodyType_Polygon:
-						{
-							Poly *polygon = &body->polygon;
-							SPHSolvePolygonCollision(&dataContainer->curPosition, polygon->vertexCount, polygon->verts);
-						} break;
-					}
-				}
+			if (useParallelPasses) {
+				workerPool.ParallelFor(particleCount, kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
+					this->SolveCollisions(startIndex, endIndex, deltaTime);
+					this->UpdateVelocities(startIndex, endIndex, deltaTime);
+				});
+			} else {
+				SolveCollisions(0, particleCount - 1, deltaTime);
+				UpdateVelocities(0, particleCount - 1, deltaTime);
 			}
 			auto deltaClock = std::chrono::high_resolution_clock::now() - startClock;
 			stats.time.collisions = std::chrono::duration_cast<std::chrono::nanoseconds>(deltaClock).count() * nanosToMilliseconds;
 		}
-
-		// Recalculate velocity for next frame
-		for (size_t particleIndex = 0; particleIndex < particleCount; ++particleIndex) {
-			ParticleData *dataContainer = &particleDatas[particleIndex];
-			dataContainer->velocity = (dataContainer->curPosition - dataContainer->prevPosition) * invDt;
-		}
 	}
 
 	void ParticleSimulation::Render(Render::CommandBuffer *commandBuffer, const float worldToScreenScale) {
@@ -456,27 +1891,24 @@ namespace Demo4 {
 		Render::PushRectangle(commandBuffer, Vec2f(-kSPHBoundaryHalfWidth, -kSPHBoundaryHalfHeight), Vec2f(kSPHBoundaryHalfWidth, kSPHBoundaryHalfHeight) * 2.0f, domainColor, false, 1.0f);
 
 		// Grid fill
-		for (int yIndexInner = 0; yIndexInner < kSPHGridCountY; ++yIndexInner) {
-			for (int xIndexInner = 0; xIndexInner < kSPHGridCountX; ++xIndexInner) {
-				size_t cellOffset = SPHComputeCellOffset(xIndexInner, yIndexInner);
-				Cell *cell = &cells[cellOffset];
-				Vec2f innerP = kSPHGridOrigin + Vec2f((float)xIndexInner, (float)yIndexInner) * kSPHGridCellSize;
-				Vec2f innerSize = Vec2f(kSPHGridCellSize);
-				if (cell->count > 0) {
-					Render::PushRectangle(commandBuffer, innerP, innerSize, ColorLightGray, true);
-				}
+		for (size_t cellIndex = 0; cellIndex < cellCount; ++cellIndex) {
+			Cell *cell = &cells[cellIndex];
+			Vec2f innerP = grid.origin + Vec2f((float)cell->cellIndex.x, (float)cell->cellIndex.y) * grid.cellSize;
+			Vec2f innerSize = Vec2f(grid.cellSize);
+			if (cell->count > 0) {
+				Render::PushRectangle(commandBuffer, innerP, innerSize, ColorLightGray, true);
 			}
 		}
 
 		// Grid lines
-		for (int yIndex = 0; yIndex < kSPHGridCountY; ++yIndex) {
-			Vec2f startP = kSPHGridOrigin + Vec2f(0, (float)yIndex) * kSPHGridCellSize;
-			Vec2f endP = kSPHGridOrigin + Vec2f((float)kSPHGridCountX, (float)yIndex) * kSPHGridCellSize;
+		for (int yIndex = 0; yIndex < grid.countY; ++yIndex) {
+			Vec2f startP = grid.origin + Vec2f(0, (float)yIndex) * grid.cellSize;
+			Vec2f endP = grid.origin + Vec2f((float)grid.countX, (float)yIndex) * grid.cellSize;
 			Render::PushLine(commandBuffer, startP, endP, ColorDarkGray, 1.0f);
 		}
-		for (int xIndex = 0; xIndex < kSPHGridCountX; ++xIndex) {
-			Vec2f startP = kSPHGridOrigin + Vec2f((float)xIndex, 0) * kSPHGridCellSize;
-			Vec2f endP = kSPHGridOrigin + Vec2f((float)xIndex, (float)kSPHGridCountY) * kSPHGridCellSize;
+		for (int xIndex = 0; xIndex < grid.countX; ++xIndex) {
+			Vec2f startP = grid.origin + Vec2f((float)xIndex, 0) * grid.cellSize;
+			Vec2f endP = grid.origin + Vec2f((float)xIndex, (float)grid.countY) * grid.cellSize;
 			Render::PushLine(commandBuffer, startP, endP, ColorDarkGray, 1.0f);
 		}
 
@@ -508,6 +1940,12 @@ namespace Demo4 {
 					polygon->Render(commandBuffer);
 				}
 				break;
+				case BodyType::BodyType_Sink:
+				{
+					Sink *sink = &body->sink;
+					sink->Render(commandBuffer);
+				}
+				break;
 			}
 		}
 
@@ -555,6 +1993,11 @@ namespace Demo4 {
 		Render::PushPolygonFrom(commandBuffer, &verts[0], vertexCount, color, false, 1.0f);
 	}
 
+	void Sink::Render(Render::CommandBuffer *commandBuffer) {
+		Vec4f color = ColorGreen;
+		Render::PushRectangle(commandBuffer, min, max - min, color, false, 1.0f);
+	}
+
 	void ParticleEmitter::Render(Render::CommandBuffer *commandBuffer) {
 		Render::PushCircle(commandBuffer, position, radius * 0.25f, ColorRed, 1.0f, false);
 	}
@@ -8,6 +8,7 @@
 
 #include "vecmath.h"
 #include "sph.h"
+#include "sphsimd.h"
 #include "threading.h"
 #include "base.h"
 #include "render.h"
@@ -22,6 +23,7 @@ namespace Demo4 {
 		BodyType_Circle = 2,
 		BodyType_LineSegment = 3,
 		BodyType_Polygon = 4,
+		BodyType_Sink = 5,
 
 		BodyType_Count,
 	};
@@ -50,11 +52,21 @@ namespace Demo4 {
 
 	struct Poly {
 		Vec2f verts[kMaxScenarioPolygonCount];
+		// Edge normals, computed once when the polygon is added
+		Vec2f normals[kMaxScenarioPolygonCount];
 		size_t vertexCount;
 
 		void Render(Render::CommandBuffer *commandBuffer);
 	};
 
+	// Particles inside the box are removed
+	struct Sink {
+		Vec2f min;
+		Vec2f max;
+
+		void Render(Render::CommandBuffer *commandBuffer);
+	};
+
 	struct Body {
 		BodyType type;
 		uint8_t padding0[4];
@@ -64,6 +76,7 @@ namespace Demo4 {
 			Circle circle;
 			LineSegment lineSegment;
 			Poly polygon;
+			Sink sink;
 		};
 
 		Body() {
@@ -75,6 +88,7 @@ namespace Demo4 {
 			circle = body.circle;
 			lineSegment = body.lineSegment;
 			polygon = body.polygon;
+			sink = body.sink;
 		}
 	};
 
@@ -110,14 +124,134 @@ namespace Demo4 {
 
 	struct ParticleIndex {
 		Vec2i cellIndex;
-		size_t neighbors[kSPHMaxParticleNeighborCount];
-		size_t neighborCount;
 		size_t indexInCell;
 	};
 
+	// Distance of two particles in floats, for the SIMD kernels
+	const size_t kParticleStride = sizeof(ParticleData) / sizeof(float);
+
+	// @NOTE: Neighbor offsets and indices are 32-bit, so the total number of neighbors must fit, which it does as long as the average particle has less than the max neighbor count
+	const size_t kMaxParticleCapacity = UINT32_MAX / kSPHMaxParticleNeighborCount;
+
+	// Indices of the particles in a cell, grows with the most particles the cell ever had
 	struct Cell {
-		size_t indices[kSPHMaxCellParticleCount];
+		size_t *indices;
 		size_t count;
+		size_t capacity;
+		Vec2i cellIndex;
+	};
+
+	// Hashed grids start with this many cells and slots, the table is grown when half of the slots are used
+	const size_t kInitialHashedCellCapacity = 256;
+	// Marks a cell position without a cell
+	const size_t kInvalidCell = SIZE_MAX;
+
+	// Particle arrays the task graph phases read or write
+	enum ParticleResource : uint32_t {
+		ParticleResource_Position = 1 << 0,
+		ParticleResource_Velocity = 1 << 1,
+		ParticleResource_Density = 1 << 2,
+		ParticleResource_Neighbors = 1 << 3,
+	};
+
+	// Scatter writes into the neighbors from any thread, colored runs the same scatter but only on cells which are at least 3 cells apart at the same time, so no two threads ever touch the same particle.
+	// Gather sums both halves of each pair into the particle itself from the unchanged neighbors and applies all deltas afterwards, so it is race-free without colors and can use the SIMD delta kernels.
+	enum SolverMode {
+		SolverMode_Scatter = 0,
+		SolverMode_Colored,
+		SolverMode_Gather,
+	};
+	const char *const kSolverModeNames[] = { "Scatter", "Colored", "Gather" };
+
+	// Incremental moves particles between the cells when they change their cell, counting sort rebuilds the grid and moves the particles into cell order.
+	// Hashed updates incrementally as well, but only has cells where particles are and finds them by position in a hash table, so particles are never clamped into the border cells.
+	enum GridMode {
+		GridMode_Incremental = 0,
+		GridMode_Sorted,
+		GridMode_Hashed,
+	};
+	const char *const kGridModeNames[] = { "Incremental", "Counting sort", "Hashed" };
+
+	// Order of the cells in memory after a grid sort
+	enum CellOrder {
+		CellOrder_RowMajor = 0,
+		CellOrder_Morton,
+
+		CellOrder_Count,
+	};
+	const char *const kCellOrderNames[] = { "Row major", "Morton" };
+
+	// When the counting sort runs, in between the grid is updated incrementally
+	enum SortPolicy {
+		SortPolicy_EveryStep = 0,
+		SortPolicy_Interval,
+		SortPolicy_Unsorted,
+	};
+	const char *const kSortPolicyNames[] = { "Every step", "Every 16 steps", "When 10% unsorted" };
+	const size_t kGridSortInterval = 16;
+	const float kGridMaxUnsortedFraction = 0.1f;
+
+	// Cells lists are rebuilt every step from the 3x3 (or 5x5 for half sized) cells, Verlet lists contain all particles within kernel height + skin and are reused until a particle has moved more than half the skin.
+	// Filtered lists are rebuilt every step with the particles within kernel height only and store the distance and normal of each pair.
+	// Half pair lists contain each pair within kernel height once, from the particle with the lower index, and always run colored because both particles of a pair are written.
+	enum NeighborMode {
+		NeighborMode_Cells = 0,
+		NeighborMode_Verlet,
+		NeighborMode_Filtered,
+		NeighborMode_HalfPairs,
+	};
+	const char *const kNeighborModeNames[] = { "Cells", "Verlet", "Filtered", "Half pairs" };
+	const char *const kNeighborSkinNames[] = { "0.1 h", "0.25 h", "0.5 h" };
+	const float kNeighborSkinScales[] = { 0.1f, 0.25f, 0.5f };
+
+	// Cell size relative to the kernel height, smaller cells contain less particles outside of the kernel height but more cells have to be visited
+	const char *const kCellSizeNames[] = { "1 h (3x3 cells)", "0.5 h (5x5 cells)" };
+	const float kCellSizeScales[] = { 1.0f, 0.5f };
+
+	// All bodies tests every body for each particle, body cells only the bodies rasterized into the grid cell of the particle.
+	// Distance field bakes all bodies except the sinks into one signed distance field whenever the bodies change and pushes a particle out with a single bilinear lookup, particles outside of the field test all bodies.
+	// Type batches run all planes over a range of particles with the plane kernel and then each other body over the range, grouped by body type, so there is no body type switch per particle.
+	enum CollisionMode {
+		CollisionMode_AllBodies = 0,
+		CollisionMode_BodyCells,
+		CollisionMode_DistanceField,
+		CollisionMode_TypeBatches,
+	};
+	const char *const kCollisionModeNames[] = { "All bodies", "Body cells", "Distance field", "Type batches" };
+
+	// Bodies are added to every dense grid cell within this margin, which covers the collision radius and the push of an earlier body in the same step
+	const float kBodyCellMargin = 2.0f * (kSPHCollisionMargin + kSPHParticleCollisionRadius);
+
+	// Continuous collisions only sweep particles which moved further than this in one step, slower particles cannot pass through a body without touching it
+	const float kContinuousCollisionMinDisplacement = kSPHParticleCollisionRadius;
+
+	// Distance field samples are half a particle radius apart and cover the boundary plus one kernel height on each side
+	const float kDistanceFieldSpacing = kSPHParticleRadius * 0.5f;
+	const float kDistanceFieldBorder = kSPHKernelHeight;
+
+	// The second task graph has up to 4 phases: neighbor search, density and pressure, delta positions and collisions
+	const size_t kMaxTaskGraphPhaseCount = 4;
+
+	// Cells are colored by their position modulo (2 * neighbor cell radius + 1), up to 4 cells for the largest skin with half sized cells
+	const int kMaxNeighborCellRadius = 4;
+	const size_t kMaxCellColorCount = (2 * kMaxNeighborCellRadius + 1) * (2 * kMaxNeighborCellRadius + 1);
+
+	enum SimulationOption {
+		SimulationOption_TaskGraph = 0,
+		SimulationOption_ParallelPasses,
+		SimulationOption_Solver,
+		SimulationOption_Grid,
+		SimulationOption_CellOrder,
+		SimulationOption_SortPolicy,
+		SimulationOption_NeighborList,
+		SimulationOption_NeighborSkin,
+		SimulationOption_Kernels,
+		SimulationOption_CellSize,
+		SimulationOption_Collisions,
+		SimulationOption_ContinuousCollisions,
+		SimulationOption_GatherRelaxation,
+
+		SimulationOption_Count,
 	};
 
 	struct ParticleEmitter {
@@ -142,23 +276,117 @@ namespace Demo4 {
 		Vec2f externalForce;
 
 		size_t particleCount;
+		// All particle arrays have room for this many particles and grow when a particle is added to the full arrays
+		size_t particleCapacity;
 		ParticleData *particleDatas;
+		// Particles are sorted into these and then swapped with the particle datas and the other per particle arrays
+		ParticleData *sortedParticleDatas;
+		Vec4f *sortedParticleColors;
+		uint8_t *sortedRemovedParticles;
+		Vec2f *sortedNeighborBuildPositions;
 		ParticleIndex *particleIndexes;
 		Vec4f *particleColors;
+		// Velocity or position change of each particle for the gather solver
+		Vec2f *particleDeltas;
+		// Particles marked as removed stay in all arrays and in the grid until the next compaction
+		uint8_t *removedParticles;
+		volatile uint32_t removedParticleCount;
+
+		// Neighbors of all particles as compressed sparse rows, the neighbors of particle i are neighborIndices[neighborOffsets[i], neighborOffsets[i + 1])
+		uint32_t *neighborOffsets;
+		uint32_t *neighborIndices;
+		size_t neighborCapacity;
+		// Distance and normal of each neighbor pair at the time of the neighbor search, for filtered lists only
+		float *neighborDistances;
+		Vec2f *neighborNormals;
+		size_t neighborPairCapacity;
+		bool hasNeighborPairs;
+		// Neighbor lists contain only neighbors with a larger index
+		bool halfNeighborPairs;
+		// Radius the neighbor lists were built with or zero when they contain all particles of the neighbor cells
+		float neighborRadius;
+		float neighborSkin;
+		int neighborCellRadius;
+		size_t neighborParticleCount;
+		bool neighborListsInvalid;
+		// Positions at the last neighbor build and the largest squared displacement since then, as float bits
+		Vec2f *neighborBuildPositions;
+		volatile uint32_t maxNeighborDisplacementSquared;
 
 		size_t bodyCount;
 		Body *bodies;
+		// Bodies of each dense grid cell as compressed sparse rows in body order, particles outside of the grid test all bodies
+		uint32_t *bodyCellOffsets;
+		uint32_t *bodyCellIndices;
+		size_t bodyCellIndexCapacity;
+		bool bodyCellsInvalid;
+		// Body indices grouped by body type in body order, the bodies of type t are bodyTypeIndices[bodyTypeOffsets[t], bodyTypeOffsets[t + 1])
+		uint32_t *bodyTypeIndices;
+		uint32_t bodyTypeOffsets[BodyType_Count + 1];
+		// All planes in body order, for the plane collision kernel
+		SPHKernelPlane *kernelPlanes;
+		bool bodyTypesInvalid;
+		// Distance field of all bodies except the sinks, which are tested separately
+		SPHDistanceField distanceField;
+		bool distanceFieldInvalid;
 
 		size_t emitterCount;
 		ParticleEmitter *emitters;
 
+		// Grid of the current kernel height and cell size option
+		SPHGrid grid;
+		// Dense grids have a cell for every grid position in row-major order, hashed grids only the cells which had particles since the table was last rebuilt
 		Cell *cells;
+		size_t cellCount;
+		size_t cellCapacity;
+		// Hashed grid: open addressing table with linear probing, each slot is the cell index + 1 or zero when empty
+		uint32_t *cellSlots;
+		size_t cellSlotCount;
+		bool isHashedGrid;
+		// Task graph: smallest and largest particle index of each cell and range of all possible neighbors of each chunk
+		ThreadPoolGraphRange *cellParticleRanges;
+		ThreadPoolGraphRange chunkNeighborRanges[MAX_THREADPOOL_GRAPH_NODE_COUNT / kMaxTaskGraphPhaseCount];
+		// Counting sort: cell rank of each particle, particles per cell rank for each chunk and first particle of each cell rank
+		uint32_t *particleCellRanks;
+		uint32_t *chunkCellCounts;
+		uint32_t *cellStarts;
+		// Rank of each cell offset and cell offset of each rank, for each cell order
+		uint32_t *cellRanks[CellOrder_Count];
+		uint32_t *rankCells[CellOrder_Count];
+		// Cell order of the last grid sort or -1 when the particles are not sorted
+		int32_t sortedCellOrder;
+		size_t stepsSinceGridSort;
+		size_t *colorCells[kMaxCellColorCount];
+		size_t colorCellCounts[kMaxCellColorCount];
+		size_t cellColorCount;
+		int colorCellRadius;
+		bool cellColorsInvalid;
 
 		bool isMultiThreading;
 		ThreadPool workerPool;
-
+		ThreadPoolGraph *taskGraph;
+
+		SPHOption options[SimulationOption_Count];
+
+		// Kernels of the selected kernel set, or of the best supported one when the CPU does not support it
+		SPHKernelSet supportedKernelSet;
+		const SPHKernelTable *kernels;
+
+		void ReserveParticles(const size_t capacity);
+		void ReserveCells(const size_t capacity);
+		void RebuildCellTable(const size_t slotCount);
+		inline size_t FindCell(const int x, const int y);
+		size_t AddCell(const Vec2i &cellIndex);
+		inline Vec2i ComputeCellIndex(const Vec2f &position);
+		void ResetGrid(const bool hashed);
+		void UpdateGridSize();
 		inline void InsertParticleIntoGrid(const size_t particleIndex);
 		inline void RemoveParticleFromGrid(const size_t particleIndex);
+		void CompactParticles();
+		void UpdateBodyCells();
+		void UpdateBodyTypes();
+		float ComputeBodiesDistance(const Vec2f &position, Vec2f *outGradient);
+		void BakeDistanceField(const bool useMultiThreading);
 
 		ParticleSimulation();
 		~ParticleSimulation();
@@ -172,17 +400,53 @@ namespace Demo4 {
 		void AddCircle(const Vec2f &pos, const float radius);
 		void AddLineSegment(const Vec2f &a, const Vec2f &b);
 		void AddPolygon(const size_t vertexCount, const Vec2f *verts);
+		void AddSink(const Vec2f &min, const Vec2f &max);
 
 		size_t AddParticle(const Vec2f &position, const Vec2f &force);
 		void AddVolume(const Vec2f &center, const Vec2f &force, const int countX, const int countY, const float spacing);
 		void AddEmitter(const Vec2f &position, const Vec2f &direction, const float radius, const float speed, const float rate, const float duration);
+		void RemoveParticle(const size_t particleIndex);
 
 		void UpdateEmitter(ParticleEmitter *emitter, float deltaTime);
+		inline void ViscosityForce(const size_t particleIndex, const float deltaTime);
+		inline void DeltaPosition(const size_t particleIndex, const float deltaTime);
+		inline void DensityPair(const size_t particleIndex, const float deltaTime);
 		void ViscosityForces(const int64_t startIndex, const int64_t endIndex, const float deltaTime);
+		void GatherViscosityForces(const int64_t startIndex, const int64_t endIndex, const float deltaTime);
+		void GatherDeltaPositions(const int64_t startIndex, const int64_t endIndex, const float deltaTime);
+		void ApplyVelocityDeltas(const int64_t startIndex, const int64_t endIndex, const float deltaTime);
+		void ApplyPositionDeltas(const int64_t startIndex, const int64_t endIndex, const float deltaTime);
+		template<typename F>
+		inline void ForEachNeighborCandidate(const size_t particleIndex, F &&func);
+		void CountNeighbors(const int64_t startIndex, const int64_t endIndex, const float deltaTime);
+		void UpdateNeighborOffsets(const bool useMultiThreading);
+		bool BeginNeighborSearch(const bool useMultiThreading);
 		void NeighborSearch(const int64_t startIndex, const int64_t endIndex, const float deltaTime);
 		void DensityAndPressure(const int64_t startIndex, const int64_t endIndex, const float deltaTime);
+		void ResetDensities(const int64_t startIndex, const int64_t endIndex, const float deltaTime);
+		void Pressures(const int64_t startIndex, const int64_t endIndex, const float deltaTime);
 		void DeltaPositions(const int64_t startIndex, const int64_t endIndex, const float deltaTime);
-
+		void UpdateCellColors(const int cellRadius);
+		template<typename F>
+		void ForEachParticleColored(const bool useMultiThreading, F &&func);
+		template<typename F>
+		void ForEachRange(const bool useMultiThreading, const size_t count, const size_t grain, F &&func);
+		void IntegrateForces(const int64_t startIndex, const int64_t endIndex, const float deltaTime);
+		void Predict(const int64_t startIndex, const int64_t endIndex, const float deltaTime);
+		inline void SolveBodyCollision(const size_t particleIndex, Body *body);
+		void SweepCollisions(const int64_t startIndex, const int64_t endIndex);
+		void SolveCollisionTypeBatches(const int64_t startIndex, const int64_t endIndex);
+		void SolveCollisions(const int64_t startIndex, const int64_t endIndex, const float deltaTime);
+		void UpdateVelocities(const int64_t startIndex, const int64_t endIndex, const float deltaTime);
+		void UpdateGridIncremental();
+		void SortGrid(const bool useMultiThreading, const CellOrder cellOrder);
+		float ComputeUnsortedFraction(const CellOrder cellOrder);
+		void UpdateGrid(const bool useMultiThreading);
+		void UpdateNeighborRanges(const size_t chunkCount);
+		ThreadPoolGraphRange ComputeNeighborRange(const ThreadPoolGraphRange &items);
+
+		void UpdateWithTaskGraph(const float deltaTime);
+		void UpdatePhases(const float deltaTime, const bool useMultiThreading);
 		void Update(const float deltaTime);
 		void Render(Render::CommandBuffer *commandBuffer, const float worldToScreenScale);
 
@@ -193,6 +457,28 @@ namespace Demo4 {
 			externalForce = Vec2f(0, 0);
 		}
 
+		// Both particles of a pair are written by the pair kernels, so half lists need the colored solver
+		inline bool IsColoredSolver() {
+			return options[SimulationOption_Solver].value == SolverMode_Colored || options[SimulationOption_NeighborList].value == NeighborMode_HalfPairs || halfNeighborPairs;
+		}
+
+		// @NOTE: The particle datas are swapped by the grid sort, so the kernel particles are only valid until the next grid update
+		inline SPHKernelParticles GetKernelParticles() {
+			SPHKernelParticles result;
+			result.positionsX = &particleDatas[0].curPosition.x;
+			result.positionsY = &particleDatas[0].curPosition.y;
+			result.velocitiesX = &particleDatas[0].velocity.x;
+			result.velocitiesY = &particleDatas[0].velocity.y;
+			result.pressures = &particleDatas[0].pressure;
+			result.nearPressures = &particleDatas[0].nearPressure;
+			result.stride = kParticleStride;
+			return(result);
+		}
+
+		inline size_t GetNeighborCount(const size_t particleIndex) {
+			return neighborOffsets[particleIndex + 1] - neighborOffsets[particleIndex];
+		}
+
 		inline size_t GetParticleCount() {
 			return particleCount;
 		}
@@ -203,12 +489,22 @@ namespace Demo4 {
 		inline bool IsMultiThreadingSupported() {
 			return true;
 		}
+		inline bool IsParticleRemovalSupported() {
+			return true;
+		}
 		inline bool IsMultiThreading() {
 			return isMultiThreading;
 		}
 		inline size_t GetWorkerThreadCount() {
 			return workerPool.GetThreadCount();
 		}
+		inline size_t GetOptionCount() {
+			return SimulationOption_Count;
+		}
+		inline SPHOption *GetOption(const size_t index) {
+			assert(index < SimulationOption_Count);
+			return &options[index];
+		}
 
 		inline void SetGravity(const Vec2f &gravity) {
 			this->gravity = gravity;
@@ -220,9 +516,7 @@ namespace Demo4 {
 		inline SPHStatistics &GetStats() {
 			return stats;
 		}
-		inline void SetParams(const SPHParameters &params) {
-			this->params = params;
-		}
+		void SetParams(const SPHParameters &params);
 	};
 };
 
@@ -0,0 +1,884 @@
+#include "demo5.h"
+
+#ifndef DEMO5_IMPLEMENTATION
+#define DEMO5_IMPLEMENTATION
+
+#include <chrono>
+#include <algorithm>
+
+#include "render.h"
+
+namespace Demo5 {
+	static void SetParticleStorageMode(ParticleStorage *storage, const StorageMode mode) {
+		// Separate arrays are blocks which follow each other in every field, blocks interleave the fields of 8 particles
+		const size_t fieldStride = mode == StorageMode_Blocks ? kParticleFieldLaneCount : storage->fieldCapacity;
+		for (size_t fieldIndex = 0; fieldIndex < ParticleField_Count; ++fieldIndex) {
+			storage->fields[fieldIndex] = (float *)storage->memory + fieldIndex * fieldStride;
+		}
+		storage->blockStride = mode == StorageMode_Blocks ? kParticleFieldLaneCount * ParticleField_Count : kParticleFieldLaneCount;
+	}
+
+	static void AllocateParticleStorage(ParticleStorage *storage, const size_t capacity, const StorageMode mode) {
+		const size_t floatsPerAlignment = kParticleFieldAlignment / sizeof(float);
+		storage->fieldCapacity = ((capacity + kParticleFieldLaneCount + floatsPerAlignment - 1) / floatsPerAlignment) * floatsPerAlignment;
+		storage->memory = fplMemoryAlignedAllocate(sizeof(float) * storage->fieldCapacity * ParticleField_Count, kParticleFieldAlignment);
+		SetParticleStorageMode(storage, mode);
+	}
+
+	static void ReleaseParticleStorage(ParticleStorage *storage) {
+		if (storage->memory != nullptr) {
+			fplMemoryAlignedFree(storage->memory);
+		}
+		*storage = {};
+	}
+
+	// Copies the first count particles, the storages may differ in mode and capacity
+	static void CopyParticleStorage(const ParticleStorage &source, ParticleStorage *target, const size_t count) {
+		for (size_t fieldIndex = 0; fieldIndex < ParticleField_Count; ++fieldIndex) {
+			const float *sourceField = source.fields[fieldIndex];
+			float *targetField = target->fields[fieldIndex];
+			for (size_t particleIndex = 0; particleIndex < count; ++particleIndex) {
+				targetField[SPHComputeBlockOffset(particleIndex, target->blockStride)] = sourceField[SPHComputeBlockOffset(particleIndex, source.blockStride)];
+			}
+		}
+	}
+
+	ParticleSimulation::ParticleSimulation() :
+		gravity(Vec2f(0, 0)),
+		particleCount(0),
+		particleCapacity(0),
+		particles({}),
+		sortedParticles({}),
+		particleCellOffsets(nullptr),
+		sortedParticleCellOffsets(nullptr),
+		particleSortIndices(nullptr),
+		particleDeltas(nullptr),
+		particleColors(nullptr),
+		particlePositions(nullptr),
+		removedParticles(nullptr),
+		removedParticleCount(0),
+		gridParticleCount(0),
+		cellNeighborIndices(nullptr),
+		cellNeighborCapacity(0),
+		bodyCount(0),
+		emitterCount(0),
+		storageMode(StorageMode_Arrays),
+		useNeighborRanges(false) {
+		ReserveParticles(kSPHInitialParticleCapacity);
+		cellStarts = new uint32_t[kSortBucketCount + 1];
+		fplMemoryClear(cellStarts, sizeof(uint32_t) * (kSortBucketCount + 1));
+		chunkCellCounts = new uint32_t[workerPool.GetMaxChunkCount() * kSortBucketCount];
+		cellNeighborOffsets = new uint32_t[kSPHGridTotalCount + 1];
+		bodies = new Body[kSPHMaxBodyCount];
+		emitters = new ParticleEmitter[kSPHMaxEmitterCount];
+		isMultiThreading = workerPool.GetThreadCount() > 1;
+		supportedKernelSet = SPHGetSupportedKernelSet();
+		kernels = &kSPHKernelTables[SPHKernelSet_Scalar];
+
+		options[SimulationOption_ParallelPasses] = { "Parallel integrate, predict and collisions", kSPHOptionBooleanNames, fplArrayCount(kSPHOptionBooleanNames), 1 };
+		options[SimulationOption_Kernels] = { "Kernels", kSPHKernelSetNames, fplArrayCount(kSPHKernelSetNames), SPHKernelSet_Scalar };
+		options[SimulationOption_Storage] = { "Storage", kStorageModeNames, fplArrayCount(kStorageModeNames), StorageMode_Arrays };
+		options[SimulationOption_Neighbors] = { "Neighbors", kNeighborModeNames, fplArrayCount(kNeighborModeNames), NeighborMode_Lists };
+		options[SimulationOption_GatherRelaxation] = { "Gather relaxation", kSPHGatherRelaxationNames, fplArrayCount(kSPHGatherRelaxationNames), kSPHDefaultGatherRelaxation };
+	}
+
+	ParticleSimulation::~ParticleSimulation() {
+		delete[] emitters;
+		delete[] bodies;
+		delete[] cellNeighborIndices;
+		delete[] cellNeighborOffsets;
+		delete[] chunkCellCounts;
+		delete[] cellStarts;
+		delete[] removedParticles;
+		delete[] particlePositions;
+		delete[] particleColors;
+		delete[] particleDeltas;
+		delete[] particleSortIndices;
+		delete[] sortedParticleCellOffsets;
+		delete[] particleCellOffsets;
+		ReleaseParticleStorage(&sortedParticles);
+		ReleaseParticleStorage(&particles);
+	}
+
+	// Grows all particle arrays to the given capacity at least, the arrays which only hold data of a single step are not copied
+	void ParticleSimulation::ReserveParticles(const size_t capacity) {
+		if (capacity <= particleCapacity) {
+			return;
+		}
+		const size_t newCapacity = SPHComputeGrownCapacity(particleCapacity, capacity, kSPHInitialParticleCapacity);
+		assert(newCapacity <= kMaxParticleCapacity);
+		ParticleStorage newParticles;
+		AllocateParticleStorage(&newParticles, newCapacity, storageMode);
+		CopyParticleStorage(particles, &newParticles, particleCount);
+		ReleaseParticleStorage(&particles);
+		particles = newParticles;
+		ReleaseParticleStorage(&sortedParticles);
+		AllocateParticleStorage(&sortedParticles, newCapacity, storageMode);
+		SPHReallocateArray(&particleCellOffsets, gridParticleCount, newCapacity);
+		SPHReallocateArray(&sortedParticleCellOffsets, 0, newCapacity);
+		SPHReallocateArray(&particleSortIndices, 0, newCapacity);
+		SPHReallocateArray(&particleDeltas, 0, newCapacity);
+		SPHReallocateArray(&particleColors, particleCount, newCapacity);
+		SPHReallocateArray(&particlePositions, 0, newCapacity);
+		SPHReallocateArray(&removedParticles, particleCount, newCapacity);
+		particleCapacity = newCapacity;
+	}
+
+	void ParticleSimulation::ClearBodies() {
+		bodyCount = 0;
+	}
+
+	void ParticleSimulation::AddPlane(const Vec2f & normal, const float distance) {
+		Body body = Body();
+		body.type = BodyType::BodyType_Plane;
+		body.plane.normal = normal;
+		body.plane.distance = distance;
+		assert(bodyCount < kSPHMaxBodyCount);
+		size_t bodyIndex = bodyCount++;
+		bodies[bodyIndex] = body;
+	}
+
+	void ParticleSimulation::AddCircle(const Vec2f & pos, const float radius) {
+		Body body = Body();
+		body.type = BodyType::BodyType_Circle;
+		body.circle.pos = pos;
+		body.circle.radius = radius;
+		assert(bodyCount < kSPHMaxBodyCount);
+		size_t bodyIndex = bodyCount++;
+		bodies[bodyIndex] = body;
+	}
+
+	void ParticleSimulation::AddLineSegment(const Vec2f & a, const Vec2f & b) {
+		Body body = Body();
+		body.type = BodyType::BodyType_LineSegment;
+		body.lineSegment.a = a;
+		body.lineSegment.b = b;
+		assert(bodyCount < kSPHMaxBodyCount);
+		size_t bodyIndex = bodyCount++;
+		bodies[bodyIndex] = body;
+	}
+
+	void ParticleSimulation::AddPolygon(const size_t vertexCount, const Vec2f *verts) {
+		Body body = Body();
+		body.type = BodyType::BodyType_Polygon;
+		assert(vertexCount <= kMaxScenarioPolygonCount);
+		for (size_t vertexIndex = 0; vertexIndex < vertexCount; ++vertexIndex) {
+			body.polygon.verts[vertexIndex] = verts[vertexIndex];
+		}
+		body.polygon.vertexCount = vertexCount;
+		SPHComputePolygonNormals(vertexCount, body.polygon.verts, body.polygon.normals);
+		assert(bodyCount < kSPHMaxBodyCount);
+		size_t bodyIndex = bodyCount++;
+		bodies[bodyIndex] = body;
+	}
+
+	void ParticleSimulation::AddSink(const Vec2f &min, const Vec2f &max) {
+		Body body = Body();
+		body.type = BodyType::BodyType_Sink;
+		body.sink.min = min;
+		body.sink.max = max;
+		assert(bodyCount < kSPHMaxBodyCount);
+		size_t bodyIndex = bodyCount++;
+		bodies[bodyIndex] = body;
+	}
+
+	void ParticleSimulation::ClearParticles() {
+		particleCount = 0;
+		gridParticleCount = 0;
+		removedParticleCount = 0;
+		fplMemoryClear(cellStarts, sizeof(uint32_t) * (kSortBucketCount + 1));
+	}
+
+	void ParticleSimulation::ClearEmitters() {
+		emitterCount = 0;
+	}
+
+	void ParticleSimulation::ResetStats() {
+		stats = {};
+	}
+
+	size_t ParticleSimulation::AddParticle(const Vec2f &position, const Vec2f &acceleration) {
+		ReserveParticles(particleCount + 1);
+		size_t particleIndex = particleCount++;
+		const size_t offset = GetParticleOffset(particleIndex);
+		particles.positionX[offset] = particles.prevPositionX[offset] = position.x;
+		particles.positionY[offset] = particles.prevPositionY[offset] = position.y;
+		particles.accelerationX[offset] = acceleration.x;
+		particles.accelerationY[offset] = acceleration.y;
+		particles.velocityX[offset] = particles.velocityY[offset] = 0;
+		particles.density[offset] = particles.nearDensity[offset] = 0;
+		particles.pressure[offset] = particles.nearPressure[offset] = 0;
+		particleColors[particleIndex] = Vec4f();
+		removedParticles[particleIndex] = 0;
+		return particleIndex;
+	}
+
+	// @NOTE: Called from the collision pass for many particles at once, each particle is only marked by the thread which owns it
+	void ParticleSimulation::RemoveParticle(const size_t particleIndex) {
+		assert(particleIndex < particleCount);
+		if (!removedParticles[particleIndex]) {
+			removedParticles[particleIndex] = 1;
+			fplAtomicFetchAndAddU32(&removedParticleCount, 1);
+		}
+	}
+
+	void ParticleSimulation::AddEmitter(const Vec2f &position, const Vec2f &direction, const float radius, const float speed, const float rate, const float duration) {
+		assert(emitterCount < kSPHMaxEmitterCount);
+		ParticleEmitter *emitter = &emitters[emitterCount++];
+		emitter->position = position;
+		emitter->direction = direction;
+		emitter->radius = radius;
+		emitter->speed = speed;
+		emitter->rate = rate;
+		emitter->duration = duration;
+		emitter->elapsed = 0;
+		emitter->totalElapsed = 0;
+		emitter->isActive = true;
+	}
+
+	void ParticleSimulation::AddVolume(const Vec2f &center, const Vec2f &force, const int countX, const int countY, const float spacing) {
+		ReserveParticles(particleCount + countX * countY);
+		Vec2f offset = Vec2f(countX * spacing, countY * spacing) * 0.5f;
+		for (int yIndex = 0; yIndex < countY; ++yIndex) {
+			for (int xIndex = 0; xIndex < countX; ++xIndex) {
+				Vec2f p = Vec2f((float)xIndex, (float)yIndex) * spacing;
+				p += Vec2f(spacing * 0.5f);
+				p += center - offset;
+				Vec2f jitter = Vec2RandomDirection() * kSPHKernelHeight * kSPHVolumeParticleDistributionScale;
+				p += jitter;
+				AddParticle(p, force);
+			}
+		}
+	}
+
+	void ParticleSimulation::UpdateEmitter(ParticleEmitter *emitter, const float deltaTime) {
+		const float spacing = params.particleSpacing;
+		const float invDeltaTime = 1.0f / deltaTime;
+		if (emitter->isActive) {
+			const float rate = 1.0f / emitter->rate;
+			emitter->elapsed += deltaTime;
+			emitter->totalElapsed += deltaTime;
+			if (emitter->elapsed >= rate) {
+				emitter->elapsed = 0;
+				Vec2f acceleration = emitter->direction * emitter->speed * invDeltaTime;
+				Vec2f dir = Vec2Cross(1.0f, emitter->direction);
+				int count = (int)floor(emitter->radius / spacing);
+				float halfSize = (float)count * spacing * 0.5f;
+				Vec2f offset = dir * (float)count * spacing * 0.5f;
+				for (int index = 0; index < count; ++index) {
+					Vec2f p = dir * (float)index * spacing;
+					p += dir * spacing * 0.5f;
+					p += emitter->position - offset;
+					Vec2f jitter = Vec2RandomDirection() * kSPHKernelHeight * kSPHVolumeParticleDistributionScale;
+					p += jitter;
+					AddParticle(p, acceleration);
+				}
+			}
+			if (emitter->totalElapsed >= emitter->duration) {
+				emitter->isActive = false;
+			}
+		}
+	}
+
+	void ParticleSimulation::IntegrateForces(const int64_t startIndex, const int64_t endIndex, const float deltaTime) {
+		const Vec2f force = gravity + externalForce;
+		for (int64_t particleIndex = startIndex; particleIndex <= endIndex; ++particleIndex) {
+			const size_t offset = GetParticleOffset(particleIndex);
+			particles.velocityX[offset] += (particles.accelerationX[offset] + force.x) * deltaTime;
+			particles.velocityY[offset] += (particles.accelerationY[offset] + force.y) * deltaTime;
+			particles.accelerationX[offset] = particles.accelerationY[offset] = 0;
+		}
+	}
+
+	// Gather solver: each particle sums the viscosity of all its pairs from the unchanged velocities, the deltas are applied afterwards
+	void ParticleSimulation::ViscosityForces(const int64_t startIndex, const int64_t endIndex, const float deltaTime) {
+		const SPHKernelBlocks kernelBlocks = GetKernelBlocks();
+		const float relaxation = kSPHGatherRelaxations[options[SimulationOption_GatherRelaxation].value].viscosity;
+		for (int64_t particleIndex = startIndex; particleIndex <= endIndex; ++particleIndex) {
+			const size_t offset = GetParticleOffset(particleIndex);
+			const Vec2f position = Vec2f(particles.positionX[offset], particles.positionY[offset]);
+			const Vec2f velocity = Vec2f(particles.velocityX[offset], particles.velocityY[offset]);
+			Vec2f forceSum = Vec2f();
+			if (useNeighborRanges) {
+				SPHKernelRange ranges[3];
+				size_t rangeCount = GetNeighborRanges(particleIndex, ranges);
+				kernels->blockViscosityForces(params, position, velocity, kernelBlocks, ranges, rangeCount, &forceSum);
+			} else {
+				size_t neighborCount;
+				const uint32_t *neighbors = GetNeighbors(particleIndex, &neighborCount);
+				kernels->viscosityForces(params, position, velocity, GetKernelParticles(), neighbors, neighborCount, &forceSum);
+			}
+			particleDeltas[particleIndex] = forceSum * (-deltaTime * relaxation);
+		}
+	}
+
+	void ParticleSimulation::ApplyVelocityDeltas(const int64_t startIndex, const int64_t endIndex, const float deltaTime) {
+		for (int64_t particleIndex = startIndex; particleIndex <= endIndex; ++particleIndex) {
+			const size_t offset = GetParticleOffset(particleIndex);
+			particles.velocityX[offset] += particleDeltas[particleIndex].x;
+			particles.velocityY[offset] += particleDeltas[particleIndex].y;
+		}
+	}
+
+	void ParticleSimulation::Predict(const int64_t startIndex, const int64_t endIndex, const float deltaTime) {
+		for (int64_t particleIndex = startIndex; particleIndex <= endIndex; ++particleIndex) {
+			const size_t offset = GetParticleOffset(particleIndex);
+			particles.prevPositionX[offset] = particles.positionX[offset];
+			particles.prevPositionY[offset] = particles.positionY[offset];
+			particles.positionX[offset] += particles.velocityX[offset] * deltaTime;
+			particles.positionY[offset] += particles.velocityY[offset] * deltaTime;
+		}
+	}
+
+	// Copies all particles into the other storage in the given mode and swaps the storages
+	void ParticleSimulation::ConvertStorage(const StorageMode mode) {
+		SetParticleStorageMode(&sortedParticles, mode);
+		CopyParticleStorage(particles, &sortedParticles, particleCount);
+		std::swap(particles, sortedParticles);
+		SetParticleStorageMode(&sortedParticles, mode);
+		storageMode = mode;
+	}
+
+	// Rebuilds the grid with a counting sort by cell and moves the particles into cell order, one field after the other
+	// Removed particles are sorted behind all cells and dropped, so the compaction is part of the sort
+	// @NOTE: The sort is stable and the chunks only depend on the particle count, so the order does not depend on the thread timing
+	void ParticleSimulation::SortGrid(const bool useMultiThreading) {
+		const size_t chunkCount = useMultiThreading ? workerPool.GetChunkCount(particleCount, kSPHParallelGrainSize) : 1;
+		auto chunkStart = [&](const size_t chunkIndex) {
+			return (chunkIndex * particleCount) / chunkCount;
+		};
+
+		// Cell of each particle and number of particles per cell for each chunk
+		ForEachRange(useMultiThreading, chunkCount, 1, [&](const size_t startChunk, const size_t endChunk) {
+			for (size_t chunkIndex = startChunk; chunkIndex <= endChunk; ++chunkIndex) {
+				uint32_t *cellCounts = &chunkCellCounts[chunkIndex * kSortBucketCount];
+				fplMemoryClear(cellCounts, sizeof(uint32_t) * kSortBucketCount);
+				for (size_t particleIndex = chunkStart(chunkIndex), end = chunkStart(chunkIndex + 1); particleIndex < end; ++particleIndex) {
+					uint32_t cellOffset = (uint32_t)kSPHGridTotalCount;
+					if (!removedParticles[particleIndex]) {
+						const size_t offset = GetParticleOffset(particleIndex);
+						Vec2i cellIndex = SPHComputeCellIndex(Vec2f(particles.positionX[offset], particles.positionY[offset]));
+						cellOffset = (uint32_t)SPHComputeCellOffset(cellIndex.x, cellIndex.y);
+					}
+					particleCellOffsets[particleIndex] = cellOffset;
+					++cellCounts[cellOffset];
+				}
+			}
+		});
+
+		// First particle of each cell
+		ForEachRange(useMultiThreading, kSortBucketCount, kSPHParallelCellGrainSize, [&](const size_t startIndex, const size_t endIndex) {
+			for (size_t cellOffset = startIndex; cellOffset <= endIndex; ++cellOffset) {
+				uint32_t count = 0;
+				for (size_t chunkIndex = 0; chunkIndex < chunkCount; ++chunkIndex) {
+					count += chunkCellCounts[chunkIndex * kSortBucketCount + cellOffset];
+				}
+				cellStarts[cellOffset] = count;
+			}
+		});
+		cellStarts[kSortBucketCount] = 0;
+		SPHExclusiveScan(cellStarts, kSortBucketCount + 1);
+		assert(cellStarts[kSortBucketCount] == particleCount);
+		assert(cellStarts[kSortBucketCount] - cellStarts[kSPHGridTotalCount] == removedParticleCount);
+
+		// First particle of each cell per chunk
+		ForEachRange(useMultiThreading, kSortBucketCount, kSPHParallelCellGrainSize, [&](const size_t startIndex, const size_t endIndex) {
+			for (size_t cellOffset = startIndex; cellOffset <= endIndex; ++cellOffset) {
+				uint32_t offset = cellStarts[cellOffset];
+				for (size_t chunkIndex = 0; chunkIndex < chunkCount; ++chunkIndex) {
+					uint32_t *cellCount = &chunkCellCounts[chunkIndex * kSortBucketCount + cellOffset];
+					uint32_t count = *cellCount;
+					*cellCount = offset;
+					offset += count;
+				}
+			}
+		});
+
+		// Index of each particle in cell order
+		ForEachRange(useMultiThreading, chunkCount, 1, [&](const size_t startChunk, const size_t endChunk) {
+			for (size_t chunkIndex = startChunk; chunkIndex <= endChunk; ++chunkIndex) {
+				uint32_t *cellOffsets = &chunkCellCounts[chunkIndex * kSortBucketCount];
+				for (size_t particleIndex = chunkStart(chunkIndex), end = chunkStart(chunkIndex + 1); particleIndex < end; ++particleIndex) {
+					particleSortIndices[particleIndex] = cellOffsets[particleCellOffsets[particleIndex]]++;
+				}
+			}
+		});
+
+		// Move the particles into cell order, every field is read in order and written to at most a few cells at once
+		// @NOTE: Both storages always have the same mode, so the blocks of the sorted particles are filled in cell order too
+		const size_t blockStride = particles.blockStride;
+		assert(sortedParticles.blockStride == blockStride);
+		ForEachRange(useMultiThreading, particleCount, kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
+			for (size_t fieldIndex = 0; fieldIndex < ParticleField_Count; ++fieldIndex) {
+				const float *source = particles.fields[fieldIndex];
+				float *target = sortedParticles.fields[fieldIndex];
+				for (size_t particleIndex = startIndex; particleIndex <= endIndex; ++particleIndex) {
+					target[SPHComputeBlockOffset(particleSortIndices[particleIndex], blockStride)] = source[SPHComputeBlockOffset(particleIndex, blockStride)];
+				}
+			}
+			for (size_t particleIndex = startIndex; particleIndex <= endIndex; ++particleIndex) {
+				sortedParticleCellOffsets[particleSortIndices[particleIndex]] = particleCellOffsets[particleIndex];
+			}
+		});
+		std::swap(particles, sortedParticles);
+		std::swap(particleCellOffsets, sortedParticleCellOffsets);
+		if (removedParticleCount > 0) {
+			// The removed flags belong to the old order, but all particles before the removed ones are alive
+			particleCount = cellStarts[kSPHGridTotalCount];
+			fplMemoryClear(removedParticles, sizeof(uint8_t) * particleCount);
+			stats.removedParticleCount += removedParticleCount;
+			removedParticleCount = 0;
+		}
+		gridParticleCount = particleCount;
+
+		for (size_t cellOffset = 0; cellOffset < kSPHGridTotalCount; ++cellOffset) {
+			size_t count = cellStarts[cellOffset + 1] - cellStarts[cellOffset];
+			stats.minCellParticleCount = std::min(count, stats.minCellParticleCount);
+			stats.maxCellParticleCount = std::max(count, stats.maxCellParticleCount);
+		}
+	}
+
+	// Calls func(startIndex, endIndex) for the particles of each row of the 3x3 cells around the given cell, the end is exclusive
+	template<typename F>
+	inline void ParticleSimulation::ForEachNeighborRange(const size_t cellOffset, F &&func) {
+		const int cellX = (int)(cellOffset % kSPHGridCountX);
+		const int cellY = (int)(cellOffset / kSPHGridCountX);
+		const int minX = std::max(cellX - 1, 0);
+		const int maxX = std::min(cellX + 1, kSPHGridCountX - 1);
+		for (int y = std::max(cellY - 1, 0), maxY = std::min(cellY + 1, kSPHGridCountY - 1); y <= maxY; ++y) {
+			func(cellStarts[SPHComputeCellOffset(minX, y)], cellStarts[SPHComputeCellOffset(maxX, y) + 1]);
+		}
+	}
+
+	inline size_t ParticleSimulation::GetNeighborRanges(const size_t particleIndex, SPHKernelRange outRanges[3]) {
+		if (particleIndex >= gridParticleCount) {
+			return(0);
+		}
+		size_t rangeCount = 0;
+		ForEachNeighborRange(particleCellOffsets[particleIndex], [&](const uint32_t start, const uint32_t end) {
+			outRanges[rangeCount].start = start;
+			outRanges[rangeCount].end = end;
+			++rangeCount;
+		});
+		return(rangeCount);
+	}
+
+	void ParticleSimulation::CountCellNeighbors(const int64_t startIndex, const int64_t endIndex) {
+		for (int64_t cellOffset = startIndex; cellOffset <= endIndex; ++cellOffset) {
+			uint32_t neighborCount = 0;
+			if (cellStarts[cellOffset + 1] > cellStarts[cellOffset]) {
+				ForEachNeighborRange(cellOffset, [&](const uint32_t start, const uint32_t end) {
+					neighborCount += end - start;
+				});
+			}
+			cellNeighborOffsets[cellOffset] = neighborCount;
+		}
+	}
+
+	void ParticleSimulation::CellNeighborSearch(const int64_t startIndex, const int64_t endIndex) {
+		for (int64_t cellOffset = startIndex; cellOffset <= endIndex; ++cellOffset) {
+			if (cellStarts[cellOffset + 1] == cellStarts[cellOffset]) continue;
+			uint32_t *neighbors = &cellNeighborIndices[cellNeighborOffsets[cellOffset]];
+			size_t neighborCount = 0;
+			ForEachNeighborRange(cellOffset, [&](const uint32_t start, const uint32_t end) {
+				for (uint32_t particleIndex = start; particleIndex < end; ++particleIndex) {
+					neighbors[neighborCount++] = particleIndex;
+				}
+			});
+			assert(neighborCount == cellNeighborOffsets[cellOffset + 1] - cellNeighborOffsets[cellOffset]);
+		}
+	}
+
+	void ParticleSimulation::NeighborSearch(const bool useMultiThreading) {
+		ForEachRange(useMultiThreading, kSPHGridTotalCount, kSPHParallelCellGrainSize, [&](const size_t startIndex, const size_t endIndex) {
+			this->CountCellNeighbors(startIndex, endIndex);
+		});
+
+		// @NOTE: The extra zero at the end turns into the total neighbor count
+		cellNeighborOffsets[kSPHGridTotalCount] = 0;
+		uint64_t totalNeighborCount = SPHExclusiveScan(cellNeighborOffsets, kSPHGridTotalCount + 1);
+		// @NOTE: Cell neighbor offsets are 32-bit as well, dense cells can exceed them long before the particle capacity is reached
+		fplAlwaysAssert(totalNeighborCount <= UINT32_MAX);
+
+		// @NOTE: Neighbor ranges come straight from the cell starts, only the counts are needed for the statistics
+		if (!useNeighborRanges) {
+			if (totalNeighborCount > cellNeighborCapacity) {
+				delete[] cellNeighborIndices;
+				cellNeighborCapacity = totalNeighborCount + totalNeighborCount / 2;
+				cellNeighborIndices = new uint32_t[cellNeighborCapacity];
+			}
+			ForEachRange(useMultiThreading, kSPHGridTotalCount, kSPHParallelCellGrainSize, [&](const size_t startIndex, const size_t endIndex) {
+				this->CellNeighborSearch(startIndex, endIndex);
+			});
+		}
+
+		stats.minParticleNeighborCount = kSPHMaxParticleNeighborCount;
+		stats.maxParticleNeighborCount = 0;
+		for (size_t cellOffset = 0; cellOffset < kSPHGridTotalCount; ++cellOffset) {
+			if (cellStarts[cellOffset + 1] == cellStarts[cellOffset]) continue;
+			size_t neighborCount = cellNeighborOffsets[cellOffset + 1] - cellNeighborOffsets[cellOffset];
+			stats.minParticleNeighborCount = std::min(neighborCount, stats.minParticleNeighborCount);
+			stats.maxParticleNeighborCount = std::max(neighborCount, stats.maxParticleNeighborCount);
+		}
+	}
+
+	void ParticleSimulation::DensityAndPressure(const int64_t startIndex, const int64_t endIndex, const float deltaTime) {
+		const SPHKernelBlocks kernelBlocks = GetKernelBlocks();
+		for (int64_t particleIndex = startIndex; particleIndex <= endIndex; ++particleIndex) {
+			const size_t offset = GetParticleOffset(particleIndex);
+			const Vec2f position = Vec2f(particles.positionX[offset], particles.positionY[offset]);
+			float densities[2] = {};
+			float pressures[2];
+			if (useNeighborRanges) {
+				SPHKernelRange ranges[3];
+				size_t rangeCount = GetNeighborRanges(particleIndex, ranges);
+				kernels->blockDensities(params, position, kernelBlocks, ranges, rangeCount, densities);
+			} else {
+				size_t neighborCount;
+				const uint32_t *neighbors = GetNeighbors(particleIndex, &neighborCount);
+				kernels->densities(params, position, GetKernelParticles(), neighbors, neighborCount, densities);
+			}
+			SPHComputePressure(params, densities, pressures);
+			particles.density[offset] = densities[0];
+			particles.nearDensity[offset] = densities[1];
+			particles.pressure[offset] = pressures[0];
+			particles.nearPressure[offset] = pressures[1];
+		}
+	}
+
+	void ParticleSimulation::DeltaPositions(const int64_t startIndex, const int64_t endIndex, const float deltaTime) {
+		const SPHKernelBlocks kernelBlocks = GetKernelBlocks();
+		const float relaxation = kSPHGatherRelaxations[options[SimulationOption_GatherRelaxation].value].delta;
+		for (int64_t particleIndex = startIndex; particleIndex <= endIndex; ++particleIndex) {
+			const size_t offset = GetParticleOffset(particleIndex);
+			const Vec2f position = Vec2f(particles.positionX[offset], particles.positionY[offset]);
+			const float pressure[2] = { particles.pressure[offset], particles.nearPressure[offset] };
+			Vec2f dx = Vec2f();
+			if (useNeighborRanges) {
+				SPHKernelRange ranges[3];
+				size_t rangeCount = GetNeighborRanges(particleIndex, ranges);
+				kernels->blockDeltas(params, position, pressure, kernelBlocks, ranges, rangeCount, deltaTime, &dx);
+			} else {
+				size_t neighborCount;
+				const uint32_t *neighbors = GetNeighbors(particleIndex, &neighborCount);
+				kernels->deltas(params, position, pressure, GetKernelParticles(), neighbors, neighborCount, deltaTime, &dx);
+			}
+			particleDeltas[particleIndex] = SPHClampGatherDelta(dx * relaxation);
+		}
+	}
+
+	void ParticleSimulation::ApplyPositionDeltas(const int64_t startIndex, const int64_t endIndex, const float deltaTime) {
+		for (int64_t particleIndex = startIndex; particleIndex <= endIndex; ++particleIndex) {
+			const size_t offset = GetParticleOffset(particleIndex);
+			particles.positionX[offset] += particleDeltas[particleIndex].x;
+			particles.positionY[offset] += particleDeltas[particleIndex].y;
+		}
+	}
+
+	void ParticleSimulation::SolveCollisions(const int64_t startIndex, const int64_t endIndex, const float deltaTime) {
+		for (int64_t particleIndex = startIndex; particleIndex <= endIndex; ++particleIndex) {
+			const size_t offset = GetParticleOffset(particleIndex);
+			Vec2f position = Vec2f(particles.positionX[offset], particles.positionY[offset]);
+			for (size_t bodyIndex = 0; bodyIndex < bodyCount; ++bodyIndex) {
+				Body *body = &bodies[bodyIndex];
+				switch (body->type) {
+					case BodyType::BodyType_Plane:
+					{
+						Plane *plane = &body->plane;
+						SPHSolvePlaneCollision(&position, plane->normal, plane->distance);
+					} break;
+					case BodyType::BodyType_Circle:
+					{
+						Circle *circle = &body->circle;
+						SPHSolveCircleCollision(&position, circle->pos, circle->radius);
+					} break;
+					case BodyType::BodyType_LineSegment:
+					{
+						LineSegment *lineSegment = &body->lineSegment;
+						SPHSolveLineSegmentCollision(&position, lineSegment->a, lineSegment->b);
+					} break;
+					case BodyType::BodyType_Polygon:
+					{
+						Poly *polygon = &body->polygon;
+						SPHSolvePolygonCollision(&position, polygon->vertexCount, polygon->verts, polygon->normals);
+					} break;
+					case BodyType::BodyType_Sink:
+					{
+						Sink *sink = &body->sink;
+						if (SPHIsPositionInSink(position, sink->min, sink->max)) {
+							RemoveParticle(particleIndex);
+						}
+					} break;
+				}
+			}
+			particles.positionX[offset] = position.x;
+			particles.positionY[offset] = position.y;
+		}
+	}
+
+	void ParticleSimulation::UpdateVelocities(const int64_t startIndex, const int64_t endIndex, const float deltaTime) {
+		const float invDt = 1.0f / deltaTime;
+		for (int64_t particleIndex = startIndex; particleIndex <= endIndex; ++particleIndex) {
+			const size_t offset = GetParticleOffset(particleIndex);
+			particles.velocityX[offset] = (particles.positionX[offset] - particles.prevPositionX[offset]) * invDt;
+			particles.velocityY[offset] = (particles.positionY[offset] - particles.prevPositionY[offset]) * invDt;
+		}
+	}
+
+	// Calls func(startIndex, endIndex) in parallel or for the whole range on the calling thread
+	template<typename F>
+	void ParticleSimulation::ForEachRange(const bool useMultiThreading, const size_t count, const size_t grain, F &&func) {
+		if (useMultiThreading) {
+			workerPool.ParallelFor(count, grain, func);
+		} else if (count > 0) {
+			func(0, count - 1);
+		}
+	}
+
+	void ParticleSimulation::Update(const float deltaTime) {
+		const bool useMultiThreading = isMultiThreading;
+		kernels = &kSPHKernelTables[std::min((SPHKernelSet)options[SimulationOption_Kernels].value, supportedKernelSet)];
+		if (options[SimulationOption_Storage].value != storageMode) {
+			ConvertStorage((StorageMode)options[SimulationOption_Storage].value);
+		}
+		useNeighborRanges = storageMode == StorageMode_Blocks || options[SimulationOption_Neighbors].value == NeighborMode_Ranges;
+		stats.waitTime = {};
+		stats.time = {};
+		const size_t barrierCount = workerPool.GetBarrierCount();
+		const double parallelTime = workerPool.GetParallelTime();
+		auto updateStartClock = std::chrono::high_resolution_clock::now();
+
+		// Emitters
+		{
+			auto startClock = std::chrono::high_resolution_clock::now();
+			for (size_t emitterIndex = 0; emitterIndex < emitterCount; ++emitterIndex) {
+				ParticleEmitter *emitter = &emitters[emitterIndex];
+				UpdateEmitter(emitter, deltaTime);
+			}
+			auto deltaClock = std::chrono::high_resolution_clock::now() - startClock;
+			stats.time.emitters = std::chrono::duration_cast<std::chrono::nanoseconds>(deltaClock).count() * nanosToMilliseconds;
+		}
+
+		if (particleCount > 0) {
+			UpdatePhases(deltaTime, useMultiThreading);
+		}
+
+		stats.barrierCount = workerPool.GetBarrierCount() - barrierCount;
+		auto updateDeltaClock = std::chrono::high_resolution_clock::now() - updateStartClock;
+		float updateTime = std::chrono::duration_cast<std::chrono::nanoseconds>(updateDeltaClock).count() * nanosToMilliseconds;
+		stats.serialFraction = SPHComputeSerialFraction(updateTime, (float)(workerPool.GetParallelTime() - parallelTime));
+	}
+
+	void ParticleSimulation::UpdatePhases(const float deltaTime, const bool useMultiThreading) {
+		// @NOTE: The solver always gathers, so the particle passes never write into other particles and need no colors or locks
+		const bool useParallelPasses = useMultiThreading && options[SimulationOption_ParallelPasses].value;
+
+		// Integrate forces
+		{
+			auto startClock = std::chrono::high_resolution_clock::now();
+			ForEachRange(useParallelPasses, particleCount, kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
+				this->IntegrateForces(startIndex, endIndex, deltaTime);
+			});
+			auto deltaClock = std::chrono::high_resolution_clock::now() - startClock;
+			stats.time.integration = std::chrono::duration_cast<std::chrono::nanoseconds>(deltaClock).count() * nanosToMilliseconds;
+		}
+
+		// Viscosity force
+		{
+			auto startClock = std::chrono::high_resolution_clock::now();
+			ForEachRange(useMultiThreading, particleCount, kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
+				this->ViscosityForces(startIndex, endIndex, deltaTime);
+			});
+			ForEachRange(useMultiThreading, particleCount, kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
+				this->ApplyVelocityDeltas(startIndex, endIndex, deltaTime);
+			});
+			auto deltaClock = std::chrono::high_resolution_clock::now() - startClock;
+			stats.time.viscosityForces = std::chrono::duration_cast<std::chrono::nanoseconds>(deltaClock).count() * nanosToMilliseconds;
+		}
+
+		// Predict
+		{
+			auto startClock = std::chrono::high_resolution_clock::now();
+			ForEachRange(useParallelPasses, particleCount, kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
+				this->Predict(startIndex, endIndex, deltaTime);
+			});
+			auto deltaClock = std::chrono::high_resolution_clock::now() - startClock;
+			stats.time.predict = std::chrono::duration_cast<std::chrono::nanoseconds>(deltaClock).count() * nanosToMilliseconds;
+		}
+
+		// Update grid
+		{
+			auto startClock = std::chrono::high_resolution_clock::now();
+			SortGrid(useMultiThreading);
+			++stats.gridSortCount;
+			auto deltaClock = std::chrono::high_resolution_clock::now() - startClock;
+			stats.time.updateGrid = std::chrono::duration_cast<std::chrono::nanoseconds>(deltaClock).count() * nanosToMilliseconds;
+		}
+
+		// Neighbor search
+		{
+			auto startClock = std::chrono::high_resolution_clock::now();
+			NeighborSearch(useMultiThreading);
+			++stats.neighborRebuildCount;
+			auto deltaClock = std::chrono::high_resolution_clock::now() - startClock;
+			stats.time.neighborSearch = std::chrono::duration_cast<std::chrono::nanoseconds>(deltaClock).count() * nanosToMilliseconds;
+		}
+
+		// Density and pressure
+		{
+			auto startClock = std::chrono::high_resolution_clock::now();
+			ForEachRange(useMultiThreading, particleCount, kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
+				this->DensityAndPressure(startIndex, endIndex, deltaTime);
+			});
+			auto deltaClock = std::chrono::high_resolution_clock::now() - startClock;
+			stats.time.densityAndPressure = std::chrono::duration_cast<std::chrono::nanoseconds>(deltaClock).count() * nanosToMilliseconds;
+		}
+
+		// Calculate delta position
+		{
+			auto startClock = std::chrono::high_resolution_clock::now();
+			ForEachRange(useMultiThreading, particleCount, kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
+				this->DeltaPositions(startIndex, endIndex, deltaTime);
+			});
+			ForEachRange(useMultiThreading, particleCount, kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
+				this->ApplyPositionDeltas(startIndex, endIndex, deltaTime);
+			});
+			auto deltaClock = std::chrono::high_resolution_clock::now() - startClock;
+			stats.time.deltaPositions = std::chrono::duration_cast<std::chrono::nanoseconds>(deltaClock).count() * nanosToMilliseconds;
+		}
+
+		// Solve collisions and recalculate velocity for next frame
+		{
+			auto startClock = std::chrono::high_resolution_clock::now();
+			ForEachRange(useParallelPasses, particleCount, kSPHParallelGrainSize, [&](const size_t startIndex, const size_t endIndex) {
+				this->SolveCollisions(startIndex, endIndex, deltaTime);
+				this->UpdateVelocities(startIndex, endIndex, deltaTime);
+			});
+			auto deltaClock = std::chrono::high_resolution_clock::now() - startClock;
+			stats.time.collisions = std::chrono::duration_cast<std::chrono::nanoseconds>(deltaClock).count() * nanosToMilliseconds;
+		}
+	}
+
+	void ParticleSimulation::Render(Render::CommandBuffer *commandBuffer, const float worldToScreenScale) {
+		// Domain
+		Vec4f domainColor = Vec4f(1.0f, 0.0f, 1.0f, 1.0f);
+		Render::PushRectangle(commandBuffer, Vec2f(-kSPHBoundaryHalfWidth, -kSPHBoundaryHalfHeight), Vec2f(kSPHBoundaryHalfWidth, kSPHBoundaryHalfHeight) * 2.0f, domainColor, false, 1.0f);
+
+		// Grid fill
+		for (int yIndexInner = 0; yIndexInner < kSPHGridCountY; ++yIndexInner) {
+			for (int xIndexInner = 0; xIndexInner < kSPHGridCountX; ++xIndexInner) {
+				size_t cellOffset = SPHComputeCellOffset(xIndexInner, yIndexInner);
+				Vec2f innerP = kSPHGridOrigin + Vec2f((float)xIndexInner, (float)yIndexInner) * kSPHGridCellSize;
+				Vec2f innerSize = Vec2f(kSPHGridCellSize);
+				if (cellStarts[cellOffset + 1] > cellStarts[cellOffset]) {
+					Render::PushRectangle(commandBuffer, innerP, innerSize, ColorLightGray, true);
+				}
+			}
+		}
+
+		// Grid lines
+		for (int yIndex = 0; yIndex < kSPHGridCountY; ++yIndex) {
+			Vec2f startP = kSPHGridOrigin + Vec2f(0, (float)yIndex) * kSPHGridCellSize;
+			Vec2f endP = kSPHGridOrigin + Vec2f((float)kSPHGridCountX, (float)yIndex) * kSPHGridCellSize;
+			Render::PushLine(commandBuffer, startP, endP, ColorDarkGray, 1.0f);
+		}
+		for (int xIndex = 0; xIndex < kSPHGridCountX; ++xIndex) {
+			Vec2f startP = kSPHGridOrigin + Vec2f((float)xIndex, 0) * kSPHGridCellSize;
+			Vec2f endP = kSPHGridOrigin + Vec2f((float)xIndex, (float)kSPHGridCountY) * kSPHGridCellSize;
+			Render::PushLine(commandBuffer, startP, endP, ColorDarkGray, 1.0f);
+		}
+
+		// Bodies
+		for (int bodyIndex = 0; bodyIndex < bodyCount; ++bodyIndex) {
+			Body *body = &bodies[bodyIndex];
+			switch (body->type) {
+				case BodyType::BodyType_Plane:
+				{
+					Plane *plane = &body->plane;
+					plane->Render(commandBuffer);
+				}
+				break;
+				case BodyType::BodyType_Circle:
+				{
+					Circle *circle = &body->circle;
+					circle->Render(commandBuffer);
+				}
+				break;
+				case BodyType::BodyType_LineSegment:
+				{
+					LineSegment *lineSegment = &body->lineSegment;
+					lineSegment->Render(commandBuffer);
+				}
+				break;
+				case BodyType::BodyType_Polygon:
+				{
+					Poly *polygon = &body->polygon;
+					polygon->Render(commandBuffer);
+				}
+				break;
+				case BodyType::BodyType_Sink:
+				{
+					Sink *sink = &body->sink;
+					sink->Render(commandBuffer);
+				}
+				break;
+			}
+		}
+
+		// Emitters
+		for (int emitterIndex = 0; emitterIndex < emitterCount; ++emitterIndex) {
+			ParticleEmitter *emitter = &emitters[emitterIndex];
+			emitter->Render(commandBuffer);
+		}
+
+		// Particles, the renderer needs interleaved positions
+		for (int particleIndex = 0; particleIndex < particleCount; ++particleIndex) {
+			const size_t offset = GetParticleOffset(particleIndex);
+			Vec2f velocity = Vec2f(particles.velocityX[offset], particles.velocityY[offset]);
+			particlePositions[particleIndex] = Vec2f(particles.positionX[offset], particles.positionY[offset]);
+			particleColors[particleIndex] = SPHGetParticleColor(params.restDensity, particles.density[offset], particles.pressure[offset], velocity);
+		}
+		float pointSize = kSPHParticleRenderRadius * 2.0f * worldToScreenScale;
+		void *vertices = (void *)((uint8_t *)&particlePositions[0]);
+		void *colors = (void *)((uint8_t *)&particleColors[0]);
+		uint32_t vertexStride = sizeof(Vec2f);
+		uint32_t colorStride = sizeof(Vec4f);
+		Render::PushVertexIndexArrayHeader(commandBuffer, vertexStride, vertices, 0, nullptr, colorStride, colors, 0, nullptr);
+		Render::PushVertexIndexArrayDraw(commandBuffer, Render::PrimitiveType::Points, (uint32_t)particleCount, pointSize, nullptr, {}, false);
+	}
+
+	void Plane::Render(Render::CommandBuffer *commandBuffer) {
+		Vec2f p = normal * distance;
+		Vec2f t = Vec2f(normal.y, -normal.x);
+		Vec4f color = ColorBlue;
+		Vec2f a = Vec2f(p.x + t.x * kSPHVisualPlaneLength, p.y + t.y * kSPHVisualPlaneLength);
+		Vec2f b = Vec2f(p.x - t.x * kSPHVisualPlaneLength, p.y - t.y * kSPHVisualPlaneLength);
+		Render::PushLine(commandBuffer, a, b, color, 1.0f);
+	}
+
+	void Circle::Render(Render::CommandBuffer *commandBuffer) {
+		Vec4f color = ColorBlue;
+		Render::PushCircle(commandBuffer, pos, radius, color, 1.0f, false);
+	}
+
+	void LineSegment::Render(Render::CommandBuffer *commandBuffer) {
+		Vec4f color = ColorBlue;
+		Render::PushLine(commandBuffer, a, b, color, 1.0f);
+	}
+
+	void Poly::Render(Render::CommandBuffer *commandBuffer) {
+		Vec4f color = ColorBlue;
+		Render::PushPolygonFrom(commandBuffer, &verts[0], vertexCount, color, false, 1.0f);
+	}
+
+	void Sink::Render(Render::CommandBuffer *commandBuffer) {
+		Vec4f color = ColorGreen;
+		Render::PushRectangle(commandBuffer, min, max - min, color, false, 1.0f);
+	}
+
+	void ParticleEmitter::Render(Render::CommandBuffer *commandBuffer) {
+		Render::PushCircle(commandBuffer, position, radius * 0.25f, ColorRed, 1.0f, false);
+	}
+}
+
+#endif // DEMO5_IMPLEMENTATION
@@ -0,0 +1,381 @@
+/* Demo 5 - Data oriented style with a structure of arrays or arrays of blocks */
+
+#ifndef DEMO5_H
+#define DEMO5_H
+
+#include <assert.h>
+#include <random>
+
+#include "vecmath.h"
+#include "sph.h"
+#include "sphsimd.h"
+#include "threading.h"
+#include "base.h"
+#include "render.h"
+
+namespace Demo5 {
+	const char *kDemoName = "Demo 5";
+
+	enum BodyType {
+		BodyType_None = 0,
+
+		BodyType_Plane = 1,
+		BodyType_Circle = 2,
+		BodyType_LineSegment = 3,
+		BodyType_Polygon = 4,
+		BodyType_Sink = 5,
+
+		BodyType_Count,
+	};
+
+	struct Plane {
+		Vec2f normal;
+		float distance;
+		uint8_t padding0[4];
+
+		void Render(Render::CommandBuffer *commandBuffer);
+	};
+
+	struct Circle {
+		Vec2f pos;
+		float radius;
+		uint8_t padding0[4];
+
+		void Render(Render::CommandBuffer *commandBuffer);
+	};
+
+	struct LineSegment {
+		Vec2f a, b;
+
+		void Render(Render::CommandBuffer *commandBuffer);
+	};
+
+	struct Poly {
+		Vec2f verts[kMaxScenarioPolygonCount];
+		// Edge normals, computed once when the polygon is added
+		Vec2f normals[kMaxScenarioPolygonCount];
+		size_t vertexCount;
+
+		void Render(Render::CommandBuffer *commandBuffer);
+	};
+
+	// Particles inside the box are removed
+	struct Sink {
+		Vec2f min;
+		Vec2f max;
+
+		void Render(Render::CommandBuffer *commandBuffer);
+	};
+
+	struct Body {
+		BodyType type;
+		uint8_t padding0[4];
+
+		union {
+			Plane plane;
+			Circle circle;
+			LineSegment lineSegment;
+			Poly polygon;
+			Sink sink;
+		};
+
+		Body() {
+		}
+
+		Body(const Body &body) {
+			type = body.type;
+			plane = body.plane;
+			circle = body.circle;
+			lineSegment = body.lineSegment;
+			polygon = body.polygon;
+			sink = body.sink;
+		}
+	};
+
+	enum ParticleField {
+		ParticleField_PositionX = 0,
+		ParticleField_PositionY,
+		ParticleField_PrevPositionX,
+		ParticleField_PrevPositionY,
+		ParticleField_AccelerationX,
+		ParticleField_AccelerationY,
+		ParticleField_VelocityX,
+		ParticleField_VelocityY,
+		ParticleField_Density,
+		ParticleField_NearDensity,
+		ParticleField_Pressure,
+		ParticleField_NearPressure,
+
+		ParticleField_Count,
+	};
+
+	// Every field starts on a cache line and has room for a full AVX2 register past the last particle
+	const size_t kParticleFieldAlignment = 64;
+	const size_t kParticleFieldLaneCount = 8;
+	fplStaticAssert(kParticleFieldLaneCount == kSPHKernelBlockWidth);
+
+	enum StorageMode {
+		// Each field of all particles is one aligned float array, so a pass only loads the fields it uses
+		StorageMode_Arrays = 0,
+		// All fields of 8 particles are one block of 8 floats per field, so the neighbors of a block are in a few cache lines and each field loads into one AVX2 register
+		StorageMode_Blocks,
+	};
+	const char *const kStorageModeNames[] = { "SoA", "AoSoA blocks" };
+
+	enum NeighborMode {
+		// Neighbor indices per cell, the kernels gather the neighbors lane by lane
+		NeighborMode_Lists = 0,
+		// The 3 particle ranges of the 3x3 cells, the kernels load the neighbors block by block
+		NeighborMode_Ranges,
+	};
+	const char *const kNeighborModeNames[] = { "Cell lists", "Cell ranges" };
+
+	// Particle fields in either storage mode, field f of particle i is at fields[f][SPHComputeBlockOffset(i, blockStride)]
+	// @NOTE: Both modes use the same memory, so the storage mode can be changed by copying the particles into the other storage
+	struct ParticleStorage {
+		union {
+			struct {
+				float *positionX;
+				float *positionY;
+				float *prevPositionX;
+				float *prevPositionY;
+				float *accelerationX;
+				float *accelerationY;
+				float *velocityX;
+				float *velocityY;
+				float *density;
+				float *nearDensity;
+				float *pressure;
+				float *nearPressure;
+			};
+			float *fields[ParticleField_Count];
+		};
+		void *memory;
+		size_t fieldCapacity;
+		size_t blockStride;
+	};
+
+	// @NOTE: Neighbor offsets and indices are 32-bit, so the total number of neighbors must fit, which it does as long as the average particle has less than the max neighbor count
+	const size_t kMaxParticleCapacity = UINT32_MAX / kSPHMaxParticleNeighborCount;
+
+	// The grid sort has one bucket per cell and one after all cells for the removed particles, so they end up behind the last cell and are dropped
+	const size_t kSortBucketCount = kSPHGridTotalCount + 1;
+
+	enum SimulationOption {
+		SimulationOption_ParallelPasses = 0,
+		SimulationOption_Kernels,
+		SimulationOption_Storage,
+		SimulationOption_Neighbors,
+		SimulationOption_GatherRelaxation,
+
+		SimulationOption_Count,
+	};
+
+	struct ParticleEmitter {
+		Vec2f position;
+		Vec2f direction;
+		float radius;
+		float speed;
+		float rate;
+		float duration;
+		float elapsed;
+		float totalElapsed;
+		int32_t isActive;
+
+		void Render(Render::CommandBuffer *commandBuffer);
+	};
+
+	struct ParticleSimulation : BaseSimulation {
+		SPHParameters params;
+		SPHStatistics stats;
+
+		Vec2f gravity;
+		Vec2f externalForce;
+
+		size_t particleCount;
+		// All particle arrays have room for this many particles and grow when a particle is added to the full arrays
+		size_t particleCapacity;
+		ParticleStorage particles;
+		// Particles are sorted into this and then swapped with the particles
+		ParticleStorage sortedParticles;
+		// Cell offset of each particle at the last grid sort, particles added after the sort have no cell until the next one
+		uint32_t *particleCellOffsets;
+		uint32_t *sortedParticleCellOffsets;
+		// Index of each particle after the grid sort
+		uint32_t *particleSortIndices;
+		// Velocity or position change of each particle for the gather solver
+		Vec2f *particleDeltas;
+		Vec4f *particleColors;
+		Vec2f *particlePositions;
+		// Particles marked as removed stay in the simulation until the next grid sort
+		uint8_t *removedParticles;
+		volatile uint32_t removedParticleCount;
+
+		// Particles are always in cell order, so the particles of cell c are [cellStarts[c], cellStarts[c + 1]) and the 3 cells of a row in the 3x3 cells are contiguous
+		// Has an entry for each sort bucket and one for the end
+		uint32_t *cellStarts;
+		uint32_t *chunkCellCounts;
+		size_t gridParticleCount;
+
+		// All particles of a cell share the same neighbors, so the neighbors are stored as compressed rows per cell, the neighbors of cell c are cellNeighborIndices[cellNeighborOffsets[c], cellNeighborOffsets[c + 1])
+		uint32_t *cellNeighborOffsets;
+		uint32_t *cellNeighborIndices;
+		size_t cellNeighborCapacity;
+
+		size_t bodyCount;
+		Body *bodies;
+
+		size_t emitterCount;
+		ParticleEmitter *emitters;
+
+		bool isMultiThreading;
+		ThreadPool workerPool;
+
+		SPHOption options[SimulationOption_Count];
+
+		// Storage mode of the particles, blocks always use neighbor ranges
+		StorageMode storageMode;
+		bool useNeighborRanges;
+
+		// Kernels of the selected kernel set, or of the best supported one when the CPU does not support it
+		SPHKernelSet supportedKernelSet;
+		const SPHKernelTable *kernels;
+
+		ParticleSimulation();
+		~ParticleSimulation();
+
+		void ResetStats();
+		void ReserveParticles(const size_t capacity);
+		void ClearBodies();
+		void ClearParticles();
+		void ClearEmitters();
+
+		void AddPlane(const Vec2f &normal, const float distance);
+		void AddCircle(const Vec2f &pos, const float radius);
+		void AddLineSegment(const Vec2f &a, const Vec2f &b);
+		void AddPolygon(const size_t vertexCount, const Vec2f *verts);
+		void AddSink(const Vec2f &min, const Vec2f &max);
+
+		size_t AddParticle(const Vec2f &position, const Vec2f &force);
+		void AddVolume(const Vec2f &center, const Vec2f &force, const int countX, const int countY, const float spacing);
+		void AddEmitter(const Vec2f &position, const Vec2f &direction, const float radius, const float speed, const float rate, const float duration);
+		void RemoveParticle(const size_t particleIndex);
+
+		void UpdateEmitter(ParticleEmitter *emitter, float deltaTime);
+		void IntegrateForces(const int64_t startIndex, const int64_t endIndex, const float deltaTime);
+		void ViscosityForces(const int64_t startIndex, const int64_t endIndex, const float deltaTime);
+		void ApplyVelocityDeltas(const int64_t startIndex, const int64_t endIndex, const float deltaTime);
+		void Predict(const int64_t startIndex, const int64_t endIndex, const float deltaTime);
+		void ConvertStorage(const StorageMode mode);
+		void SortGrid(const bool useMultiThreading);
+		void CountCellNeighbors(const int64_t startIndex, const int64_t endIndex);
+		void CellNeighborSearch(const int64_t startIndex, const int64_t endIndex);
+		void NeighborSearch(const bool useMultiThreading);
+		void DensityAndPressure(const int64_t startIndex, const int64_t endIndex, const float deltaTime);
+		void DeltaPositions(const int64_t startIndex, const int64_t endIndex, const float deltaTime);
+		void ApplyPositionDeltas(const int64_t startIndex, const int64_t endIndex, const float deltaTime);
+		void SolveCollisions(const int64_t startIndex, const int64_t endIndex, const float deltaTime);
+		void UpdateVelocities(const int64_t startIndex, const int64_t endIndex, const float deltaTime);
+		template<typename F>
+		inline void ForEachNeighborRange(const size_t cellOffset, F &&func);
+		template<typename F>
+		void ForEachRange(const bool useMultiThreading, const size_t count, const size_t grain, F &&func);
+
+		void UpdatePhases(const float deltaTime, const bool useMultiThreading);
+		void Update(const float deltaTime);
+		void Render(Render::CommandBuffer *commandBuffer, const float worldToScreenScale);
+
+		inline void AddExternalForces(const Vec2f &force) {
+			externalForce += force;
+		}
+		inline void ClearExternalForce() {
+			externalForce = Vec2f(0, 0);
+		}
+
+		// Only valid for separate arrays
+		inline SPHKernelParticles GetKernelParticles() {
+			assert(storageMode == StorageMode_Arrays);
+			SPHKernelParticles result;
+			result.positionsX = particles.positionX;
+			result.positionsY = particles.positionY;
+			result.velocitiesX = particles.velocityX;
+			result.velocitiesY = particles.velocityY;
+			result.pressures = particles.pressure;
+			result.nearPressures = particles.nearPressure;
+			result.stride = 1;
+			return(result);
+		}
+
+		inline SPHKernelBlocks GetKernelBlocks() {
+			SPHKernelBlocks result;
+			result.positionsX = particles.positionX;
+			result.positionsY = particles.positionY;
+			result.velocitiesX = particles.velocityX;
+			result.velocitiesY = particles.velocityY;
+			result.pressures = particles.pressure;
+			result.nearPressures = particles.nearPressure;
+			result.blockStride = particles.blockStride;
+			return(result);
+		}
+
+		inline size_t GetParticleOffset(const size_t particleIndex) {
+			return SPHComputeBlockOffset(particleIndex, particles.blockStride);
+		}
+
+		inline size_t GetNeighborRanges(const size_t particleIndex, SPHKernelRange outRanges[3]);
+
+		// Only valid for neighbor lists, particles added after the last grid sort have no neighbors
+		inline const uint32_t *GetNeighbors(const size_t particleIndex, size_t *outNeighborCount) {
+			if (particleIndex >= gridParticleCount) {
+				*outNeighborCount = 0;
+				return(nullptr);
+			}
+			uint32_t cellOffset = particleCellOffsets[particleIndex];
+			*outNeighborCount = cellNeighborOffsets[cellOffset + 1] - cellNeighborOffsets[cellOffset];
+			return(&cellNeighborIndices[cellNeighborOffsets[cellOffset]]);
+		}
+
+		inline size_t GetParticleCount() {
+			return particleCount;
+		}
+
+		inline void SetMultiThreading(const bool value) {
+			isMultiThreading = value;
+		}
+		inline bool IsMultiThreadingSupported() {
+			return true;
+		}
+		inline bool IsParticleRemovalSupported() {
+			return true;
+		}
+		inline bool IsMultiThreading() {
+			return isMultiThreading;
+		}
+		inline size_t GetWorkerThreadCount() {
+			return workerPool.GetThreadCount();
+		}
+		inline size_t GetOptionCount() {
+			return SimulationOption_Count;
+		}
+		inline SPHOption *GetOption(const size_t index) {
+			assert(index < SimulationOption_Count);
+			return &options[index];
+		}
+
+		inline void SetGravity(const Vec2f &gravity) {
+			this->gravity = gravity;
+		}
+
+		inline const SPHParameters &GetParams() {
+			return params;
+		}
+		inline SPHStatistics &GetStats() {
+			return stats;
+		}
+		inline void SetParams(const SPHParameters &params) {
+			this->params = params;
+		}
+	};
+};
+
+#endif // DEMO5_H
@@ -2,9 +2,9 @@
 -------------------------------------------------------------------------------------------------------------------
 Multi-Threaded N-Body 2D Smoothed Particle Hydrodynamics Fluid Simulation based on paper "Particle-based Viscoelastic Fluid Simulation" by Simon Clavet, Philippe Beaudoin, and Pierre Poulin.
 
-Version 1.4.4
+Version 1.5.0
 
-A experiment about creating a two-way particle simulation in 4 different programming styles to see the difference in performance and maintainability.
+A experiment about creating a two-way particle simulation in 5 different programming styles to see the difference in performance and maintainability.
 The core math is same for all implementations, including rendering and threading.
 
 Demos:
@@ -13,6 +13,7 @@ Demos:
 2. Object oriented style 2 (Public, reserved vectors, fixed grid, no unneccesary classes or pointers)
 3. Object oriented style 3 (Structs only, no virtual function calls, reserved vectors, fixed grid)
 4. Data oriented style with 8/16 byte aligned structures
+5. Data oriented style with a structure of aligned arrays
 
 How to compile:
 
@@ -27,7 +28,7 @@ To stop a benchmark hit "Escape" key.
 
 Notes:
 
-- Collision detection is discrete, therefore particles may pass through bodies when they are too thin and particles too fast.
+- Collision detection is discrete, therefore particles may pass through bodies when they are too thin and particles too fast. Demo 4 has a continuous collisions option, which sweeps the fast particles against the bodies.
 
 Todo:
 
@@ -38,6 +39,43 @@ Todo:
 
 Version History:
 
+1.5.0:
+- Replaced the mutex and std::deque task queue in threading.h with per-worker work-stealing deques
+- ThreadPool::WaitUntilDone() runs queued tasks on the calling thread and sleeps instead of spinning, wait times are shown per phase
+- Added ThreadPool::ParallelFor() which references the callable instead of copying a std::function, all demos use it now
+- Added dispatch benchmark (M) to compare CreateTasks() against ParallelFor()
+- Added task graph to threading.h, phases declare their resource accesses and chunks run as soon as their dependencies are done
+- Demo 4 can run its update as two task graphs (Option: Task graph), barriers per step are shown in the stats
+- Added runtime solver options to the demos, select with O and change with V
+- Demo 4 runs integrate, predict and the fused collisions and velocity pass in parallel (Option: Parallel integrate, predict and collisions)
+- Serial fraction of each step is shown in the stats and in the benchmark results
+- Demo 4 has a race-free colored solver for viscosity and delta positions (Option: Solver), the results are identical for any thread count
+- Added ThreadPool::ParallelExclusiveScan()
+- Demo 4 stores the neighbors as compressed rows of 32-bit indices instead of a fixed array of 1000 neighbors per particle (~80 MB less memory)
+- Demo 4 can rebuild the grid with a parallel counting sort which moves the particles into cell order (Option: Grid)
+- Demo 4 can sort the grid cells in Morton order (Option: Cell order) and sort only every 16 steps or when too many particles are unsorted (Option: Grid sort)
+- Added layout benchmark (L) to compare neighbor search and density times of unsorted, row major and Morton ordered particles
+- Demo 4 can use Verlet neighbor lists with a skin, which are reused until a particle has moved more than half the skin (Option: Neighbor list, Neighbor skin)
+- Demo 4 can use filtered neighbor lists, which store only neighbors within the kernel height with their distance and normal, so density and delta positions skip the distance math (Option: Neighbor list)
+- Demo 4 can use half pair neighbor lists, which contain each pair once and apply the density, viscosity and delta position of a pair to both particles, always with the colored solver (Option: Neighbor list)
+- Added SSE and AVX2 density kernels to Demo 4, selected at runtime with a fallback to the best kernel set the CPU supports (Option: Kernels)
+- Added kernel benchmark (K) to compare the density time and error of the scalar, SSE and AVX2 kernels
+- Demo 4 has a race-free gather solver, which sums both halves of each pair into the particle itself and applies all deltas afterwards, with SSE and AVX2 delta position kernels (Option: Solver), the position deltas are limited to the particle radius and can be under-relaxed in Demo 4 and 5 (Option: Gather relaxation)
+- Demo 4 has SSE and AVX2 viscosity force kernels for the gather solver, which are compared to the scalar kernels in the kernel benchmark as well
+- Added Demo 5, which stores the particles as a structure of aligned arrays, always keeps them in cell order and shares the neighbors of each cell, with the gather solver and the SIMD kernels of Demo 4
+- The SIMD kernels read the particle fields through separate x and y pointers with a stride, so they work on structures and on separate arrays
+- Added storage option to Demo 5 for blocks of 8 particles (AoSoA) and neighbor option for cell ranges, with block kernels which load whole blocks and a storage benchmark (S) against Demo 4 and separate arrays
+- Demo 4 and Demo 5 grow the particle arrays and the cells with the particles instead of preallocating the max particle and cell counts
+- Added sink bodies and particle removal, Demo 4 swap-removes the removed particles before the grid update and Demo 5 drops them in the grid sort, new scenario Outflow with a sink
+- Added hashed grid option to Demo 4, which only stores the cells with particles in an open addressing table and has no bounds
+- Demo 4 sizes the grid at runtime from the kernel height, with a cell size option for 1 h or 0.5 h cells
+- Demo 4 rasterizes the bodies into the grid cells and only tests the bodies of the particle cell for collisions, polygon edge normals are computed once when the polygon is added
+- Added collisions option to Demo 4 for a distance field, which bakes all bodies into a signed distance field when the bodies change and pushes the particles out with one bilinear lookup
+- Added type batches to the Demo 4 collisions option, which solves all planes with a scalar, SSE or AVX2 plane kernel and then each other body type over the particle range
+- Added continuous collisions option to Demo 4, which moves particles faster than the particle radius per step back to their first contact with a circle, line segment or polygon
+- Fixed Vec2DistanceSquared returned the squared product of the coordinate differences instead of the squared distance
+- Fixed BaseSimulation was missing a virtual destructor, so demos and its thread pools were never destroyed
+
 1.4.4:
 - Migrated to FPL 0.9.9.0 beta
 - Migrated to Final Dynamic OpenGL 0.4.0.0 beta
@@ -65,12 +65,38 @@ const float kSPHGridWidth = kSPHGridCountX * kSPHGridCellSize;
 const float kSPHGridHeight = kSPHGridCountY * kSPHGridCellSize;
 
 // Max constants
+// @NOTE: Cell and neighbor counts are no capacities, the particle and cell arrays grow with the actual particles
 const uint32_t kSPHMaxCellParticleCount = 500;
 const uint32_t kSPHMaxParticleNeighborCount = 1000;
-const uint32_t kSPHMaxParticleCount = 10000;
 const uint32_t kSPHMaxBodyCount = 100;
 const uint32_t kSPHMaxEmitterCount = 8;
 
+// Initial capacities of the growable particle and cell arrays
+const size_t kSPHInitialParticleCapacity = 1024;
+const size_t kSPHInitialCellParticleCapacity = 16;
+
+// Minimum number of particles per task for the parallel phases
+const size_t kSPHParallelGrainSize = 64;
+// Minimum number of cells per task for passes which run over the cells
+const size_t kSPHParallelCellGrainSize = 4;
+
+// Scale of the viscosity impulse and the position delta of the gather solvers, which apply all pairs at once from the same state (Jacobi) instead of one pair after another like the scatter solver (Gauss-Seidel)
+// @NOTE: Mean density after 1000 steps compared to the scatter solver, with the deltas limited to kSPHGatherMaxDelta:
+// None is the default, it is stable and within 3% of scatter in all scenarios in Demo 4 and 5.
+// Viscosity 0.5 is within 3% of scatter as well, but the fluid still moves up to 70% faster at the end.
+// Viscosity 0.5 and delta 0.4 compresses the fluid by 18-41% more than scatter, except the resting blob.
+struct SPHGatherRelaxation {
+	float viscosity;
+	float delta;
+};
+const char *const kSPHGatherRelaxationNames[] = { "None", "Viscosity 0.5", "Viscosity 0.5, delta 0.4" };
+const SPHGatherRelaxation kSPHGatherRelaxations[] = { { 1.0f, 1.0f }, { 0.5f, 1.0f }, { 0.5f, 0.4f } };
+const size_t kSPHDefaultGatherRelaxation = 0;
+fplStaticAssert(fplArrayCount(kSPHGatherRelaxationNames) == fplArrayCount(kSPHGatherRelaxations));
+// Longest position delta of a particle per step in the gather solvers.
+// @NOTE: A compressed particle sums the deltas of all its neighbors from the same positions and overshoots, which makes the next step worse, until the dam break blows up. The scatter solver stops short of that, because each pair sees the positions the pairs before it have moved already.
+const float kSPHGatherMaxDelta = kSPHParticleRadius;
+
 // @NOTE: Particle radius must never be smaller collision margin
 fplStaticAssert(kSPHParticleRadius > kSPHCollisionMargin);
 
@@ -110,7 +136,7 @@ struct SPHParameters {
 	}
 
 	SPHParameters(const float kernelHeight, const float cellSize, const float particleSpacing, const float restDensity, const float stiffness, const float nearStiffness, const float linearViscosity, const float quadraticViscosity) {
-		this->kernelHeight = kSPHKernelHeight;
+		this->kernelHeight = kernelHeight;
 		this->cellSize = cellSize;
 		this->particleSpacing = particleSpacing;
 		this->invKernelHeight = 1.0f / kernelHeight;
@@ -122,6 +148,16 @@ struct SPHParameters {
 	}
 };
 
+// Solver option which can be changed at runtime, value is the index into valueNames
+struct SPHOption {
+	const char *name;
+	const char *const *valueNames;
+	size_t valueCount;
+	size_t value;
+};
+
+const char *const kSPHOptionBooleanNames[] = { "no", "yes" };
+
 struct SPHStatistics {
 	size_t minParticleNeighborCount;
 	size_t maxParticleNeighborCount;
@@ -138,14 +174,58 @@ struct SPHStatistics {
 		float densityAndPressure;
 		float deltaPositions;
 		float collisions;
+		// Total time of all task graphs, the phases inside a graph overlap and are not timed separately
+		float taskGraph;
+		// Time the main thread spent adding the phases and building the dependencies of all task graphs, part of the task graph time
+		float taskGraphBuild;
 	} time;
 
+	// Time in ms the calling thread waited on the worker pool, per parallel phase
+	struct {
+		float viscosityForces;
+		float neighborSearch;
+		float densityAndPressure;
+		float deltaPositions;
+	} waitTime;
+
+	// Number of times the main thread joined the worker pool in the last step
+	size_t barrierCount;
+	// Number of dependencies of all task graphs in the last step
+	size_t graphEdgeCount;
+	// Part of the last step which ran on the main thread only, in range of 0 to 1
+	float serialFraction;
+	// Part of the particles which are not in cell order anymore since the last grid sort, in range of 0 to 1
+	float unsortedFraction;
+	// Number of grid sorts since the stats were reset
+	size_t gridSortCount;
+	// Number of steps the neighbor lists were rebuilt or reused since the stats were reset
+	size_t neighborRebuildCount;
+	size_t neighborReuseCount;
+	// Number of particles removed by sinks or the removal api since the stats were reset
+	size_t removedParticleCount;
+	// Memory and bake time of the last baked distance field, with its largest distance error against the bodies near the surface
+	size_t distanceFieldSize;
+	float distanceFieldBakeTime;
+	float distanceFieldMaxError;
+
 	SPHStatistics() :
 		minParticleNeighborCount(kSPHMaxCellParticleCount),
 		maxParticleNeighborCount(0),
 		minCellParticleCount(kSPHMaxCellParticleCount),
-		maxCellParticleCount(0) {
+		maxCellParticleCount(0),
+		barrierCount(0),
+		graphEdgeCount(0),
+		serialFraction(0),
+		unsortedFraction(0),
+		gridSortCount(0),
+		neighborRebuildCount(0),
+		neighborReuseCount(0),
+		removedParticleCount(0),
+		distanceFieldSize(0),
+		distanceFieldBakeTime(0),
+		distanceFieldMaxError(0) {
 		time = {};
+		waitTime = {};
 	}
 };
 
@@ -156,6 +236,7 @@ enum SPHScenarioBodyType {
 	SPHScenarioBodyType_Plane,
 	SPHScenarioBodyType_LineSegment,
 	SPHScenarioBodyType_Polygon,
+	SPHScenarioBodyType_Sink,
 };
 
 static const size_t kMaxScenarioPolygonCount = 8;
@@ -214,6 +295,19 @@ struct SPHScenarioBody {
 		result.localVerts[3] = Vec2f(ext.x, -ext.y);
 		return(result);
 	}
+
+	// Axis aligned box which removes all particles entering it
+	static inline SPHScenarioBody CreateSink(const Vec2f &position, const Vec2f &ext) {
+		SPHScenarioBody result = SPHScenarioBody();
+		result.type = SPHScenarioBodyType::SPHScenarioBodyType_Sink;
+		result.radius = 0;
+		result.position = position;
+		result.orientation = Mat2Identity();
+		result.vertexCount = 2;
+		result.localVerts[0] = Vec2f(-ext.x, -ext.y);
+		result.localVerts[1] = Vec2f(ext.x, ext.y);
+		return(result);
+	}
 };
 
 struct SPHScenarioVolume {
@@ -312,6 +406,11 @@ const float kSPHDambreakVolumeHeight = kSPHBoundaryHeight * 0.95f;
 const float kSPHBlobVolumeWidth = kSPHBoundaryWidth * 0.5f;
 const float kSPHBlobVolumeHeight = kSPHBoundaryHeight * 0.5f;
 
+const float kSPHOutflowSinkWidth = kSPHBoundaryWidth * 0.15f;
+const float kSPHOutflowSinkHeight = kSPHBoundaryHeight * 0.1f;
+// Simulations with sinks reach a steady particle count after about 15 seconds, the others stop growing when the emitter stops
+const float kSPHOutflowEmitterDuration = 30.0f;
+
 static SPHScenario SPHScenarios[] = {
 	SPHScenario("Dambreak", Vec2f(0, -10),
 	{
@@ -434,8 +533,29 @@ static SPHScenario SPHScenarios[] = {
 		SPHScenarioBody::CreateBox(Vec2f(0, -kSPHBoundaryHalfHeight + 0.5f), 0, Vec2f(0.3f, 1.0f)),
 	},
 	SPHParameters(kSPHKernelHeight, kSPHGridCellSize, kSPHKernelHeight / 4.0f, kSPHRestDensity, kSPHStiffness, kSPHStiffness * 6.0f, kSPHLinearViscosity, kSPHQuadraticViscosity)),
+
+	SPHScenario("Outflow", Vec2f(0, -10),
+	{
+	},
+	{
+		SPHScenarioEmitter(Vec2f(-4, 2), Vec2f(1, 0), kSPHKernelHeight * 4, 3.5f, 15.0f, kSPHOutflowEmitterDuration),
+	},
+	{
+		SPHScenarioBody::CreatePlane(Vec2f(0, -kSPHBoundaryHalfHeight), Vec2f(0, 1)),
+		SPHScenarioBody::CreatePlane(Vec2f(0, kSPHBoundaryHalfHeight), Vec2f(0, -1)),
+		SPHScenarioBody::CreatePlane(Vec2f(-kSPHBoundaryHalfWidth, 0), Vec2f(1, 0)),
+		SPHScenarioBody::CreatePlane(Vec2f(kSPHBoundaryHalfWidth, 0), Vec2f(-1, 0)),
+		SPHScenarioBody::CreateBox(Vec2f(-1.0f, -0.5f), kDeg2Rad * -5.0f, Vec2f(2.5f, 0.1f)),
+		SPHScenarioBody::CreateSink(Vec2f(kSPHBoundaryHalfWidth - kSPHOutflowSinkWidth * 0.5f, -kSPHBoundaryHalfHeight + kSPHOutflowSinkHeight * 0.5f), Vec2f(kSPHOutflowSinkWidth * 0.5f, kSPHOutflowSinkHeight * 0.5f)),
+	},
+	SPHParameters(kSPHKernelHeight, kSPHGridCellSize, kSPHKernelHeight / 4.0f, kSPHRestDensity, kSPHStiffness, kSPHStiffness * 6.0f, kSPHLinearViscosity, kSPHQuadraticViscosity)),
 };
 
+force_inline float SPHComputeSerialFraction(const float totalTime, const float parallelTime) {
+	float result = totalTime > 0.0f ? std::max(0.0f, 1.0f - parallelTime / totalTime) : 1.0f;
+	return(result);
+}
+
 force_inline bool SPHIsPositionInGrid(int x, int y) {
 	bool result = ((x >= 0 && x < kSPHGridCountX) && (y >= 0 && y < kSPHGridCountY));
 	return(result);
@@ -447,6 +567,48 @@ force_inline size_t SPHComputeCellOffset(const int x, const int y) {
 	return(result);
 }
 
+// Interleaves the bits of x and y (z-order curve), cells which are close in 2D are mostly close on the curve as well
+force_inline uint32_t SPHComputeMortonCode(const uint32_t x, const uint32_t y) {
+	auto spreadBits = [](uint32_t v) {
+		v &= 0x0000FFFF;
+		v = (v | (v << 8)) & 0x00FF00FF;
+		v = (v | (v << 4)) & 0x0F0F0F0F;
+		v = (v | (v << 2)) & 0x33333333;
+		v = (v | (v << 1)) & 0x55555555;
+		return(v);
+	};
+	uint32_t result = spreadBits(x) | (spreadBits(y) << 1);
+	return(result);
+}
+
+// Grows by half of the capacity at least, so adding elements one by one only reallocates a logarithmic number of times
+inline size_t SPHComputeGrownCapacity(const size_t capacity, const size_t requiredCapacity, const size_t minCapacity) {
+	return std::max(requiredCapacity, std::max(capacity + capacity / 2, minCapacity));
+}
+
+// Reallocates the array with the new capacity and keeps the first count elements
+template<typename T>
+inline void SPHReallocateArray(T **array, const size_t count, const size_t newCapacity) {
+	assert(count <= newCapacity);
+	T *newArray = new T[newCapacity];
+	if (*array != nullptr) {
+		std::copy(*array, *array + count, newArray);
+		delete[] *array;
+	}
+	*array = newArray;
+}
+
+// Replaces values[0, count) with its exclusive prefix sum and returns the total sum, which is summed up in 64-bit so an overflow of the offsets can be detected
+force_inline uint64_t SPHExclusiveScan(uint32_t *values, const size_t count) {
+	uint64_t result = 0;
+	for (size_t index = 0; index < count; ++index) {
+		uint32_t value = values[index];
+		values[index] = (uint32_t)result;
+		result += value;
+	}
+	return(result);
+}
+
 force_inline Vec2i SPHComputeCellPos(const Vec2f &p, const Vec2f &center, const float cellSize) {
 	int x = (int)((p.x + center.x) / cellSize);
 	int y = (int)((p.y + center.y) / cellSize);
@@ -462,6 +624,61 @@ force_inline Vec2i SPHComputeCellIndex(const Vec2f & p) {
 	return (result);
 }
 
+// Uniform grid over the boundary which is sized at runtime, the cells are the kernel height times the cell scale wide.
+// All neighbors of a particle are within the cell radius around its cell, so a cell scale of 0.5 needs 5x5 cells instead of 3x3.
+struct SPHGrid {
+	Vec2f origin;
+	float cellSize;
+	int countX;
+	int countY;
+	size_t totalCount;
+	int cellRadius;
+};
+
+inline SPHGrid SPHCreateGrid(const float kernelHeight, const float cellScale) {
+	SPHGrid result;
+	result.origin = kSPHGridOrigin;
+	result.cellSize = kernelHeight * cellScale;
+	result.countX = std::max((int)(kSPHBoundaryWidth / result.cellSize), 1);
+	result.countY = std::max((int)(kSPHBoundaryHeight / result.cellSize), 1);
+	result.totalCount = (size_t)(result.countX * result.countY);
+	result.cellRadius = (int)ceilf(kernelHeight / result.cellSize);
+	return(result);
+}
+
+force_inline bool SPHIsPositionInGrid(const SPHGrid &grid, const int x, const int y) {
+	bool result = ((x >= 0 && x < grid.countX) && (y >= 0 && y < grid.countY));
+	return(result);
+}
+
+force_inline size_t SPHComputeCellOffset(const SPHGrid &grid, const int x, const int y) {
+	assert(SPHIsPositionInGrid(grid, x, y));
+	size_t result = y * grid.countX + x;
+	return(result);
+}
+
+force_inline Vec2i SPHComputeCellIndex(const SPHGrid &grid, const Vec2f &p) {
+	int x = (int)((p.x - grid.origin.x) / grid.cellSize);
+	int y = (int)((p.y - grid.origin.y) / grid.cellSize);
+	Vec2i result = Vec2i(std::min(std::max(x, 0), grid.countX - 1), std::min(std::max(y, 0), grid.countY - 1));
+	return (result);
+}
+
+// Cell of the position without clamping into the grid, for grids without bounds
+force_inline Vec2i SPHComputeUnboundedCellIndex(const SPHGrid &grid, const Vec2f &p) {
+	const float maxCell = (float)(1 << 24);
+	float x = std::min(std::max(floorf((p.x - grid.origin.x) / grid.cellSize), -maxCell), maxCell);
+	float y = std::min(std::max(floorf((p.y - grid.origin.y) / grid.cellSize), -maxCell), maxCell);
+	Vec2i result = Vec2i((int)x, (int)y);
+	return (result);
+}
+
+// Spatial hash of a cell position (Teschner et al., Optimized Spatial Hashing for Collision Detection of Deformable Objects)
+force_inline uint32_t SPHComputeCellHash(const int x, const int y) {
+	uint32_t result = ((uint32_t)x * 73856093u) ^ ((uint32_t)y * 19349663u);
+	return(result);
+}
+
 force_inline void SPHComputeDensity(const SPHParameters &params, const Vec2f &position, const Vec2f &neighborPosition, float outDensity[2]) {
 	Vec2f Rij = neighborPosition - position;
 	float rijSquared = Vec2Dot(Rij, Rij);
@@ -511,6 +728,61 @@ force_inline void SPHComputeViscosityForce(const SPHParameters &params, const Ve
 	}
 }
 
+// Kernels for distance filtered neighbors, the pair distance is known to be below the kernel height, so they do not need a range check
+force_inline void SPHComputeDensityFromDistance(const SPHParameters &params, const float distance, float outDensity[2]) {
+	float term = 1.0f - distance * params.invKernelHeight;
+	outDensity[0] += (term * term);
+	outDensity[1] += (term * term * term);
+}
+
+force_inline void SPHComputeDeltaFromPair(const SPHParameters &params, const float distance, const Vec2f &normal, const float pressure[2], const float deltaTime, Vec2f *outDelta) {
+	float term = 1.0f - distance * params.invKernelHeight;
+	float d = (deltaTime * deltaTime) * (pressure[0] * term + pressure[1] * (term * term));
+	*outDelta = Vec2Hadamard(d, normal);
+}
+
+// Same as SPHComputeViscosityForce(), but out of range pairs and separating pairs are clamped to zero instead of branched
+force_inline void SPHComputeViscosityForceClamped(const SPHParameters &params, const Vec2f &position, const Vec2f &neighborPosition, const Vec2f &velocity, const Vec2f &neighborVelocity, Vec2f *outForce) {
+	Vec2f Rij = neighborPosition - position;
+	float rij = Vec2Length(Rij);
+	float q = std::min(rij * params.invKernelHeight, 1.0f);
+	Vec2f n = Rij * (1.0f / std::max(rij, kSPHCollisionEpsilon));
+	float u = std::max(Vec2Dot(velocity - neighborVelocity, n), 0.0f);
+	float f = (1.0f - q) * (params.linearViscosity * u + params.quadraticViscosity * (u * u));
+	*outForce = Vec2Hadamard(f, n);
+}
+
+// Pair kernels for half neighbor lists, which compute the terms of a pair once for both particles
+force_inline void SPHComputeDensityPair(const SPHParameters &params, const Vec2f &position, const Vec2f &neighborPosition, float outDensity[2], float outNeighborDensity[2]) {
+	Vec2f Rij = neighborPosition - position;
+	float rij = Vec2Length(Rij);
+	float term = std::max(1.0f - rij * params.invKernelHeight, 0.0f);
+	float termSquared = term * term;
+	float termCubed = termSquared * term;
+	outDensity[0] += termSquared;
+	outDensity[1] += termCubed;
+	outNeighborDensity[0] += termSquared;
+	outNeighborDensity[1] += termCubed;
+}
+force_inline void SPHComputeDeltaPair(const SPHParameters &params, const Vec2f &position, const Vec2f &neighborPosition, const float pressure[2], const float neighborPressure[2], const float deltaTime, Vec2f *outDelta) {
+	// @NOTE: Same as the two half deltas of (i,j) and (j,i), the neighbor moves by +delta and the particle by -delta
+	Vec2f Rij = neighborPosition - position;
+	float rij = Vec2Length(Rij);
+	float term = std::max(1.0f - rij * params.invKernelHeight, 0.0f);
+	Vec2f n = Rij * (1.0f / std::max(rij, kSPHCollisionEpsilon));
+	float d = 0.5f * (deltaTime * deltaTime) * ((pressure[0] + neighborPressure[0]) * term + (pressure[1] + neighborPressure[1]) * (term * term));
+	*outDelta = Vec2Hadamard(d, n);
+}
+
+// Limits the position delta of the gather solvers to kSPHGatherMaxDelta
+force_inline Vec2f SPHClampGatherDelta(const Vec2f &delta) {
+	float length = Vec2Length(delta);
+	if (length > kSPHGatherMaxDelta) {
+		return delta * (kSPHGatherMaxDelta / length);
+	}
+	return delta;
+}
+
 force_inline void SPHSolvePlaneCollision(Vec2f *position, const Vec2f &normal, const float distance) {
 	Vec2f p = normal * distance;
 	Vec2f particlePos = *position;
@@ -597,7 +869,16 @@ static void SPHSolveLineSegmentCollision(Vec2f *particlePosition, const Vec2f &a
 	*particlePosition = particlePos;
 }
 
-static bool FindMTVCirclePolygon(const Vec2f &circlePosition, const size_t vertexCount, const Vec2f *verts, Vec2f *mtv) {
+// Unit normal of each edge from vertex i to i + 1
+inline void SPHComputePolygonNormals(const size_t vertexCount, const Vec2f *verts, Vec2f *outNormals) {
+	for (size_t vertexIndex = 0; vertexIndex < vertexCount; ++vertexIndex) {
+		Vec2f a = verts[vertexIndex];
+		Vec2f b = verts[(vertexIndex + 1) % vertexCount];
+		outNormals[vertexIndex] = Vec2Normalize(Vec2Cross(b - a, 1.0f));
+	}
+}
+
+static bool FindMTVCirclePolygon(const Vec2f &circlePosition, const size_t vertexCount, const Vec2f *verts, const Vec2f *normals, Vec2f *mtv) {
 	size_t edgeIndex = 0;
 	Vec2f normal = Vec2f(0, 0);
 	float separation = -FLT_MAX;
@@ -605,8 +886,7 @@ static bool FindMTVCirclePolygon(const Vec2f &circlePosition, const size_t verte
 
 	for (size_t vertexIndex = 0; vertexIndex < vertexCount; ++vertexIndex) {
 		Vec2f a = verts[vertexIndex];
-		Vec2f b = verts[(vertexIndex + 1) % vertexCount];
-		Vec2f n = Vec2Normalize(Vec2Cross(b - a, 1.0f));
+		Vec2f n = normals[vertexIndex];
 		float s = Vec2Dot(n, circlePosition - a);
 		if (s > radius) {
 			return false;
@@ -671,15 +951,204 @@ static bool FindMTVCirclePolygon(const Vec2f &circlePosition, const size_t verte
 	assert(!"Invalid!");
 }
 
-force_inline void SPHSolvePolygonCollision(Vec2f *particlePosition, const size_t vertexCount, const Vec2f *verts) {
+force_inline void SPHSolvePolygonCollision(Vec2f *particlePosition, const size_t vertexCount, const Vec2f *verts, const Vec2f *normals) {
 	Vec2f particlePos = *particlePosition;
 	Vec2f mtv = Vec2f();
-	if (FindMTVCirclePolygon(particlePos, vertexCount, verts, &mtv)) {
+	if (FindMTVCirclePolygon(particlePos, vertexCount, verts, normals, &mtv)) {
 		particlePos += mtv;
 		*particlePosition = particlePos;
 	}
 }
 
+// @NOTE: Computes the edge normals on every call, bodies which are stored with the polygon should precompute them once
+force_inline void SPHSolvePolygonCollision(Vec2f *particlePosition, const size_t vertexCount, const Vec2f *verts) {
+	assert(vertexCount <= kMaxScenarioPolygonCount);
+	Vec2f normals[kMaxScenarioPolygonCount];
+	SPHComputePolygonNormals(vertexCount, verts, normals);
+	SPHSolvePolygonCollision(particlePosition, vertexCount, verts, normals);
+}
+
+// Earliest fraction of the movement from p0 to p1 where a particle touches the circle, returns false when it does not touch it in between.
+// A particle which already touches it at p0 and moves further in is stopped at p0.
+force_inline bool SPHComputeCircleTimeOfImpact(const Vec2f &p0, const Vec2f &p1, const Vec2f &center, const float radius, float *outT) {
+	Vec2f d = p1 - p0;
+	Vec2f m = p0 - center;
+	float a = Vec2Dot(d, d);
+	float b = Vec2Dot(m, d);
+	float c = Vec2Dot(m, m) - radius * radius;
+	if (c <= 0.0f) {
+		*outT = 0.0f;
+		return b < 0.0f;
+	}
+	float discriminant = b * b - a * c;
+	if (a <= 0.0f || b >= 0.0f || discriminant < 0.0f) {
+		return false;
+	}
+	float t = (-b - sqrtf(discriminant)) / a;
+	if (t < 0.0f || t > 1.0f) {
+		return false;
+	}
+	*outT = t;
+	return true;
+}
+
+// Earliest fraction of the movement from p0 to p1 where a particle touches the capsule of the given radius around the segment ab, returns false when it does not touch it in between.
+// A particle which already touches it at p0 and moves further in is stopped at p0, otherwise a fast particle resting on a thin body would pass through it in one step.
+inline bool SPHComputeCapsuleTimeOfImpact(const Vec2f &p0, const Vec2f &p1, const Vec2f &a, const Vec2f &b, const float radius, float *outT) {
+	Vec2f e = b - a;
+	float den = Vec2Dot(e, e);
+	float u0 = den > 0 ? std::min(std::max(Vec2Dot(p0 - a, e) / den, 0.0f), 1.0f) : 0.0f;
+	Vec2f closest = a + e * u0;
+	if (Vec2DistanceSquared(p0, closest) <= radius * radius) {
+		*outT = 0.0f;
+		return Vec2Dot(p1 - p0, p0 - closest) < 0.0f;
+	}
+	bool result = false;
+	float t = FLT_MAX;
+	float circleT;
+	if (SPHComputeCircleTimeOfImpact(p0, p1, a, radius, &circleT)) {
+		t = circleT;
+		result = true;
+	}
+	if (den > 0 && SPHComputeCircleTimeOfImpact(p0, p1, b, radius, &circleT) && circleT < t) {
+		t = circleT;
+		result = true;
+	}
+	if (den > 0) {
+		// Side of the capsule facing p0
+		Vec2f n = Vec2Normalize(Vec2f(-e.y, e.x));
+		float s0 = Vec2Dot(p0 - a, n);
+		float s1 = Vec2Dot(p1 - a, n);
+		float side = s0 > 0 ? radius : -radius;
+		if ((s0 - side) * (s1 - side) <= 0.0f && s0 != s1) {
+			float sideT = (s0 - side) / (s0 - s1);
+			float u = Vec2Dot(p0 + (p1 - p0) * sideT - a, e) / den;
+			if (u >= 0.0f && u <= 1.0f && sideT < t) {
+				t = sideT;
+				result = true;
+			}
+		}
+	}
+	if (result) {
+		*outT = t;
+	}
+	return(result);
+}
+
+// Signed distances of the bodies, including the collision margin where the analytic collision adds it, so a particle collides when the distance is below the particle collision radius.
+// The distance is negative inside the body and the gradient is the unit direction away from the body.
+force_inline float SPHComputePlaneDistance(const Vec2f &position, const Vec2f &normal, const float distance, Vec2f *outGradient) {
+	*outGradient = normal;
+	float result = Vec2Dot(position, normal) - distance;
+	return(result);
+}
+
+force_inline float SPHComputeCircleDistance(const Vec2f &position, const Vec2f &circlePos, const float circleRadius, Vec2f *outGradient) {
+	Vec2f deltaPos = position - circlePos;
+	float distance = Vec2Length(deltaPos);
+	*outGradient = distance > 0 ? deltaPos * (1.0f / distance) : Vec2f(0, 1);
+	float result = distance - circleRadius;
+	return(result);
+}
+
+inline float SPHComputeLineSegmentDistance(const Vec2f &position, const Vec2f &a, const Vec2f &b, Vec2f *outGradient) {
+	Vec2f e = b - a;
+	float den = Vec2Dot(e, e);
+	float t = den > 0 ? std::min(std::max(Vec2Dot(position - a, e) / den, 0.0f), 1.0f) : 0.0f;
+	Vec2f deltaPos = position - (a + e * t);
+	float distance = Vec2Length(deltaPos);
+	*outGradient = distance > 0 ? deltaPos * (1.0f / distance) : Vec2Normalize(Vec2f(-e.y, e.x));
+	float result = distance - kSPHCollisionMargin;
+	return(result);
+}
+
+// @NOTE: Polygons are convex, so inside the distance is the largest edge separation and outside the distance to the nearest edge
+inline float SPHComputePolygonDistance(const Vec2f &position, const size_t vertexCount, const Vec2f *verts, const Vec2f *normals, Vec2f *outGradient) {
+	float separation = -FLT_MAX;
+	Vec2f normal = Vec2f(0, 1);
+	for (size_t vertexIndex = 0; vertexIndex < vertexCount; ++vertexIndex) {
+		float s = Vec2Dot(normals[vertexIndex], position - verts[vertexIndex]);
+		if (s > separation) {
+			separation = s;
+			normal = normals[vertexIndex];
+		}
+	}
+	float distance = separation;
+	*outGradient = normal;
+	if (separation > 0) {
+		distance = FLT_MAX;
+		for (size_t vertexIndex = 0; vertexIndex < vertexCount; ++vertexIndex) {
+			Vec2f edgeGradient;
+			float edgeDistance = SPHComputeLineSegmentDistance(position, verts[vertexIndex], verts[(vertexIndex + 1) % vertexCount], &edgeGradient) + kSPHCollisionMargin;
+			if (edgeDistance < distance) {
+				distance = edgeDistance;
+				*outGradient = edgeGradient;
+			}
+		}
+	}
+	float result = distance - kSPHCollisionMargin;
+	return(result);
+}
+
+// Signed distance to all bodies sampled at regular positions, with the gradient of the nearest body at each sample.
+// Each sample is stored in separate arrays, row by row.
+struct SPHDistanceField {
+	Vec2f origin;
+	float spacing;
+	float invSpacing;
+	int countX;
+	int countY;
+	float *distances;
+	float *gradientsX;
+	float *gradientsY;
+};
+
+// Bilinear distance and gradient at the position, returns false when the position is outside of the field
+force_inline bool SPHSampleDistanceField(const SPHDistanceField &field, const Vec2f &position, float *outDistance, Vec2f *outGradient) {
+	float fx = (position.x - field.origin.x) * field.invSpacing;
+	float fy = (position.y - field.origin.y) * field.invSpacing;
+	if (!(fx >= 0.0f && fy >= 0.0f && fx < (float)(field.countX - 1) && fy < (float)(field.countY - 1))) {
+		return false;
+	}
+	int x = (int)fx;
+	int y = (int)fy;
+	float tx = fx - (float)x;
+	float ty = fy - (float)y;
+	size_t s00 = (size_t)y * field.countX + x;
+	size_t s10 = s00 + 1;
+	size_t s01 = s00 + field.countX;
+	size_t s11 = s01 + 1;
+	float w00 = (1.0f - tx) * (1.0f - ty);
+	float w10 = tx * (1.0f - ty);
+	float w01 = (1.0f - tx) * ty;
+	float w11 = tx * ty;
+	*outDistance = field.distances[s00] * w00 + field.distances[s10] * w10 + field.distances[s01] * w01 + field.distances[s11] * w11;
+	outGradient->x = field.gradientsX[s00] * w00 + field.gradientsX[s10] * w10 + field.gradientsX[s01] * w01 + field.gradientsX[s11] * w11;
+	outGradient->y = field.gradientsY[s00] * w00 + field.gradientsY[s10] * w10 + field.gradientsY[s01] * w01 + field.gradientsY[s11] * w11;
+	return true;
+}
+
+// Pushes the particle out along the field gradient, returns false when the position is outside of the field
+force_inline bool SPHSolveDistanceFieldCollision(Vec2f *particlePosition, const SPHDistanceField &field) {
+	float distance;
+	Vec2f gradient;
+	if (!SPHSampleDistanceField(field, *particlePosition, &distance, &gradient)) {
+		return false;
+	}
+	if (distance < kSPHParticleCollisionRadius) {
+		float gradientLength = Vec2Length(gradient);
+		if (gradientLength > kSPHCollisionEpsilon) {
+			*particlePosition += gradient * ((kSPHParticleCollisionRadius - distance) / gradientLength);
+		}
+	}
+	return true;
+}
+
+force_inline bool SPHIsPositionInSink(const Vec2f &position, const Vec2f &sinkMin, const Vec2f &sinkMax) {
+	bool result = (position.x >= sinkMin.x && position.x <= sinkMax.x) && (position.y >= sinkMin.y && position.y <= sinkMax.y);
+	return(result);
+}
+
 force_inline Vec4f SPHGetParticleColor(const float restDensity, const float density, const float pressure, const Vec2f &velocity) {
 	// @TODO: This is are totally wrong, when the default parameters are different!
 	float r = pressure / (-10.0f);
@@ -0,0 +1,719 @@
+#ifndef SPH_SIMD_H
+#define SPH_SIMD_H
+
+#include <immintrin.h>
+
+#include "sph.h"
+
+//
+// SIMD kernels, which process 4 (SSE) or 8 (AVX2) neighbors of one particle at once.
+// Neighbor positions are gathered by the neighbor indices from an array of structures or from separate arrays, lanes out of range or past the end are masked out instead of branched.
+// The block kernels take ranges of neighbors instead and load whole blocks of 8 particles with aligned loads.
+//
+// @NOTE: MSVC compiles AVX2 intrinsics in any function, GCC and Clang need the target on every function which uses them.
+// The SSE kernels use SSE2 only, which every x64 CPU has.
+#if defined(_MSC_VER)
+#	define SPH_TARGET_AVX2
+#else
+#	define SPH_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+enum SPHKernelSet {
+	SPHKernelSet_Scalar = 0,
+	SPHKernelSet_SSE,
+	SPHKernelSet_AVX2,
+
+	SPHKernelSet_Count,
+};
+const char *const kSPHKernelSetNames[] = { "Scalar", "SSE", "AVX2" };
+
+// Largest relative difference of the SIMD results to the scalar results, the summation order, the rounding of the lanes and the refined reciprocal square roots differ
+const float kSPHKernelTolerance = 1e-5f;
+
+// Smallest squared distance for the reciprocal square root, the particle itself has a zero distance and gets a zero normal
+const float kSPHKernelMinDistanceSquared = 1e-12f;
+
+// Particle fields the kernels read from the neighbors, each one points to the field of the first particle and the stride is the distance of two particles in floats.
+// An array of structures has the size of one particle as stride, separate arrays have a stride of one.
+struct SPHKernelParticles {
+	const float *positionsX;
+	const float *positionsY;
+	const float *velocitiesX;
+	const float *velocitiesY;
+	const float *pressures;
+	const float *nearPressures;
+	size_t stride;
+};
+
+// Adds the densities of all neighbors to outDensity
+typedef void (SPHDensityKernel)(const SPHParameters &params, const Vec2f &position, const SPHKernelParticles &particles, const uint32_t *neighbors, const size_t neighborCount, float outDensity[2]);
+
+static void SPHComputeDensitiesScalar(const SPHParameters &params, const Vec2f &position, const SPHKernelParticles &particles, const uint32_t *neighbors, const size_t neighborCount, float outDensity[2]) {
+	for (size_t index = 0; index < neighborCount; ++index) {
+		const size_t offset = neighbors[index] * particles.stride;
+		SPHComputeDensity(params, position, Vec2f(particles.positionsX[offset], particles.positionsY[offset]), outDensity);
+	}
+}
+
+// Adds the displacement of the particle from all neighbors to outDelta, as the sum of both halves of each pair, so only the particle itself is written.
+typedef void (SPHDeltaKernel)(const SPHParameters &params, const Vec2f &position, const float pressure[2], const SPHKernelParticles &particles, const uint32_t *neighbors, const size_t neighborCount, const float deltaTime, Vec2f *outDelta);
+
+static void SPHComputeDeltasScalar(const SPHParameters &params, const Vec2f &position, const float pressure[2], const SPHKernelParticles &particles, const uint32_t *neighbors, const size_t neighborCount, const float deltaTime, Vec2f *outDelta) {
+	for (size_t index = 0; index < neighborCount; ++index) {
+		const size_t offset = neighbors[index] * particles.stride;
+		const float pressureSum[2] = { pressure[0] + particles.pressures[offset], pressure[1] + particles.nearPressures[offset] };
+		Vec2f delta = Vec2f();
+		SPHComputeDelta(params, position, Vec2f(particles.positionsX[offset], particles.positionsY[offset]), pressureSum, deltaTime, &delta);
+		*outDelta -= delta * 0.5f;
+	}
+}
+
+// Adds the viscosity forces of all pairs of the particle to outForce, the particle gets the negative force times the time step.
+typedef void (SPHViscosityKernel)(const SPHParameters &params, const Vec2f &position, const Vec2f &velocity, const SPHKernelParticles &particles, const uint32_t *neighbors, const size_t neighborCount, Vec2f *outForce);
+
+static void SPHComputeViscosityForcesScalar(const SPHParameters &params, const Vec2f &position, const Vec2f &velocity, const SPHKernelParticles &particles, const uint32_t *neighbors, const size_t neighborCount, Vec2f *outForce) {
+	for (size_t index = 0; index < neighborCount; ++index) {
+		const size_t offset = neighbors[index] * particles.stride;
+		Vec2f force = Vec2f();
+		SPHComputeViscosityForce(params, position, Vec2f(particles.positionsX[offset], particles.positionsY[offset]), velocity, Vec2f(particles.velocitiesX[offset], particles.velocitiesY[offset]), &force);
+		*outForce += force;
+	}
+}
+
+// Particles in blocks of 8, the fields of a block are 8 floats each and the blocks are blockStride floats apart.
+// Separate arrays are blocks with a stride of 8, blocks which interleave all fields of 8 particles have a stride of 8 times the field count.
+const size_t kSPHKernelBlockWidth = 8;
+struct SPHKernelBlocks {
+	const float *positionsX;
+	const float *positionsY;
+	const float *velocitiesX;
+	const float *velocitiesY;
+	const float *pressures;
+	const float *nearPressures;
+	size_t blockStride;
+};
+
+// Contiguous range of neighbors, the end is exclusive
+struct SPHKernelRange {
+	uint32_t start;
+	uint32_t end;
+};
+
+// Offset of the given particle from the field of the first particle
+force_inline size_t SPHComputeBlockOffset(const size_t particleIndex, const size_t blockStride) {
+	return (particleIndex / kSPHKernelBlockWidth) * blockStride + (particleIndex % kSPHKernelBlockWidth);
+}
+
+// Same as the kernels above, but the neighbors are ranges of particles, so the SIMD kernels load whole blocks instead of gathering single lanes
+typedef void (SPHBlockDensityKernel)(const SPHParameters &params, const Vec2f &position, const SPHKernelBlocks &blocks, const SPHKernelRange *ranges, const size_t rangeCount, float outDensity[2]);
+typedef void (SPHBlockDeltaKernel)(const SPHParameters &params, const Vec2f &position, const float pressure[2], const SPHKernelBlocks &blocks, const SPHKernelRange *ranges, const size_t rangeCount, const float deltaTime, Vec2f *outDelta);
+typedef void (SPHBlockViscosityKernel)(const SPHParameters &params, const Vec2f &position, const Vec2f &velocity, const SPHKernelBlocks &blocks, const SPHKernelRange *ranges, const size_t rangeCount, Vec2f *outForce);
+
+static void SPHComputeBlockDensitiesScalar(const SPHParameters &params, const Vec2f &position, const SPHKernelBlocks &blocks, const SPHKernelRange *ranges, const size_t rangeCount, float outDensity[2]) {
+	for (size_t rangeIndex = 0; rangeIndex < rangeCount; ++rangeIndex) {
+		for (uint32_t index = ranges[rangeIndex].start; index < ranges[rangeIndex].end; ++index) {
+			const size_t offset = SPHComputeBlockOffset(index, blocks.blockStride);
+			SPHComputeDensity(params, position, Vec2f(blocks.positionsX[offset], blocks.positionsY[offset]), outDensity);
+		}
+	}
+}
+
+static void SPHComputeBlockDeltasScalar(const SPHParameters &params, const Vec2f &position, const float pressure[2], const SPHKernelBlocks &blocks, const SPHKernelRange *ranges, const size_t rangeCount, const float deltaTime, Vec2f *outDelta) {
+	for (size_t rangeIndex = 0; rangeIndex < rangeCount; ++rangeIndex) {
+		for (uint32_t index = ranges[rangeIndex].start; index < ranges[rangeIndex].end; ++index) {
+			const size_t offset = SPHComputeBlockOffset(index, blocks.blockStride);
+			const float pressureSum[2] = { pressure[0] + blocks.pressures[offset], pressure[1] + blocks.nearPressures[offset] };
+			Vec2f delta = Vec2f();
+			SPHComputeDelta(params, position, Vec2f(blocks.positionsX[offset], blocks.positionsY[offset]), pressureSum, deltaTime, &delta);
+			*outDelta -= delta * 0.5f;
+		}
+	}
+}
+
+static void SPHComputeBlockViscosityForcesScalar(const SPHParameters &params, const Vec2f &position, const Vec2f &velocity, const SPHKernelBlocks &blocks, const SPHKernelRange *ranges, const size_t rangeCount, Vec2f *outForce) {
+	for (size_t rangeIndex = 0; rangeIndex < rangeCount; ++rangeIndex) {
+		for (uint32_t index = ranges[rangeIndex].start; index < ranges[rangeIndex].end; ++index) {
+			const size_t offset = SPHComputeBlockOffset(index, blocks.blockStride);
+			Vec2f force = Vec2f();
+			SPHComputeViscosityForce(params, position, Vec2f(blocks.positionsX[offset], blocks.positionsY[offset]), velocity, Vec2f(blocks.velocitiesX[offset], blocks.velocitiesY[offset]), &force);
+			*outForce += force;
+		}
+	}
+}
+
+force_inline float SPHHorizontalSumSSE(const __m128 value) {
+	__m128 sum = _mm_add_ps(value, _mm_movehl_ps(value, value));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(1, 1, 1, 1)));
+	return _mm_cvtss_f32(sum);
+}
+
+// Reciprocal square root with one Newton step, 22 bits instead of 12
+force_inline __m128 SPHReciprocalSqrtSSE(const __m128 value) {
+	__m128 result = _mm_rsqrt_ps(value);
+	__m128 correction = _mm_sub_ps(_mm_set1_ps(1.5f), _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), value), _mm_mul_ps(result, result)));
+	return _mm_mul_ps(result, correction);
+}
+
+struct SPHKernelConstantsSSE {
+	__m128 kernelHeightSquared;
+	__m128 invKernelHeight;
+	__m128 linearViscosity;
+	__m128 quadraticViscosity;
+	__m128 deltaScale;
+	__m128 minDistanceSquared;
+	__m128 one;
+	__m128 zero;
+};
+
+force_inline SPHKernelConstantsSSE SPHLoadKernelConstantsSSE(const SPHParameters &params, const float deltaTime) {
+	SPHKernelConstantsSSE result;
+	result.kernelHeightSquared = _mm_set1_ps(params.kernelHeight * params.kernelHeight);
+	result.invKernelHeight = _mm_set1_ps(params.invKernelHeight);
+	result.linearViscosity = _mm_set1_ps(params.linearViscosity);
+	result.quadraticViscosity = _mm_set1_ps(params.quadraticViscosity);
+	result.deltaScale = _mm_set1_ps(-0.5f * deltaTime * deltaTime);
+	result.minDistanceSquared = _mm_set1_ps(kSPHKernelMinDistanceSquared);
+	result.one = _mm_set1_ps(1.0f);
+	result.zero = _mm_setzero_ps();
+	return(result);
+}
+
+// Per lane math of the SSE kernels, rx and ry point from the particle to the neighbors and the lane mask marks the valid neighbors
+force_inline void SPHAccumulateDensitiesSSE(const SPHKernelConstantsSSE &constants, const __m128 rx, const __m128 ry, const __m128 laneMask, __m128 *density, __m128 *nearDensity) {
+	__m128 rSquared = _mm_add_ps(_mm_mul_ps(rx, rx), _mm_mul_ps(ry, ry));
+	__m128 mask = _mm_and_ps(_mm_cmplt_ps(rSquared, constants.kernelHeightSquared), laneMask);
+	__m128 term = _mm_and_ps(_mm_sub_ps(constants.one, _mm_mul_ps(_mm_sqrt_ps(rSquared), constants.invKernelHeight)), mask);
+	__m128 termSquared = _mm_mul_ps(term, term);
+	*density = _mm_add_ps(*density, termSquared);
+	*nearDensity = _mm_add_ps(*nearDensity, _mm_mul_ps(termSquared, term));
+}
+
+force_inline void SPHAccumulateDeltasSSE(const SPHKernelConstantsSSE &constants, const __m128 rx, const __m128 ry, const __m128 pressureSum0, const __m128 pressureSum1, const __m128 laneMask, __m128 *dx, __m128 *dy) {
+	__m128 rSquared = _mm_add_ps(_mm_mul_ps(rx, rx), _mm_mul_ps(ry, ry));
+	__m128 mask = _mm_and_ps(_mm_cmplt_ps(rSquared, constants.kernelHeightSquared), laneMask);
+	__m128 invR = SPHReciprocalSqrtSSE(_mm_max_ps(rSquared, constants.minDistanceSquared));
+	__m128 term = _mm_sub_ps(constants.one, _mm_mul_ps(_mm_mul_ps(rSquared, invR), constants.invKernelHeight));
+	__m128 d = _mm_mul_ps(constants.deltaScale, _mm_add_ps(_mm_mul_ps(pressureSum0, term), _mm_mul_ps(pressureSum1, _mm_mul_ps(term, term))));
+	d = _mm_and_ps(_mm_mul_ps(d, invR), mask);
+	*dx = _mm_add_ps(*dx, _mm_mul_ps(d, rx));
+	*dy = _mm_add_ps(*dy, _mm_mul_ps(d, ry));
+}
+
+force_inline void SPHAccumulateViscosityForcesSSE(const SPHKernelConstantsSSE &constants, const __m128 rx, const __m128 ry, const __m128 dvx, const __m128 dvy, const __m128 laneMask, __m128 *fx, __m128 *fy) {
+	__m128 rSquared = _mm_add_ps(_mm_mul_ps(rx, rx), _mm_mul_ps(ry, ry));
+	__m128 invR = SPHReciprocalSqrtSSE(_mm_max_ps(rSquared, constants.minDistanceSquared));
+	__m128 nx = _mm_mul_ps(rx, invR);
+	__m128 ny = _mm_mul_ps(ry, invR);
+	__m128 u = _mm_add_ps(_mm_mul_ps(dvx, nx), _mm_mul_ps(dvy, ny));
+	// Only pairs inside the kernel height which move towards each other
+	__m128 mask = _mm_and_ps(_mm_and_ps(_mm_cmplt_ps(rSquared, constants.kernelHeightSquared), _mm_cmpgt_ps(u, constants.zero)), laneMask);
+	__m128 q = _mm_mul_ps(_mm_mul_ps(rSquared, invR), constants.invKernelHeight);
+	__m128 f = _mm_mul_ps(_mm_sub_ps(constants.one, q), _mm_add_ps(_mm_mul_ps(constants.linearViscosity, u), _mm_mul_ps(constants.quadraticViscosity, _mm_mul_ps(u, u))));
+	f = _mm_and_ps(f, mask);
+	*fx = _mm_add_ps(*fx, _mm_mul_ps(f, nx));
+	*fy = _mm_add_ps(*fy, _mm_mul_ps(f, ny));
+}
+
+static void SPHComputeDensitiesSSE(const SPHParameters &params, const Vec2f &position, const SPHKernelParticles &particles, const uint32_t *neighbors, const size_t neighborCount, float outDensity[2]) {
+	const SPHKernelConstantsSSE constants = SPHLoadKernelConstantsSSE(params, 0.0f);
+	const __m128 px = _mm_set1_ps(position.x);
+	const __m128 py = _mm_set1_ps(position.y);
+	const __m128i laneIndices = _mm_setr_epi32(0, 1, 2, 3);
+	__m128 density = _mm_setzero_ps();
+	__m128 nearDensity = _mm_setzero_ps();
+	for (size_t index = 0; index < neighborCount; index += 4) {
+		// @NOTE: Lanes past the end load the last neighbor again and are masked out
+		const size_t lastIndex = neighborCount - 1;
+		const size_t o0 = neighbors[index] * particles.stride;
+		const size_t o1 = neighbors[std::min(index + 1, lastIndex)] * particles.stride;
+		const size_t o2 = neighbors[std::min(index + 2, lastIndex)] * particles.stride;
+		const size_t o3 = neighbors[std::min(index + 3, lastIndex)] * particles.stride;
+		__m128 rx = _mm_sub_ps(_mm_setr_ps(particles.positionsX[o0], particles.positionsX[o1], particles.positionsX[o2], particles.positionsX[o3]), px);
+		__m128 ry = _mm_sub_ps(_mm_setr_ps(particles.positionsY[o0], particles.positionsY[o1], particles.positionsY[o2], particles.positionsY[o3]), py);
+		__m128 laneMask = _mm_castsi128_ps(_mm_cmplt_epi32(laneIndices, _mm_set1_epi32((int)(neighborCount - index))));
+		SPHAccumulateDensitiesSSE(constants, rx, ry, laneMask, &density, &nearDensity);
+	}
+	outDensity[0] += SPHHorizontalSumSSE(density);
+	outDensity[1] += SPHHorizontalSumSSE(nearDensity);
+}
+
+static void SPHComputeDeltasSSE(const SPHParameters &params, const Vec2f &position, const float pressure[2], const SPHKernelParticles &particles, const uint32_t *neighbors, const size_t neighborCount, const float deltaTime, Vec2f *outDelta) {
+	const SPHKernelConstantsSSE constants = SPHLoadKernelConstantsSSE(params, deltaTime);
+	const __m128 px = _mm_set1_ps(position.x);
+	const __m128 py = _mm_set1_ps(position.y);
+	const __m128 pressure0 = _mm_set1_ps(pressure[0]);
+	const __m128 pressure1 = _mm_set1_ps(pressure[1]);
+	const __m128i laneIndices = _mm_setr_epi32(0, 1, 2, 3);
+	__m128 dx = _mm_setzero_ps();
+	__m128 dy = _mm_setzero_ps();
+	for (size_t index = 0; index < neighborCount; index += 4) {
+		const size_t lastIndex = neighborCount - 1;
+		const size_t o0 = neighbors[index] * particles.stride;
+		const size_t o1 = neighbors[std::min(index + 1, lastIndex)] * particles.stride;
+		const size_t o2 = neighbors[std::min(index + 2, lastIndex)] * particles.stride;
+		const size_t o3 = neighbors[std::min(index + 3, lastIndex)] * particles.stride;
+		__m128 rx = _mm_sub_ps(_mm_setr_ps(particles.positionsX[o0], particles.positionsX[o1], particles.positionsX[o2], particles.positionsX[o3]), px);
+		__m128 ry = _mm_sub_ps(_mm_setr_ps(particles.positionsY[o0], particles.positionsY[o1], particles.positionsY[o2], particles.positionsY[o3]), py);
+		__m128 pressureSum0 = _mm_add_ps(_mm_setr_ps(particles.pressures[o0], particles.pressures[o1], particles.pressures[o2], particles.pressures[o3]), pressure0);
+		__m128 pressureSum1 = _mm_add_ps(_mm_setr_ps(particles.nearPressures[o0], particles.nearPressures[o1], particles.nearPressures[o2], particles.nearPressures[o3]), pressure1);
+		__m128 laneMask = _mm_castsi128_ps(_mm_cmplt_epi32(laneIndices, _mm_set1_epi32((int)(neighborCount - index))));
+		SPHAccumulateDeltasSSE(constants, rx, ry, pressureSum0, pressureSum1, laneMask, &dx, &dy);
+	}
+	outDelta->x += SPHHorizontalSumSSE(dx);
+	outDelta->y += SPHHorizontalSumSSE(dy);
+}
+
+static void SPHComputeViscosityForcesSSE(const SPHParameters &params, const Vec2f &position, const Vec2f &velocity, const SPHKernelParticles &particles, const uint32_t *neighbors, const size_t neighborCount, Vec2f *outForce) {
+	const SPHKernelConstantsSSE constants = SPHLoadKernelConstantsSSE(params, 0.0f);
+	const __m128 px = _mm_set1_ps(position.x);
+	const __m128 py = _mm_set1_ps(position.y);
+	const __m128 vx = _mm_set1_ps(velocity.x);
+	const __m128 vy = _mm_set1_ps(velocity.y);
+	const __m128i laneIndices = _mm_setr_epi32(0, 1, 2, 3);
+	__m128 fx = _mm_setzero_ps();
+	__m128 fy = _mm_setzero_ps();
+	for (size_t index = 0; index < neighborCount; index += 4) {
+		const size_t lastIndex = neighborCount - 1;
+		const size_t o0 = neighbors[index] * particles.stride;
+		const size_t o1 = neighbors[std::min(index + 1, lastIndex)] * particles.stride;
+		const size_t o2 = neighbors[std::min(index + 2, lastIndex)] * particles.stride;
+		const size_t o3 = neighbors[std::min(index + 3, lastIndex)] * particles.stride;
+		__m128 rx = _mm_sub_ps(_mm_setr_ps(particles.positionsX[o0], particles.positionsX[o1], particles.positionsX[o2], particles.positionsX[o3]), px);
+		__m128 ry = _mm_sub_ps(_mm_setr_ps(particles.positionsY[o0], particles.positionsY[o1], particles.positionsY[o2], particles.positionsY[o3]), py);
+		__m128 dvx = _mm_sub_ps(vx, _mm_setr_ps(particles.velocitiesX[o0], particles.velocitiesX[o1], particles.velocitiesX[o2], particles.velocitiesX[o3]));
+		__m128 dvy = _mm_sub_ps(vy, _mm_setr_ps(particles.velocitiesY[o0], particles.velocitiesY[o1], particles.velocitiesY[o2], particles.velocitiesY[o3]));
+		__m128 laneMask = _mm_castsi128_ps(_mm_cmplt_epi32(laneIndices, _mm_set1_epi32((int)(neighborCount - index))));
+		SPHAccumulateViscosityForcesSSE(constants, rx, ry, dvx, dvy, laneMask, &fx, &fy);
+	}
+	outForce->x += SPHHorizontalSumSSE(fx);
+	outForce->y += SPHHorizontalSumSSE(fy);
+}
+
+SPH_TARGET_AVX2 static float SPHHorizontalSumAVX2(const __m256 value) {
+	__m128 sum = _mm_add_ps(_mm256_castps256_ps128(value), _mm256_extractf128_ps(value, 1));
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(1, 1, 1, 1)));
+	return _mm_cvtss_f32(sum);
+}
+
+SPH_TARGET_AVX2 static __m256 SPHReciprocalSqrtAVX2(const __m256 value) {
+	__m256 result = _mm256_rsqrt_ps(value);
+	__m256 correction = _mm256_sub_ps(_mm256_set1_ps(1.5f), _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), value), _mm256_mul_ps(result, result)));
+	return _mm256_mul_ps(result, correction);
+}
+
+struct SPHKernelConstantsAVX2 {
+	__m256 kernelHeightSquared;
+	__m256 invKernelHeight;
+	__m256 linearViscosity;
+	__m256 quadraticViscosity;
+	__m256 deltaScale;
+	__m256 minDistanceSquared;
+	__m256 one;
+	__m256 zero;
+};
+
+SPH_TARGET_AVX2 static SPHKernelConstantsAVX2 SPHLoadKernelConstantsAVX2(const SPHParameters &params, const float deltaTime) {
+	SPHKernelConstantsAVX2 result;
+	result.kernelHeightSquared = _mm256_set1_ps(params.kernelHeight * params.kernelHeight);
+	result.invKernelHeight = _mm256_set1_ps(params.invKernelHeight);
+	result.linearViscosity = _mm256_set1_ps(params.linearViscosity);
+	result.quadraticViscosity = _mm256_set1_ps(params.quadraticViscosity);
+	result.deltaScale = _mm256_set1_ps(-0.5f * deltaTime * deltaTime);
+	result.minDistanceSquared = _mm256_set1_ps(kSPHKernelMinDistanceSquared);
+	result.one = _mm256_set1_ps(1.0f);
+	result.zero = _mm256_setzero_ps();
+	return(result);
+}
+
+SPH_TARGET_AVX2 static void SPHAccumulateDensitiesAVX2(const SPHKernelConstantsAVX2 &constants, const __m256 rx, const __m256 ry, const __m256 laneMask, __m256 *density, __m256 *nearDensity) {
+	__m256 rSquared = _mm256_add_ps(_mm256_mul_ps(rx, rx), _mm256_mul_ps(ry, ry));
+	__m256 mask = _mm256_and_ps(_mm256_cmp_ps(rSquared, constants.kernelHeightSquared, _CMP_LT_OQ), laneMask);
+	__m256 term = _mm256_and_ps(_mm256_sub_ps(constants.one, _mm256_mul_ps(_mm256_sqrt_ps(rSquared), constants.invKernelHeight)), mask);
+	__m256 termSquared = _mm256_mul_ps(term, term);
+	*density = _mm256_add_ps(*density, termSquared);
+	*nearDensity = _mm256_add_ps(*nearDensity, _mm256_mul_ps(termSquared, term));
+}
+
+SPH_TARGET_AVX2 static void SPHAccumulateDeltasAVX2(const SPHKernelConstantsAVX2 &constants, const __m256 rx, const __m256 ry, const __m256 pressureSum0, const __m256 pressureSum1, const __m256 laneMask, __m256 *dx, __m256 *dy) {
+	__m256 rSquared = _mm256_add_ps(_mm256_mul_ps(rx, rx), _mm256_mul_ps(ry, ry));
+	__m256 mask = _mm256_and_ps(_mm256_cmp_ps(rSquared, constants.kernelHeightSquared, _CMP_LT_OQ), laneMask);
+	__m256 invR = SPHReciprocalSqrtAVX2(_mm256_max_ps(rSquared, constants.minDistanceSquared));
+	__m256 term = _mm256_sub_ps(constants.one, _mm256_mul_ps(_mm256_mul_ps(rSquared, invR), constants.invKernelHeight));
+	__m256 d = _mm256_mul_ps(constants.deltaScale, _mm256_add_ps(_mm256_mul_ps(pressureSum0, term), _mm256_mul_ps(pressureSum1, _mm256_mul_ps(term, term))));
+	d = _mm256_and_ps(_mm256_mul_ps(d, invR), mask);
+	*dx = _mm256_add_ps(*dx, _mm256_mul_ps(d, rx));
+	*dy = _mm256_add_ps(*dy, _mm256_mul_ps(d, ry));
+}
+
+SPH_TARGET_AVX2 static void SPHAccumulateViscosityForcesAVX2(const SPHKernelConstantsAVX2 &constants, const __m256 rx, const __m256 ry, const __m256 dvx, const __m256 dvy, const __m256 laneMask, __m256 *fx, __m256 *fy) {
+	__m256 rSquared = _mm256_add_ps(_mm256_mul_ps(rx, rx), _mm256_mul_ps(ry, ry));
+	__m256 invR = SPHReciprocalSqrtAVX2(_mm256_max_ps(rSquared, constants.minDistanceSquared));
+	__m256 nx = _mm256_mul_ps(rx, invR);
+	__m256 ny = _mm256_mul_ps(ry, invR);
+	__m256 u = _mm256_add_ps(_mm256_mul_ps(dvx, nx), _mm256_mul_ps(dvy, ny));
+	__m256 mask = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(rSquared, constants.kernelHeightSquared, _CMP_LT_OQ), _mm256_cmp_ps(u, constants.zero, _CMP_GT_OQ)), laneMask);
+	__m256 q = _mm256_mul_ps(_mm256_mul_ps(rSquared, invR), constants.invKernelHeight);
+	__m256 f = _mm256_mul_ps(_mm256_sub_ps(constants.one, q), _mm256_add_ps(_mm256_mul_ps(constants.linearViscosity, u), _mm256_mul_ps(constants.quadraticViscosity, _mm256_mul_ps(u, u))));
+	f = _mm256_and_ps(f, mask);
+	*fx = _mm256_add_ps(*fx, _mm256_mul_ps(f, nx));
+	*fy = _mm256_add_ps(*fy, _mm256_mul_ps(f, ny));
+}
+
+SPH_TARGET_AVX2 static void SPHComputeDensitiesAVX2(const SPHParameters &params, const Vec2f &position, const SPHKernelParticles &particles, const uint32_t *neighbors, const size_t neighborCount, float outDensity[2]) {
+	const SPHKernelConstantsAVX2 constants = SPHLoadKernelConstantsAVX2(params, 0.0f);
+	const __m256 px = _mm256_set1_ps(position.x);
+	const __m256 py = _mm256_set1_ps(position.y);
+	const __m256i strides = _mm256_set1_epi32((int)particles.stride);
+	const __m256i laneIndices = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256 density = _mm256_setzero_ps();
+	__m256 nearDensity = _mm256_setzero_ps();
+	for (size_t index = 0; index < neighborCount; index += 8) {
+		// @NOTE: Masked loads and gathers never touch the lanes past the end
+		__m256i laneMask = _mm256_cmpgt_epi32(_mm256_set1_epi32((int)(neighborCount - index)), laneIndices);
+		__m256 laneMaskFloat = _mm256_castsi256_ps(laneMask);
+		__m256i offsets = _mm256_mullo_epi32(_mm256_maskload_epi32((const int *)(neighbors + index), laneMask), strides);
+		__m256 rx = _mm256_sub_ps(_mm256_mask_i32gather_ps(px, particles.positionsX, offsets, laneMaskFloat, 4), px);
+		__m256 ry = _mm256_sub_ps(_mm256_mask_i32gather_ps(py, particles.positionsY, offsets, laneMaskFloat, 4), py);
+		SPHAccumulateDensitiesAVX2(constants, rx, ry, laneMaskFloat, &density, &nearDensity);
+	}
+	outDensity[0] += SPHHorizontalSumAVX2(density);
+	outDensity[1] += SPHHorizontalSumAVX2(nearDensity);
+}
+
+SPH_TARGET_AVX2 static void SPHComputeDeltasAVX2(const SPHParameters &params, const Vec2f &position, const float pressure[2], const SPHKernelParticles &particles, const uint32_t *neighbors, const size_t neighborCount, const float deltaTime, Vec2f *outDelta) {
+	const SPHKernelConstantsAVX2 constants = SPHLoadKernelConstantsAVX2(params, deltaTime);
+	const __m256 px = _mm256_set1_ps(position.x);
+	const __m256 py = _mm256_set1_ps(position.y);
+	const __m256 pressure0 = _mm256_set1_ps(pressure[0]);
+	const __m256 pressure1 = _mm256_set1_ps(pressure[1]);
+	const __m256i strides = _mm256_set1_epi32((int)particles.stride);
+	const __m256i laneIndices = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256 dx = _mm256_setzero_ps();
+	__m256 dy = _mm256_setzero_ps();
+	for (size_t index = 0; index < neighborCount; index += 8) {
+		__m256i laneMask = _mm256_cmpgt_epi32(_mm256_set1_epi32((int)(neighborCount - index)), laneIndices);
+		__m256 laneMaskFloat = _mm256_castsi256_ps(laneMask);
+		__m256i offsets = _mm256_mullo_epi32(_mm256_maskload_epi32((const int *)(neighbors + index), laneMask), strides);
+		__m256 rx = _mm256_sub_ps(_mm256_mask_i32gather_ps(px, particles.positionsX, offsets, laneMaskFloat, 4), px);
+		__m256 ry = _mm256_sub_ps(_mm256_mask_i32gather_ps(py, particles.positionsY, offsets, laneMaskFloat, 4), py);
+		__m256 pressureSum0 = _mm256_add_ps(_mm256_mask_i32gather_ps(_mm256_setzero_ps(), particles.pressures, offsets, laneMaskFloat, 4), pressure0);
+		__m256 pressureSum1 = _mm256_add_ps(_mm256_mask_i32gather_ps(_mm256_setzero_ps(), particles.nearPressures, offsets, laneMaskFloat, 4), pressure1);
+		SPHAccumulateDeltasAVX2(constants, rx, ry, pressureSum0, pressureSum1, laneMaskFloat, &dx, &dy);
+	}
+	outDelta->x += SPHHorizontalSumAVX2(dx);
+	outDelta->y += SPHHorizontalSumAVX2(dy);
+}
+
+SPH_TARGET_AVX2 static void SPHComputeViscosityForcesAVX2(const SPHParameters &params, const Vec2f &position, const Vec2f &velocity, const SPHKernelParticles &particles, const uint32_t *neighbors, const size_t neighborCount, Vec2f *outForce) {
+	const SPHKernelConstantsAVX2 constants = SPHLoadKernelConstantsAVX2(params, 0.0f);
+	const __m256 px = _mm256_set1_ps(position.x);
+	const __m256 py = _mm256_set1_ps(position.y);
+	const __m256 vx = _mm256_set1_ps(velocity.x);
+	const __m256 vy = _mm256_set1_ps(velocity.y);
+	const __m256i strides = _mm256_set1_epi32((int)particles.stride);
+	const __m256i laneIndices = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256 fx = _mm256_setzero_ps();
+	__m256 fy = _mm256_setzero_ps();
+	for (size_t index = 0; index < neighborCount; index += 8) {
+		__m256i laneMask = _mm256_cmpgt_epi32(_mm256_set1_epi32((int)(neighborCount - index)), laneIndices);
+		__m256 laneMaskFloat = _mm256_castsi256_ps(laneMask);
+		__m256i offsets = _mm256_mullo_epi32(_mm256_maskload_epi32((const int *)(neighbors + index), laneMask), strides);
+		__m256 rx = _mm256_sub_ps(_mm256_mask_i32gather_ps(px, particles.positionsX, offsets, laneMaskFloat, 4), px);
+		__m256 ry = _mm256_sub_ps(_mm256_mask_i32gather_ps(py, particles.positionsY, offsets, laneMaskFloat, 4), py);
+		__m256 dvx = _mm256_sub_ps(vx, _mm256_mask_i32gather_ps(vx, particles.velocitiesX, offsets, laneMaskFloat, 4));
+		__m256 dvy = _mm256_sub_ps(vy, _mm256_mask_i32gather_ps(vy, particles.velocitiesY, offsets, laneMaskFloat, 4));
+		SPHAccumulateViscosityForcesAVX2(constants, rx, ry, dvx, dvy, laneMaskFloat, &fx, &fy);
+	}
+	outForce->x += SPHHorizontalSumAVX2(fx);
+	outForce->y += SPHHorizontalSumAVX2(fy);
+}
+
+// @NOTE: The lanes of a block outside of the range may hold other particles or garbage past the last particle, they are masked out like the lanes past the end of a neighbor list.
+// Each block is loaded as two aligned halves, every block starts on 32 bytes.
+force_inline __m128 SPHComputeBlockLaneMaskSSE(const uint32_t blockStart, const SPHKernelRange &range) {
+	__m128i indices = _mm_add_epi32(_mm_set1_epi32((int)blockStart), _mm_setr_epi32(0, 1, 2, 3));
+	__m128i mask = _mm_and_si128(_mm_cmpgt_epi32(indices, _mm_set1_epi32((int)range.start - 1)), _mm_cmplt_epi32(indices, _mm_set1_epi32((int)range.end)));
+	return _mm_castsi128_ps(mask);
+}
+
+static void SPHComputeBlockDensitiesSSE(const SPHParameters &params, const Vec2f &position, const SPHKernelBlocks &blocks, const SPHKernelRange *ranges, const size_t rangeCount, float outDensity[2]) {
+	const SPHKernelConstantsSSE constants = SPHLoadKernelConstantsSSE(params, 0.0f);
+	const __m128 px = _mm_set1_ps(position.x);
+	const __m128 py = _mm_set1_ps(position.y);
+	__m128 density = _mm_setzero_ps();
+	__m128 nearDensity = _mm_setzero_ps();
+	for (size_t rangeIndex = 0; rangeIndex < rangeCount; ++rangeIndex) {
+		const SPHKernelRange &range = ranges[rangeIndex];
+		if (range.start == range.end) continue;
+		for (uint32_t blockIndex = range.start / kSPHKernelBlockWidth, lastBlock = (range.end - 1) / kSPHKernelBlockWidth; blockIndex <= lastBlock; ++blockIndex) {
+			const size_t offset = blockIndex * blocks.blockStride;
+			for (uint32_t half = 0; half < 2; ++half) {
+				const size_t halfOffset = offset + half * 4;
+				__m128 laneMask = SPHComputeBlockLaneMaskSSE(blockIndex * (uint32_t)kSPHKernelBlockWidth + half * 4, range);
+				__m128 rx = _mm_sub_ps(_mm_load_ps(blocks.positionsX + halfOffset), px);
+				__m128 ry = _mm_sub_ps(_mm_load_ps(blocks.positionsY + halfOffset), py);
+				SPHAccumulateDensitiesSSE(constants, rx, ry, laneMask, &density, &nearDensity);
+			}
+		}
+	}
+	outDensity[0] += SPHHorizontalSumSSE(density);
+	outDensity[1] += SPHHorizontalSumSSE(nearDensity);
+}
+
+static void SPHComputeBlockDeltasSSE(const SPHParameters &params, const Vec2f &position, const float pressure[2], const SPHKernelBlocks &blocks, const SPHKernelRange *ranges, const size_t rangeCount, const float deltaTime, Vec2f *outDelta) {
+	const SPHKernelConstantsSSE constants = SPHLoadKernelConstantsSSE(params, deltaTime);
+	const __m128 px = _mm_set1_ps(position.x);
+	const __m128 py = _mm_set1_ps(position.y);
+	const __m128 pressure0 = _mm_set1_ps(pressure[0]);
+	const __m128 pressure1 = _mm_set1_ps(pressure[1]);
+	__m128 dx = _mm_setzero_ps();
+	__m128 dy = _mm_setzero_ps();
+	for (size_t rangeIndex = 0; rangeIndex < rangeCount; ++rangeIndex) {
+		const SPHKernelRange &range = ranges[rangeIndex];
+		if (range.start == range.end) continue;
+		for (uint32_t blockIndex = range.start / kSPHKernelBlockWidth, lastBlock = (range.end - 1) / kSPHKernelBlockWidth; blockIndex <= lastBlock; ++blockIndex) {
+			const size_t offset = blockIndex * blocks.blockStride;
+			for (uint32_t half = 0; half < 2; ++half) {
+				const size_t halfOffset = offset + half * 4;
+				__m128 laneMask = SPHComputeBlockLaneMaskSSE(blockIndex * (uint32_t)kSPHKernelBlockWidth + half * 4, range);
+				__m128 rx = _mm_sub_ps(_mm_load_ps(blocks.positionsX + halfOffset), px);
+				__m128 ry = _mm_sub_ps(_mm_load_ps(blocks.positionsY + halfOffset), py);
+				__m128 pressureSum0 = _mm_add_ps(_mm_load_ps(blocks.pressures + halfOffset), pressure0);
+				__m128 pressureSum1 = _mm_add_ps(_mm_load_ps(blocks.nearPressures + halfOffset), pressure1);
+				SPHAccumulateDeltasSSE(constants, rx, ry, pressureSum0, pressureSum1, laneMask, &dx, &dy);
+			}
+		}
+	}
+	outDelta->x += SPHHorizontalSumSSE(dx);
+	outDelta->y += SPHHorizontalSumSSE(dy);
+}
+
+static void SPHComputeBlockViscosityForcesSSE(const SPHParameters &params, const Vec2f &position, const Vec2f &velocity, const SPHKernelBlocks &blocks, const SPHKernelRange *ranges, const size_t rangeCount, Vec2f *outForce) {
+	const SPHKernelConstantsSSE constants = SPHLoadKernelConstantsSSE(params, 0.0f);
+	const __m128 px = _mm_set1_ps(position.x);
+	const __m128 py = _mm_set1_ps(position.y);
+	const __m128 vx = _mm_set1_ps(velocity.x);
+	const __m128 vy = _mm_set1_ps(velocity.y);
+	__m128 fx = _mm_setzero_ps();
+	__m128 fy = _mm_setzero_ps();
+	for (size_t rangeIndex = 0; rangeIndex < rangeCount; ++rangeIndex) {
+		const SPHKernelRange &range = ranges[rangeIndex];
+		if (range.start == range.end) continue;
+		for (uint32_t blockIndex = range.start / kSPHKernelBlockWidth, lastBlock = (range.end - 1) / kSPHKernelBlockWidth; blockIndex <= lastBlock; ++blockIndex) {
+			const size_t offset = blockIndex * blocks.blockStride;
+			for (uint32_t half = 0; half < 2; ++half) {
+				const size_t halfOffset = offset + half * 4;
+				__m128 laneMask = SPHComputeBlockLaneMaskSSE(blockIndex * (uint32_t)kSPHKernelBlockWidth + half * 4, range);
+				__m128 rx = _mm_sub_ps(_mm_load_ps(blocks.positionsX + halfOffset), px);
+				__m128 ry = _mm_sub_ps(_mm_load_ps(blocks.positionsY + halfOffset), py);
+				__m128 dvx = _mm_sub_ps(vx, _mm_load_ps(blocks.velocitiesX + halfOffset));
+				__m128 dvy = _mm_sub_ps(vy, _mm_load_ps(blocks.velocitiesY + halfOffset));
+				SPHAccumulateViscosityForcesSSE(constants, rx, ry, dvx, dvy, laneMask, &fx, &fy);
+			}
+		}
+	}
+	outForce->x += SPHHorizontalSumSSE(fx);
+	outForce->y += SPHHorizontalSumSSE(fy);
+}
+
+SPH_TARGET_AVX2 static __m256 SPHComputeBlockLaneMaskAVX2(const uint32_t blockStart, const SPHKernelRange &range) {
+	__m256i indices = _mm256_add_epi32(_mm256_set1_epi32((int)blockStart), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+	__m256i mask = _mm256_and_si256(_mm256_cmpgt_epi32(indices, _mm256_set1_epi32((int)range.start - 1)), _mm256_cmpgt_epi32(_mm256_set1_epi32((int)range.end), indices));
+	return _mm256_castsi256_ps(mask);
+}
+
+SPH_TARGET_AVX2 static void SPHComputeBlockDensitiesAVX2(const SPHParameters &params, const Vec2f &position, const SPHKernelBlocks &blocks, const SPHKernelRange *ranges, const size_t rangeCount, float outDensity[2]) {
+	const SPHKernelConstantsAVX2 constants = SPHLoadKernelConstantsAVX2(params, 0.0f);
+	const __m256 px = _mm256_set1_ps(position.x);
+	const __m256 py = _mm256_set1_ps(position.y);
+	__m256 density = _mm256_setzero_ps();
+	__m256 nearDensity = _mm256_setzero_ps();
+	for (size_t rangeIndex = 0; rangeIndex < rangeCount; ++rangeIndex) {
+		const SPHKernelRange &range = ranges[rangeIndex];
+		if (range.start == range.end) continue;
+		for (uint32_t blockIndex = range.start / kSPHKernelBlockWidth, lastBlock = (range.end - 1) / kSPHKernelBlockWidth; blockIndex <= lastBlock; ++blockIndex) {
+			const size_t offset = blockIndex * blocks.blockStride;
+			__m256 laneMask = SPHComputeBlockLaneMaskAVX2(blockIndex * (uint32_t)kSPHKernelBlockWidth, range);
+			__m256 rx = _mm256_sub_ps(_mm256_load_ps(blocks.positionsX + offset), px);
+			__m256 ry = _mm256_sub_ps(_mm256_load_ps(blocks.positionsY + offset), py);
+			SPHAccumulateDensitiesAVX2(constants, rx, ry, laneMask, &density, &nearDensity);
+		}
+	}
+	outDensity[0] += SPHHorizontalSumAVX2(density);
+	outDensity[1] += SPHHorizontalSumAVX2(nearDensity);
+}
+
+SPH_TARGET_AVX2 static void SPHComputeBlockDeltasAVX2(const SPHParameters &params, const Vec2f &position, const float pressure[2], const SPHKernelBlocks &blocks, const SPHKernelRange *ranges, const size_t rangeCount, const float deltaTime, Vec2f *outDelta) {
+	const SPHKernelConstantsAVX2 constants = SPHLoadKernelConstantsAVX2(params, deltaTime);
+	const __m256 px = _mm256_set1_ps(position.x);
+	const __m256 py = _mm256_set1_ps(position.y);
+	const __m256 pressure0 = _mm256_set1_ps(pressure[0]);
+	const __m256 pressure1 = _mm256_set1_ps(pressure[1]);
+	__m256 dx = _mm256_setzero_ps();
+	__m256 dy = _mm256_setzero_ps();
+	for (size_t rangeIndex = 0; rangeIndex < rangeCount; ++rangeIndex) {
+		const SPHKernelRange &range = ranges[rangeIndex];
+		if (range.start == range.end) continue;
+		for (uint32_t blockIndex = range.start / kSPHKernelBlockWidth, lastBlock = (range.end - 1) / kSPHKernelBlockWidth; blockIndex <= lastBlock; ++blockIndex) {
+			const size_t offset = blockIndex * blocks.blockStride;
+			__m256 laneMask = SPHComputeBlockLaneMaskAVX2(blockIndex * (uint32_t)kSPHKernelBlockWidth, range);
+			__m256 rx = _mm256_sub_ps(_mm256_load_ps(blocks.positionsX + offset), px);
+			__m256 ry = _mm256_sub_ps(_mm256_load_ps(blocks.positionsY + offset), py);
+			__m256 pressureSum0 = _mm256_add_ps(_mm256_load_ps(blocks.pressures + offset), pressure0);
+			__m256 pressureSum1 = _mm256_add_ps(_mm256_load_ps(blocks.nearPressures + offset), pressure1);
+			SPHAccumulateDeltasAVX2(constants, rx, ry, pressureSum0, pressureSum1, laneMask, &dx, &dy);
+		}
+	}
+	outDelta->x += SPHHorizontalSumAVX2(dx);
+	outDelta->y += SPHHorizontalSumAVX2(dy);
+}
+
+SPH_TARGET_AVX2 static void SPHComputeBlockViscosityForcesAVX2(const SPHParameters &params, const Vec2f &position, const Vec2f &velocity, const SPHKernelBlocks &blocks, const SPHKernelRange *ranges, const size_t rangeCount, Vec2f *outForce) {
+	const SPHKernelConstantsAVX2 constants = SPHLoadKernelConstantsAVX2(params, 0.0f);
+	const __m256 px = _mm256_set1_ps(position.x);
+	const __m256 py = _mm256_set1_ps(position.y);
+	const __m256 vx = _mm256_set1_ps(velocity.x);
+	const __m256 vy = _mm256_set1_ps(velocity.y);
+	__m256 fx = _mm256_setzero_ps();
+	__m256 fy = _mm256_setzero_ps();
+	for (size_t rangeIndex = 0; rangeIndex < rangeCount; ++rangeIndex) {
+		const SPHKernelRange &range = ranges[rangeIndex];
+		if (range.start == range.end) continue;
+		for (uint32_t blockIndex = range.start / kSPHKernelBlockWidth, lastBlock = (range.end - 1) / kSPHKernelBlockWidth; blockIndex <= lastBlock; ++blockIndex) {
+			const size_t offset = blockIndex * blocks.blockStride;
+			__m256 laneMask = SPHComputeBlockLaneMaskAVX2(blockIndex * (uint32_t)kSPHKernelBlockWidth, range);
+			__m256 rx = _mm256_sub_ps(_mm256_load_ps(blocks.positionsX + offset), px);
+			__m256 ry = _mm256_sub_ps(_mm256_load_ps(blocks.positionsY + offset), py);
+			__m256 dvx = _mm256_sub_ps(vx, _mm256_load_ps(blocks.velocitiesX + offset));
+			__m256 dvy = _mm256_sub_ps(vy, _mm256_load_ps(blocks.velocitiesY + offset));
+			SPHAccumulateViscosityForcesAVX2(constants, rx, ry, dvx, dvy, laneMask, &fx, &fy);
+		}
+	}
+	outForce->x += SPHHorizontalSumAVX2(fx);
+	outForce->y += SPHHorizontalSumAVX2(fy);
+}
+
+// Boundary plane for the plane collision kernels
+struct SPHKernelPlane {
+	Vec2f normal;
+	float distance;
+};
+
+// Pushes a range of particles out of all planes, the planes are applied to each particle in order like SPHSolvePlaneCollision.
+// The positions point to the first particle of the range and are written back, the stride is the distance of two particles in floats.
+typedef void (SPHPlaneCollisionKernel)(float *positionsX, float *positionsY, const size_t stride, const size_t count, const SPHKernelPlane *planes, const size_t planeCount);
+
+static void SPHSolvePlaneCollisionsScalar(float *positionsX, float *positionsY, const size_t stride, const size_t count, const SPHKernelPlane *planes, const size_t planeCount) {
+	for (size_t index = 0; index < count; ++index) {
+		const size_t offset = index * stride;
+		Vec2f position = Vec2f(positionsX[offset], positionsY[offset]);
+		for (size_t planeIndex = 0; planeIndex < planeCount; ++planeIndex) {
+			SPHSolvePlaneCollision(&position, planes[planeIndex].normal, planes[planeIndex].distance);
+		}
+		positionsX[offset] = position.x;
+		positionsY[offset] = position.y;
+	}
+}
+
+// @NOTE: Same operations in the same order as SPHSolvePlaneCollision, lanes without penetration add zero, so the results match the scalar kernel exactly
+static void SPHSolvePlaneCollisionsSSE(float *positionsX, float *positionsY, const size_t stride, const size_t count, const SPHKernelPlane *planes, const size_t planeCount) {
+	const __m128 radius = _mm_set1_ps(kSPHParticleCollisionRadius);
+	for (size_t index = 0; index < count; index += 4) {
+		// Lanes past the end load the last particle again and are not written back
+		const size_t laneCount = std::min(count - index, (size_t)4);
+		const size_t lastIndex = count - 1;
+		const size_t o0 = index * stride;
+		const size_t o1 = std::min(index + 1, lastIndex) * stride;
+		const size_t o2 = std::min(index + 2, lastIndex) * stride;
+		const size_t o3 = std::min(index + 3, lastIndex) * stride;
+		__m128 px = _mm_setr_ps(positionsX[o0], positionsX[o1], positionsX[o2], positionsX[o3]);
+		__m128 py = _mm_setr_ps(positionsY[o0], positionsY[o1], positionsY[o2], positionsY[o3]);
+		for (size_t planeIndex = 0; planeIndex < planeCount; ++planeIndex) {
+			const SPHKernelPlane &plane = planes[planeIndex];
+			const __m128 nx = _mm_set1_ps(plane.normal.x);
+			const __m128 ny = _mm_set1_ps(plane.normal.y);
+			__m128 dx = _mm_sub_ps(px, _mm_set1_ps(plane.normal.x * plane.distance));
+			__m128 dy = _mm_sub_ps(py, _mm_set1_ps(plane.normal.y * plane.distance));
+			__m128 proj = _mm_add_ps(_mm_mul_ps(dx, nx), _mm_mul_ps(dy, ny));
+			__m128 penetration = _mm_and_ps(_mm_sub_ps(radius, proj), _mm_cmple_ps(proj, radius));
+			px = _mm_add_ps(px, _mm_mul_ps(nx, penetration));
+			py = _mm_add_ps(py, _mm_mul_ps(ny, penetration));
+		}
+		float resultX[4], resultY[4];
+		_mm_storeu_ps(resultX, px);
+		_mm_storeu_ps(resultY, py);
+		for (size_t lane = 0; lane < laneCount; ++lane) {
+			positionsX[(index + lane) * stride] = resultX[lane];
+			positionsY[(index + lane) * stride] = resultY[lane];
+		}
+	}
+}
+
+SPH_TARGET_AVX2 static void SPHSolvePlaneCollisionsAVX2(float *positionsX, float *positionsY, const size_t stride, const size_t count, const SPHKernelPlane *planes, const size_t planeCount) {
+	const __m256 radius = _mm256_set1_ps(kSPHParticleCollisionRadius);
+	const __m256i laneIndices = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m256i strides = _mm256_set1_epi32((int)stride);
+	for (size_t index = 0; index < count; index += 8) {
+		// Lanes past the end are never gathered nor written back
+		const size_t laneCount = std::min(count - index, (size_t)8);
+		__m256 laneMask = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32((int)laneCount), laneIndices));
+		__m256i offsets = _mm256_mullo_epi32(laneIndices, strides);
+		const float *baseX = positionsX + index * stride;
+		const float *baseY = positionsY + index * stride;
+		__m256 px = _mm256_mask_i32gather_ps(_mm256_setzero_ps(), baseX, offsets, laneMask, 4);
+		__m256 py = _mm256_mask_i32gather_ps(_mm256_setzero_ps(), baseY, offsets, laneMask, 4);
+		for (size_t planeIndex = 0; planeIndex < planeCount; ++planeIndex) {
+			const SPHKernelPlane &plane = planes[planeIndex];
+			const __m256 nx = _mm256_set1_ps(plane.normal.x);
+			const __m256 ny = _mm256_set1_ps(plane.normal.y);
+			__m256 dx = _mm256_sub_ps(px, _mm256_set1_ps(plane.normal.x * plane.distance));
+			__m256 dy = _mm256_sub_ps(py, _mm256_set1_ps(plane.normal.y * plane.distance));
+			__m256 proj = _mm256_add_ps(_mm256_mul_ps(dx, nx), _mm256_mul_ps(dy, ny));
+			__m256 penetration = _mm256_and_ps(_mm256_sub_ps(radius, proj), _mm256_cmp_ps(proj, radius, _CMP_LE_OQ));
+			px = _mm256_add_ps(px, _mm256_mul_ps(nx, penetration));
+			py = _mm256_add_ps(py, _mm256_mul_ps(ny, penetration));
+		}
+		float resultX[8], resultY[8];
+		_mm256_storeu_ps(resultX, px);
+		_mm256_storeu_ps(resultY, py);
+		for (size_t lane = 0; lane < laneCount; ++lane) {
+			positionsX[(index + lane) * stride] = resultX[lane];
+			positionsY[(index + lane) * stride] = resultY[lane];
+		}
+	}
+}
+
+// One entry per kernel set, all kernels of a set use the same instructions
+struct SPHKernelTable {
+	SPHDensityKernel *densities;
+	SPHDeltaKernel *deltas;
+	SPHViscosityKernel *viscosityForces;
+	SPHBlockDensityKernel *blockDensities;
+	SPHBlockDeltaKernel *blockDeltas;
+	SPHBlockViscosityKernel *blockViscosityForces;
+	SPHPlaneCollisionKernel *planeCollisions;
+};
+
+static const SPHKernelTable kSPHKernelTables[SPHKernelSet_Count] = {
+	{ SPHComputeDensitiesScalar, SPHComputeDeltasScalar, SPHComputeViscosityForcesScalar, SPHComputeBlockDensitiesScalar, SPHComputeBlockDeltasScalar, SPHComputeBlockViscosityForcesScalar, SPHSolvePlaneCollisionsScalar },
+	{ SPHComputeDensitiesSSE, SPHComputeDeltasSSE, SPHComputeViscosityForcesSSE, SPHComputeBlockDensitiesSSE, SPHComputeBlockDeltasSSE, SPHComputeBlockViscosityForcesSSE, SPHSolvePlaneCollisionsSSE },
+	{ SPHComputeDensitiesAVX2, SPHComputeDeltasAVX2, SPHComputeViscosityForcesAVX2, SPHComputeBlockDensitiesAVX2, SPHComputeBlockDeltasAVX2, SPHComputeBlockViscosityForcesAVX2, SPHSolvePlaneCollisionsAVX2 },
+};
+
+// Best kernel set the CPU and the OS support
+static SPHKernelSet SPHGetSupportedKernelSet() {
+	fplCPUCapabilities caps = fplZeroInit;
+	if (!fplCPUGetCapabilities(&caps)) {
+		return SPHKernelSet_Scalar;
+	}
+	if (caps.hasAVX2) {
+		return SPHKernelSet_AVX2;
+	}
+	if (caps.hasSSE2) {
+		return SPHKernelSet_SSE;
+	}
+	return SPHKernelSet_Scalar;
+}
+
+#endif // SPH_SIMD_H
@@ -5,86 +5,573 @@
 #include <final_platform_layer.h>
 
 #include <assert.h>
+#include <algorithm>
 #include <functional>
-#include <deque> // @TODO(final): Replace std::deque
+#include <type_traits>
+#include <vector>
 
-// @TODO(final): Allow non-lambda functions as well
 typedef std::function<void(const size_t startIndex, const size_t endIndex, const float deltaTime)> thread_pool_task_function;
 
-struct ThreadPoolTask {
+// @NOTE: Plain function pointer the workers call for every task, the context points to the callable of the batch
+typedef void(*thread_pool_invoke_function)(const void *context, const size_t startIndex, const size_t endIndex, const float deltaTime);
+
+constexpr size_t MAX_THREADPOOL_THREAD_COUNT = 128;
+
+// @NOTE: Number of tasks each worker gets per batch, more tasks = better load balancing through stealing, but more dispatch overhead
+constexpr size_t THREADPOOL_TASKS_PER_THREAD = 4;
+
+// @NOTE: Number of batches which can be in flight between two WaitUntilDone() calls
+constexpr size_t MAX_THREADPOOL_BATCH_COUNT = 16;
+
+constexpr size_t MAX_THREADPOOL_GRAPH_PHASE_COUNT = 16;
+constexpr size_t MAX_THREADPOOL_GRAPH_ACCESS_COUNT = 4;
+constexpr size_t MAX_THREADPOOL_GRAPH_NODE_COUNT = 512;
+
+// @NOTE: Must be a power of two and large enough to hold all tasks of all batches in flight for one worker, a graph may push all its nodes into a single deque
+constexpr size_t MAX_THREADPOOL_DEQUE_CAPACITY = 1024;
+fplStaticAssert((MAX_THREADPOOL_DEQUE_CAPACITY & (MAX_THREADPOOL_DEQUE_CAPACITY - 1)) == 0);
+fplStaticAssert(MAX_THREADPOOL_DEQUE_CAPACITY >= (THREADPOOL_TASKS_PER_THREAD + 1) * MAX_THREADPOOL_BATCH_COUNT + MAX_THREADPOOL_GRAPH_NODE_COUNT);
+
+// @NOTE: Number of yields the caller spins in WaitUntilDone() before it goes to sleep
+constexpr size_t THREADPOOL_WAIT_SPIN_COUNT = 64;
+
+constexpr size_t THREADPOOL_CACHE_LINE_SIZE = 64;
+
+struct ThreadPoolWaitStatistics {
+	// Time in ms the caller spent spinning or sleeping, without running tasks
+	float waitTime;
+	// Time in ms the caller was blocked on the done condition
+	float sleepTime;
+	// Number of tasks the caller has run itself
+	size_t taskCount;
+};
+
+inline void ThreadPoolInvokeTaskFunction(const void *context, const size_t startIndex, const size_t endIndex, const float deltaTime) {
+	const thread_pool_task_function *func = static_cast<const thread_pool_task_function *>(context);
+	(*func)(startIndex, endIndex, deltaTime);
+}
+
+template<typename F>
+inline void ThreadPoolInvokeCallable(const void *context, const size_t startIndex, const size_t endIndex, const float) {
+	const F *func = static_cast<const F *>(context);
+	(*func)(startIndex, endIndex);
+}
+
+//
+// Task graph
+// Each phase is a loop over [0, itemCount) split into chunks (nodes) and declares which resources it reads or writes.
+// A resource is any array indexed by item, e.g. particle positions. A node accesses either its own item range or a range computed from it (e.g. all neighbors).
+// Dependencies are derived from overlapping accesses of nodes in different phases, so a node starts as soon as the nodes it conflicts with are done, without a barrier between phases.
+// @NOTE: Nodes of the same phase are never ordered against each other, writes to shared items inside one phase are not protected.
+//
+enum class ThreadPoolGraphAccessType : int32_t {
+	Read = 0,
+	Write,
+};
+
+// Item range, end index is inclusive
+struct ThreadPoolGraphRange {
 	size_t startIndex;
 	size_t endIndex;
+};
+
+struct ThreadPoolGraphAccess {
+	uint32_t resources;
+	ThreadPoolGraphAccessType type;
+};
+
+struct ThreadPoolGraphPhase {
+	ThreadPoolGraphAccess accesses[MAX_THREADPOOL_GRAPH_ACCESS_COUNT];
+	thread_pool_invoke_function invoke;
+	const void *context;
+	size_t accessCount;
+	size_t firstNode;
+	size_t nodeCount;
+};
+
+struct ThreadPoolGraphNode {
+	ThreadPoolGraphRange items;
+	ThreadPoolGraphRange ranges[MAX_THREADPOOL_GRAPH_ACCESS_COUNT];
+	size_t phaseIndex;
+	size_t firstDependent;
+	size_t dependentCount;
+	uint32_t dependencyCount;
+	volatile uint32_t remainingCount;
+};
+
+inline bool ThreadPoolGraphAccessesConflict(const ThreadPoolGraphAccess *accessA, const ThreadPoolGraphAccess *accessB) {
+	if ((accessA->resources & accessB->resources) == 0) return false;
+	return accessA->type == ThreadPoolGraphAccessType::Write || accessB->type == ThreadPoolGraphAccessType::Write;
+}
+
+// @NOTE: Phases reference their callables, so the callables must outlive ThreadPool::RunGraph()
+class ThreadPoolGraph {
+private:
+	std::vector<uint64_t> _edges;
+	// Nodes of each phase sorted by the start of their range, per access, and the longest range of each phase and access
+	uint32_t _sortedNodes[MAX_THREADPOOL_GRAPH_ACCESS_COUNT][MAX_THREADPOOL_GRAPH_NODE_COUNT];
+	size_t _maxRangeLengths[MAX_THREADPOOL_GRAPH_PHASE_COUNT][MAX_THREADPOOL_GRAPH_ACCESS_COUNT];
+	// Last node which got an edge from each node, so a pair of nodes conflicting in several accesses gets one edge only
+	uint32_t _edgeMarks[MAX_THREADPOOL_GRAPH_NODE_COUNT];
+
+	inline size_t BeginAccess(const size_t phaseIndex, const uint32_t resources, const ThreadPoolGraphAccessType type) {
+		assert(phaseIndex < phaseCount);
+		ThreadPoolGraphPhase *phase = &phases[phaseIndex];
+		fplAlwaysAssert(phase->accessCount < MAX_THREADPOOL_GRAPH_ACCESS_COUNT);
+		size_t result = phase->accessCount++;
+		phase->accesses[result].resources = resources;
+		phase->accesses[result].type = type;
+		return(result);
+	}
+public:
+	ThreadPoolGraphPhase phases[MAX_THREADPOOL_GRAPH_PHASE_COUNT];
+	ThreadPoolGraphNode nodes[MAX_THREADPOOL_GRAPH_NODE_COUNT];
+	uint32_t readyNodes[MAX_THREADPOOL_GRAPH_NODE_COUNT];
+	std::vector<uint32_t> dependents;
+	size_t phaseCount;
+	size_t nodeCount;
+	size_t readyCount;
+
+	ThreadPoolGraph() :
+		phaseCount(0),
+		nodeCount(0),
+		readyCount(0) {
+	}
+
+	inline void Clear() {
+		phaseCount = nodeCount = readyCount = 0;
+		dependents.clear();
+	}
+
+	// Adds a phase which calls func(startIndex, endIndex) for each of the chunkCount chunks of [0, itemCount)
+	// @NOTE: The nodes of all phases must fit into the fixed node arrays, see GetMaxChunkCount()
+	template<typename F>
+	inline size_t AddPhase(const size_t itemCount, const size_t chunkCount, F &&func) {
+		typedef typename std::remove_reference<F>::type callable_type;
+		static_assert(std::is_lvalue_reference<F>::value, "The callable of a graph phase must not be a temporary");
+		fplAlwaysAssert(phaseCount < MAX_THREADPOOL_GRAPH_PHASE_COUNT);
+		size_t phaseIndex = phaseCount++;
+		ThreadPoolGraphPhase *phase = &phases[phaseIndex];
+		phase->invoke = ThreadPoolInvokeCallable<callable_type>;
+		phase->context = &func;
+		phase->accessCount = 0;
+		phase->firstNode = nodeCount;
+		phase->nodeCount = itemCount > 0 ? fplMax(fplMin(chunkCount, itemCount), 1) : 0;
+		fplAlwaysAssert((nodeCount + phase->nodeCount) <= MAX_THREADPOOL_GRAPH_NODE_COUNT);
+		for (size_t chunkIndex = 0; chunkIndex < phase->nodeCount; ++chunkIndex) {
+			ThreadPoolGraphNode *node = &nodes[nodeCount++];
+			node->items = GetChunkItems(itemCount, phase->nodeCount, chunkIndex);
+			node->phaseIndex = phaseIndex;
+		}
+		return(phaseIndex);
+	}
+
+	// Each node of the phase accesses the resources in its own item range
+	inline void AddAccess(const size_t phaseIndex, const uint32_t resources, const ThreadPoolGraphAccessType type) {
+		AddAccess(phaseIndex, resources, type, [](const ThreadPoolGraphRange &items) {
+			return(items);
+		});
+	}
+
+	// Each node of the phase accesses the resources in the range returned by rangeFunc(items)
+	template<typename R>
+	inline void AddAccess(const size_t phaseIndex, const uint32_t resources, const ThreadPoolGraphAccessType type, R &&rangeFunc) {
+		size_t accessIndex = BeginAccess(phaseIndex, resources, type);
+		const ThreadPoolGraphPhase *phase = &phases[phaseIndex];
+		for (size_t nodeIndex = phase->firstNode; nodeIndex < phase->firstNode + phase->nodeCount; ++nodeIndex) {
+			ThreadPoolGraphNode *node = &nodes[nodeIndex];
+			node->ranges[accessIndex] = rangeFunc(node->items);
+		}
+	}
+
+	// Each node of the phase accesses the resources in chunkRanges[chunk index], so ranges which are expensive to compute can be computed in parallel before
+	inline void AddChunkAccess(const size_t phaseIndex, const uint32_t resources, const ThreadPoolGraphAccessType type, const ThreadPoolGraphRange *chunkRanges) {
+		size_t accessIndex = BeginAccess(phaseIndex, resources, type);
+		const ThreadPoolGraphPhase *phase = &phases[phaseIndex];
+		for (size_t chunkIndex = 0; chunkIndex < phase->nodeCount; ++chunkIndex) {
+			nodes[phase->firstNode + chunkIndex].ranges[accessIndex] = chunkRanges[chunkIndex];
+		}
+	}
+
+	// Computes the dependencies between all nodes, must be called after all phases and accesses are added
+	// @NOTE: The nodes of each phase are sorted by the start of their ranges, so each node only visits the nodes of the earlier phases which can overlap it.
+	// A range can only overlap [start, end] when it starts in [start - longest range length, end], so the cost grows with the number of edges and not with the number of node pairs.
+	inline void Build() {
+		_edges.clear();
+		for (size_t nodeIndex = 0; nodeIndex < nodeCount; ++nodeIndex) {
+			nodes[nodeIndex].dependencyCount = 0;
+			nodes[nodeIndex].dependentCount = 0;
+			_edgeMarks[nodeIndex] = UINT32_MAX;
+		}
+		for (size_t phaseIndex = 0; phaseIndex < phaseCount; ++phaseIndex) {
+			const ThreadPoolGraphPhase *phase = &phases[phaseIndex];
+			for (size_t accessIndex = 0; accessIndex < phase->accessCount; ++accessIndex) {
+				uint32_t *sortedNodes = &_sortedNodes[accessIndex][phase->firstNode];
+				size_t maxRangeLength = 0;
+				for (size_t chunkIndex = 0; chunkIndex < phase->nodeCount; ++chunkIndex) {
+					const ThreadPoolGraphRange *range = &nodes[phase->firstNode + chunkIndex].ranges[accessIndex];
+					if (range->endIndex >= range->startIndex) {
+						maxRangeLength = fplMax(maxRangeLength, range->endIndex - range->startIndex);
+					}
+					sortedNodes[chunkIndex] = (uint32_t)(phase->firstNode + chunkIndex);
+				}
+				std::sort(sortedNodes, sortedNodes + phase->nodeCount, [&](const uint32_t nodeIndexA, const uint32_t nodeIndexB) {
+					return nodes[nodeIndexA].ranges[accessIndex].startIndex < nodes[nodeIndexB].ranges[accessIndex].startIndex;
+				});
+				_maxRangeLengths[phaseIndex][accessIndex] = maxRangeLength;
+			}
+		}
+		for (size_t phaseIndexB = 1; phaseIndexB < phaseCount; ++phaseIndexB) {
+			const ThreadPoolGraphPhase *phaseB = &phases[phaseIndexB];
+			for (size_t nodeIndexB = phaseB->firstNode; nodeIndexB < phaseB->firstNode + phaseB->nodeCount; ++nodeIndexB) {
+				for (size_t phaseIndexA = 0; phaseIndexA < phaseIndexB; ++phaseIndexA) {
+					const ThreadPoolGraphPhase *phaseA = &phases[phaseIndexA];
+					for (size_t accessIndexB = 0; accessIndexB < phaseB->accessCount; ++accessIndexB) {
+						const ThreadPoolGraphRange rangeB = nodes[nodeIndexB].ranges[accessIndexB];
+						for (size_t accessIndexA = 0; accessIndexA < phaseA->accessCount; ++accessIndexA) {
+							if (!ThreadPoolGraphAccessesConflict(&phaseA->accesses[accessIndexA], &phaseB->accesses[accessIndexB])) continue;
+							const size_t maxRangeLength = _maxRangeLengths[phaseIndexA][accessIndexA];
+							const size_t minStartIndex = rangeB.startIndex > maxRangeLength ? rangeB.startIndex - maxRangeLength : 0;
+							const uint32_t *sortedNodes = &_sortedNodes[accessIndexA][phaseA->firstNode];
+							const uint32_t *endNode = sortedNodes + phaseA->nodeCount;
+							const uint32_t *sortedNode = std::lower_bound(sortedNodes, endNode, minStartIndex, [&](const uint32_t nodeIndex, const size_t startIndex) {
+								return nodes[nodeIndex].ranges[accessIndexA].startIndex < startIndex;
+							});
+							for (; sortedNode != endNode; ++sortedNode) {
+								const uint32_t nodeIndexA = *sortedNode;
+								const ThreadPoolGraphRange *rangeA = &nodes[nodeIndexA].ranges[accessIndexA];
+								if (rangeA->startIndex > rangeB.endIndex) break;
+								if (rangeA->endIndex < rangeB.startIndex || _edgeMarks[nodeIndexA] == (uint32_t)nodeIndexB) continue;
+								_edgeMarks[nodeIndexA] = (uint32_t)nodeIndexB;
+								_edges.push_back(((uint64_t)nodeIndexA << 32) | (uint64_t)nodeIndexB);
+								++nodes[nodeIndexA].dependentCount;
+								++nodes[nodeIndexB].dependencyCount;
+							}
+						}
+					}
+				}
+			}
+		}
+
+		// Group the dependents by node
+		size_t firstDependent = 0;
+		for (size_t nodeIndex = 0; nodeIndex < nodeCount; ++nodeIndex) {
+			nodes[nodeIndex].firstDependent = firstDependent;
+			firstDependent += nodes[nodeIndex].dependentCount;
+			nodes[nodeIndex].dependentCount = 0;
+		}
+		dependents.resize(_edges.size());
+		for (size_t edgeIndex = 0; edgeIndex < _edges.size(); ++edgeIndex) {
+			ThreadPoolGraphNode *node = &nodes[_edges[edgeIndex] >> 32];
+			dependents[node->firstDependent + node->dependentCount++] = (uint32_t)(_edges[edgeIndex] & 0xFFFFFFFF);
+		}
+
+		readyCount = 0;
+		for (size_t nodeIndex = 0; nodeIndex < nodeCount; ++nodeIndex) {
+			if (nodes[nodeIndex].dependencyCount == 0) {
+				readyNodes[readyCount++] = (uint32_t)nodeIndex;
+			}
+		}
+	}
+
+	inline size_t GetEdgeCount() const {
+		return dependents.size();
+	}
+
+	// Items of the chunk with the given index, when itemCount items are split into chunkCount chunks
+	static inline ThreadPoolGraphRange GetChunkItems(const size_t itemCount, const size_t chunkCount, const size_t chunkIndex) {
+		ThreadPoolGraphRange result;
+		result.startIndex = (chunkIndex * itemCount) / chunkCount;
+		result.endIndex = ((chunkIndex + 1) * itemCount) / chunkCount - 1;
+		return(result);
+	}
+
+	// Largest chunk count per phase, so that a graph of phaseCount phases never has more nodes than the node arrays
+	static inline size_t GetMaxChunkCount(const size_t phaseCount) {
+		return MAX_THREADPOOL_GRAPH_NODE_COUNT / fplMax(phaseCount, 1);
+	}
+};
+
+struct ThreadPoolBatch {
+	// Number of the batch in this slot, or UINT64_MAX while the slot is being filled
+	volatile uint64_t batchNumber;
+	ThreadPoolGraph *graph;
+	thread_pool_task_function func;
+	thread_pool_invoke_function invoke;
+	const void *context;
+	size_t itemCount;
+	size_t taskCount;
 	float deltaTime;
 	uint8_t padding0[4];
-	thread_pool_task_function func;
 };
 
-constexpr size_t MAX_THREADPOOL_THREAD_COUNT = 128;
+// @NOTE: A task is packed into 64-bit as (batch index << 32 | task index), so the deque can read and write it atomically
+inline uint64_t ThreadPoolPackTask(const size_t batchIndex, const size_t taskIndex) {
+	uint64_t result = ((uint64_t)batchIndex << 32) | (uint64_t)taskIndex;
+	return(result);
+}
+
+inline void ThreadPoolUnpackTask(const uint64_t task, size_t *batchIndex, size_t *taskIndex) {
+	*batchIndex = (size_t)(task >> 32);
+	*taskIndex = (size_t)(task & 0xFFFFFFFF);
+}
+
+//
+// Chase-Lev work-stealing deque
+// Only the owning thread pushes and pops at the bottom, any other thread may steal from the top.
+// @NOTE: FPL atomic loads and stores are full barriers, which gives us the store-load ordering the pop needs.
+//
+struct ThreadPoolDeque {
+	volatile int64_t top;
+	uint8_t padding0[THREADPOOL_CACHE_LINE_SIZE - sizeof(int64_t)];
+	volatile int64_t bottom;
+	uint8_t padding1[THREADPOOL_CACHE_LINE_SIZE - sizeof(int64_t)];
+	volatile uint64_t items[MAX_THREADPOOL_DEQUE_CAPACITY];
+};
+
+inline void ThreadPoolDequePush(ThreadPoolDeque *deque, const uint64_t task) {
+	int64_t b = deque->bottom;
+	int64_t t = fplAtomicLoadS64(&deque->top);
+	assert((b - t) < (int64_t)MAX_THREADPOOL_DEQUE_CAPACITY);
+	deque->items[b & (MAX_THREADPOOL_DEQUE_CAPACITY - 1)] = task;
+	fplAtomicStoreS64(&deque->bottom, b + 1);
+}
+
+inline bool ThreadPoolDequePop(ThreadPoolDeque *deque, uint64_t *outTask) {
+	int64_t b = deque->bottom - 1;
+	fplAtomicStoreS64(&deque->bottom, b);
+	int64_t t = fplAtomicLoadS64(&deque->top);
+	if (t > b) {
+		// Empty
+		fplAtomicStoreS64(&deque->bottom, b + 1);
+		return false;
+	}
+	*outTask = deque->items[b & (MAX_THREADPOOL_DEQUE_CAPACITY - 1)];
+	if (t < b) {
+		return true;
+	}
+	// Last task, race against the thieves
+	bool result = fplAtomicIsCompareAndSwapS64(&deque->top, t, t + 1);
+	fplAtomicStoreS64(&deque->bottom, b + 1);
+	return(result);
+}
+
+inline bool ThreadPoolDequeSteal(ThreadPoolDeque *deque, uint64_t *outTask) {
+	int64_t t = fplAtomicLoadS64(&deque->top);
+	int64_t b = fplAtomicLoadS64(&deque->bottom);
+	if (t >= b) {
+		return false;
+	}
+	uint64_t task = deque->items[t & (MAX_THREADPOOL_DEQUE_CAPACITY - 1)];
+	if (!fplAtomicIsCompareAndSwapS64(&deque->top, t, t + 1)) {
+		return false;
+	}
+	*outTask = task;
+	return true;
+}
+
+struct ThreadPoolState;
+
+struct ThreadPoolWorker {
+	ThreadPoolDeque deque;
+	ThreadPoolState *state;
+	size_t workerIndex;
+	uint64_t seededBatchCount;
+	uint8_t padding0[THREADPOOL_CACHE_LINE_SIZE - sizeof(ThreadPoolState *) - sizeof(size_t) - sizeof(uint64_t)];
+};
+
+// @NOTE: The calling thread takes part in every batch, so there is one more worker slot than threads, the last one is owned by the caller.
 struct ThreadPoolState {
 	fplThreadHandle *threads[MAX_THREADPOOL_THREAD_COUNT];
+	ThreadPoolWorker *workers;
 	size_t threadCount;
-	fplMutexHandle queueMutex;
-	fplConditionVariable queueCondition;
-	std::deque<ThreadPoolTask> queue;
+	size_t workerCount;
+	ThreadPoolBatch batches[MAX_THREADPOOL_BATCH_COUNT];
+	fplMutexHandle wakeMutex;
+	fplConditionVariable wakeCondition;
+	fplMutexHandle doneMutex;
+	fplConditionVariable doneCondition;
+	volatile uint64_t batchCount;
+	volatile uint64_t waitBatchCount;
 	volatile uint64_t pendingCount;
-	volatile uint64_t queuedCount;
-	volatile int stopped;
+	volatile uint32_t sleepingCount;
+	volatile uint32_t callerSleeping;
+	volatile int32_t stopped;
+	size_t barrierCount;
+	double parallelTime;
 };
 
-inline void ThreadPoolWorkerThreadProc(const fplThreadHandle *thread, void *data) {
-	ThreadPoolState *state = static_cast<ThreadPoolState *>(data);
-	ThreadPoolTask task;
-	while (true) {
-		fplMutexLock(&state->queueMutex);
+// Runs a single node of a graph and pushes all dependents which became ready into the workers own deque
+inline void ThreadPoolRunGraphNode(ThreadPoolWorker *worker, const size_t batchIndex, ThreadPoolGraph *graph, const size_t nodeIndex) {
+	const ThreadPoolGraphNode *node = &graph->nodes[nodeIndex];
+	const ThreadPoolGraphPhase *phase = &graph->phases[node->phaseIndex];
+	phase->invoke(phase->context, node->items.startIndex, node->items.endIndex, 0.0f);
+	for (size_t index = 0; index < node->dependentCount; ++index) {
+		uint32_t dependentIndex = graph->dependents[node->firstDependent + index];
+		if (fplAtomicAddAndFetchU32(&graph->nodes[dependentIndex].remainingCount, (uint32_t)-1) == 0) {
+			ThreadPoolDequePush(&worker->deque, ThreadPoolPackTask(batchIndex, dependentIndex));
+		}
+	}
+}
 
-		while (fplAtomicLoadU64(&state->queuedCount) == 0 && !state->stopped) {
-			fplConditionWait(&state->queueCondition, &state->queueMutex, FPL_TIMEOUT_INFINITE);
+inline void ThreadPoolRunTask(ThreadPoolWorker *worker, const uint64_t task) {
+	ThreadPoolState *state = worker->state;
+	size_t batchIndex, taskIndex;
+	ThreadPoolUnpackTask(task, &batchIndex, &taskIndex);
+	const ThreadPoolBatch *batch = &state->batches[batchIndex];
+	if (batch->graph != nullptr) {
+		ThreadPoolRunGraphNode(worker, batchIndex, batch->graph, taskIndex);
+	} else {
+		size_t startIndex = (taskIndex * batch->itemCount) / batch->taskCount;
+		size_t endIndex = ((taskIndex + 1) * batch->itemCount) / batch->taskCount - 1;
+		batch->invoke(batch->context, startIndex, endIndex, batch->deltaTime);
+	}
+	if (fplAtomicAddAndFetchU64(&state->pendingCount, -1) == 0) {
+		// Last task of all batches done, wake up the caller when its sleeping
+		if (fplAtomicLoadU32(&state->callerSleeping)) {
+			fplMutexLock(&state->doneMutex);
+			fplConditionBroadcast(&state->doneCondition);
+			fplMutexUnlock(&state->doneMutex);
 		}
+	}
+}
 
-		if (state->stopped) {
-			fplMutexUnlock(&state->queueMutex);
-			break;
+// Pushes the workers share of all batches it has not seen yet into its own deque
+inline void ThreadPoolSeedWorker(ThreadPoolWorker *worker) {
+	ThreadPoolState *state = worker->state;
+	uint64_t batchCount = fplAtomicLoadU64(&state->batchCount);
+	while (worker->seededBatchCount < batchCount) {
+		uint64_t batchNumber = worker->seededBatchCount++;
+		size_t batchIndex = (size_t)(batchNumber % MAX_THREADPOOL_BATCH_COUNT);
+		ThreadPoolBatch *batch = &state->batches[batchIndex];
+		// @NOTE: A worker which did not run for a while may find the slot recycled already. A batch can only be done without this worker when its share is empty,
+		// so a recycled slot is skipped. The batch number is checked again after the task count is read, because the slot may be refilled in between.
+		if (fplAtomicLoadU64(&batch->batchNumber) != batchNumber) continue;
+		size_t taskCount = batch->taskCount;
+		if (fplAtomicLoadU64(&batch->batchNumber) != batchNumber) continue;
+		size_t firstTask = (worker->workerIndex * taskCount) / state->workerCount;
+		size_t lastTask = ((worker->workerIndex + 1) * taskCount) / state->workerCount;
+		// @NOTE: Pushed in reverse, so the owner pops its share front-to-back and thieves take from the far end
+		// For graphs only the nodes without dependencies are seeded, the others are pushed when they become ready
+		for (size_t taskIndex = lastTask; taskIndex > firstTask; --taskIndex) {
+			size_t index = batch->graph != nullptr ? batch->graph->readyNodes[taskIndex - 1] : taskIndex - 1;
+			ThreadPoolDequePush(&worker->deque, ThreadPoolPackTask(batchIndex, index));
 		}
+	}
+}
 
-		task = state->queue.front();
-		state->queue.pop_front();
-		fplAtomicFetchAndAddU64(&state->queuedCount, -1);
-		fplMutexUnlock(&state->queueMutex);
+inline bool ThreadPoolFindTask(ThreadPoolWorker *worker, uint64_t *outTask) {
+	if (ThreadPoolDequePop(&worker->deque, outTask)) {
+		return true;
+	}
+	ThreadPoolState *state = worker->state;
+	for (size_t offset = 1; offset < state->workerCount; ++offset) {
+		size_t victimIndex = (worker->workerIndex + offset) % state->workerCount;
+		if (ThreadPoolDequeSteal(&state->workers[victimIndex].deque, outTask)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+inline void ThreadPoolWorkerThreadProc(const fplThreadHandle *thread, void *data) {
+	ThreadPoolWorker *worker = static_cast<ThreadPoolWorker *>(data);
+	ThreadPoolState *state = worker->state;
+	uint64_t task;
+	while (!fplAtomicLoadS32(&state->stopped)) {
+		ThreadPoolSeedWorker(worker);
 
-		task.func(task.startIndex, task.endIndex, task.deltaTime);
-		fplAtomicFetchAndAddU64(&state->pendingCount, -1);
+		if (ThreadPoolFindTask(worker, &task)) {
+			ThreadPoolRunTask(worker, task);
+			continue;
+		}
+
+		// Other workers have not seeded their share yet or are still running their last tasks
+		if (fplAtomicLoadU64(&state->pendingCount) > 0) {
+			fplThreadYield();
+			continue;
+		}
+
+		// Nothing left, sleep until the next batch arrives
+		fplMutexLock(&state->wakeMutex);
+		fplAtomicFetchAndAddU32(&state->sleepingCount, 1);
+		while (worker->seededBatchCount == fplAtomicLoadU64(&state->batchCount) && !fplAtomicLoadS32(&state->stopped)) {
+			fplConditionWait(&state->wakeCondition, &state->wakeMutex, FPL_TIMEOUT_INFINITE);
+		}
+		fplAtomicFetchAndAddU32(&state->sleepingCount, -1);
+		fplMutexUnlock(&state->wakeMutex);
 	}
 }
 
 class ThreadPool {
 private:
 	ThreadPoolState _state;
+
+	inline void WakeWorkers() {
+		if (fplAtomicLoadU32(&_state.sleepingCount) > 0) {
+			fplMutexLock(&_state.wakeMutex);
+			fplConditionBroadcast(&_state.wakeCondition);
+			fplMutexUnlock(&_state.wakeMutex);
+		}
+	}
+
+	inline ThreadPoolBatch *BeginBatch() {
+		// @NOTE: Batch slots are recycled, so only a limited number of batches can be created before waiting
+		uint64_t batchCount = fplAtomicLoadU64(&_state.batchCount);
+		assert((batchCount - fplAtomicLoadU64(&_state.waitBatchCount)) < MAX_THREADPOOL_BATCH_COUNT);
+		ThreadPoolBatch *result = &_state.batches[batchCount % MAX_THREADPOOL_BATCH_COUNT];
+		fplAtomicStoreU64(&result->batchNumber, UINT64_MAX);
+		return(result);
+	}
+
+	inline void EndBatch(ThreadPoolBatch *batch, const size_t pendingCount) {
+		fplAtomicStoreU64(&batch->batchNumber, fplAtomicLoadU64(&_state.batchCount));
+		fplAtomicFetchAndAddU64(&_state.pendingCount, pendingCount);
+		fplAtomicFetchAndAddU64(&_state.batchCount, 1);
+		WakeWorkers();
+
+		// The callers share is run in WaitUntilDone(), unless it gets stolen before
+		ThreadPoolSeedWorker(&_state.workers[_state.threadCount]);
+	}
 public:
 	ThreadPool(const size_t threadCount) {
 		_state = {};
 		_state.threadCount = fplMax(fplMin(threadCount, MAX_THREADPOOL_THREAD_COUNT), 1);
-		fplMutexInit(&_state.queueMutex);
-		fplConditionInit(&_state.queueCondition);
+		_state.workerCount = _state.threadCount + 1;
+		fplMutexInit(&_state.wakeMutex);
+		fplConditionInit(&_state.wakeCondition);
+		fplMutexInit(&_state.doneMutex);
+		fplConditionInit(&_state.doneCondition);
+		_state.workers = (ThreadPoolWorker *)fplMemoryAlignedAllocate(sizeof(ThreadPoolWorker) * _state.workerCount, THREADPOOL_CACHE_LINE_SIZE);
+		for (size_t workerIndex = 0; workerIndex < _state.workerCount; ++workerIndex) {
+			ThreadPoolWorker *worker = &_state.workers[workerIndex];
+			worker->deque.top = worker->deque.bottom = 0;
+			worker->state = &_state;
+			worker->workerIndex = workerIndex;
+			worker->seededBatchCount = 0;
+		}
 		for (size_t workerIndex = 0; workerIndex < _state.threadCount; ++workerIndex) {
-			_state.threads[workerIndex] = fplThreadCreate(ThreadPoolWorkerThreadProc, &_state);
+			_state.threads[workerIndex] = fplThreadCreate(ThreadPoolWorkerThreadProc, &_state.workers[workerIndex]);
 		}
 	}
 	ThreadPool() :
 		ThreadPool(ThreadPool::GetConcurrencyThreadCount()) {
 	}
 	~ThreadPool() {
-		fplMutexLock(&_state.queueMutex);
-		_state.stopped = 1;
-		_state.pendingCount = 0;
-		_state.queuedCount = 0;
-		_state.queue.clear();
-		fplMutexUnlock(&_state.queueMutex);
-		fplConditionBroadcast(&_state.queueCondition);
+		WaitUntilDone();
+
+		fplMutexLock(&_state.wakeMutex);
+		fplAtomicStoreS32(&_state.stopped, 1);
+		fplConditionBroadcast(&_state.wakeCondition);
+		fplMutexUnlock(&_state.wakeMutex);
 
 		fplThreadWaitForAll(_state.threads, _state.threadCount, 0, FPL_TIMEOUT_INFINITE);
 
-		fplConditionDestroy(&_state.queueCondition);
-		fplMutexDestroy(&_state.queueMutex);
+		fplMemoryAlignedFree(_state.workers);
+		fplConditionDestroy(&_state.doneCondition);
+		fplMutexDestroy(&_state.doneMutex);
+		fplConditionDestroy(&_state.wakeCondition);
+		fplMutexDestroy(&_state.wakeMutex);
 		_state = {};
 	}
 
@@ -93,39 +580,177 @@ public:
 	ThreadPool(ThreadPool &&) = delete;
 	ThreadPool &operator=(ThreadPool &&) = delete;
 
-	inline void AddTask(const ThreadPoolTask &task) {
-		_state.queue.push_back(task);
-		fplAtomicFetchAndAddU64(&_state.queuedCount, 1);
-	}
-
-	inline void WaitUntilDone() {
-		fplAssert(_state.queueMutex.isValid);
-		fplMutexLock(&_state.queueMutex);
-		fplConditionBroadcast(&_state.queueCondition);
-		fplMutexUnlock(&_state.queueMutex);
+	// Runs queued tasks on the calling thread until all batches are done, then spins for a short while and sleeps when there is still work in flight
+	// @NOTE: Must be called from the same thread which calls CreateTasks()
+	inline ThreadPoolWaitStatistics WaitUntilDone() {
+		ThreadPoolWaitStatistics result = {};
+		if (fplAtomicLoadU64(&_state.waitBatchCount) != fplAtomicLoadU64(&_state.batchCount)) {
+			++_state.barrierCount;
+		}
+		ThreadPoolWorker *caller = &_state.workers[_state.threadCount];
+		uint64_t task;
+		size_t spinCount = 0;
+		bool isWaiting = false;
+		fplTimestamp waitStart = {};
 		while (fplAtomicLoadU64(&_state.pendingCount) > 0) {
-			fplThreadYield();
+			if (ThreadPoolFindTask(caller, &task)) {
+				if (isWaiting) {
+					result.waitTime += (float)(fplTimestampElapsed(waitStart, fplTimestampQuery()) * 1000.0);
+					isWaiting = false;
+				}
+				ThreadPoolRunTask(caller, task);
+				++result.taskCount;
+				spinCount = 0;
+				continue;
+			}
+
+			if (!isWaiting) {
+				waitStart = fplTimestampQuery();
+				isWaiting = true;
+			}
+
+			if (spinCount < THREADPOOL_WAIT_SPIN_COUNT) {
+				++spinCount;
+				fplThreadYield();
+				continue;
+			}
+
+			fplTimestamp sleepStart = fplTimestampQuery();
+			fplMutexLock(&_state.doneMutex);
+			fplAtomicStoreU32(&_state.callerSleeping, 1);
+			while (fplAtomicLoadU64(&_state.pendingCount) > 0) {
+				fplConditionWait(&_state.doneCondition, &_state.doneMutex, FPL_TIMEOUT_INFINITE);
+			}
+			fplAtomicStoreU32(&_state.callerSleeping, 0);
+			fplMutexUnlock(&_state.doneMutex);
+			result.sleepTime += (float)(fplTimestampElapsed(sleepStart, fplTimestampQuery()) * 1000.0);
+		}
+		if (isWaiting) {
+			result.waitTime += (float)(fplTimestampElapsed(waitStart, fplTimestampQuery()) * 1000.0);
 		}
+		fplAtomicStoreU64(&_state.waitBatchCount, fplAtomicLoadU64(&_state.batchCount));
+		return(result);
 	}
 
+	// Queues the range [0, itemCount) as tasks and returns immediately, the function is copied into the batch
 	inline void CreateTasks(const size_t itemCount, const thread_pool_task_function &func, const float deltaTime) {
 		if (itemCount == 0) return;
+		ThreadPoolBatch *batch = BeginBatch();
+		batch->graph = nullptr;
+		batch->func = func;
+		batch->invoke = ThreadPoolInvokeTaskFunction;
+		batch->context = &batch->func;
+		batch->itemCount = itemCount;
+		batch->taskCount = fplMin(itemCount, _state.workerCount * THREADPOOL_TASKS_PER_THREAD);
+		batch->deltaTime = deltaTime;
+		EndBatch(batch, batch->taskCount);
+	}
 
-		const size_t threads_size = _state.threadCount;
-		const size_t itemsPerTask = fplMax((size_t)1, itemCount / threads_size);
+	// Splits the range [0, count) into chunks of at least grain items, calls func(startIndex, endIndex) for each chunk and waits until all tasks are done
+	// @NOTE: The callable is referenced and not copied, so there is no allocation or type erasure per batch. End index is inclusive, same as for CreateTasks().
+	template<typename F>
+	inline ThreadPoolWaitStatistics ParallelFor(const size_t count, const size_t grain, F &&func) {
+		typedef typename std::remove_reference<F>::type callable_type;
+		ThreadPoolWaitStatistics result = {};
+		if (count == 0) return(result);
+		size_t chunkCount = GetChunkCount(count, grain);
+		if (chunkCount == 1 && fplAtomicLoadU64(&_state.pendingCount) == 0) {
+			// Not worth waking up the workers
+			func(0, count - 1);
+			return(result);
+		}
+		fplTimestamp startTime = fplTimestampQuery();
+		ThreadPoolBatch *batch = BeginBatch();
+		batch->graph = nullptr;
+		batch->invoke = ThreadPoolInvokeCallable<callable_type>;
+		batch->context = &func;
+		batch->itemCount = count;
+		batch->taskCount = chunkCount;
+		batch->deltaTime = 0.0f;
+		EndBatch(batch, batch->taskCount);
+		result = WaitUntilDone();
+		_state.parallelTime += fplTimestampElapsed(startTime, fplTimestampQuery()) * 1000.0;
+		return(result);
+	}
+
+	// Replaces values[0, count) with its exclusive prefix sum and returns the total sum, which is summed up in TSum so a wider type can detect an overflow of the offsets
+	// @NOTE: Each chunk sums up its own range first, the chunk sums are scanned on the caller and then each chunk writes its offsets, so there are two barriers
+	template<typename T, typename TSum = T>
+	inline TSum ParallelExclusiveScan(T *values, const size_t count, const size_t grain) {
+		TSum result = 0;
+		if (count == 0) return(result);
+		TSum chunkSums[(MAX_THREADPOOL_THREAD_COUNT + 1) * THREADPOOL_TASKS_PER_THREAD];
+		const size_t chunkCount = GetChunkCount(count, grain);
+		assert(chunkCount <= fplArrayCount(chunkSums));
+		ParallelFor(chunkCount, 1, [&](const size_t startChunk, const size_t endChunk) {
+			for (size_t chunkIndex = startChunk; chunkIndex <= endChunk; ++chunkIndex) {
+				TSum sum = 0;
+				for (size_t index = (chunkIndex * count) / chunkCount, end = ((chunkIndex + 1) * count) / chunkCount; index < end; ++index) {
+					sum += values[index];
+				}
+				chunkSums[chunkIndex] = sum;
+			}
+		});
+		for (size_t chunkIndex = 0; chunkIndex < chunkCount; ++chunkIndex) {
+			TSum sum = chunkSums[chunkIndex];
+			chunkSums[chunkIndex] = result;
+			result += sum;
+		}
+		ParallelFor(chunkCount, 1, [&](const size_t startChunk, const size_t endChunk) {
+			for (size_t chunkIndex = startChunk; chunkIndex <= endChunk; ++chunkIndex) {
+				TSum offset = chunkSums[chunkIndex];
+				for (size_t index = (chunkIndex * count) / chunkCount, end = ((chunkIndex + 1) * count) / chunkCount; index < end; ++index) {
+					T value = values[index];
+					values[index] = (T)offset;
+					offset += value;
+				}
+			}
+		});
+		return(result);
+	}
 
-		fplMutexLock(&_state.queueMutex);
-		size_t tasks_added = 0;
-		for (size_t itemIndex = 0; itemIndex < itemCount; itemIndex += itemsPerTask, ++tasks_added) {
-			ThreadPoolTask task = {};
-			task.func = func;
-			task.deltaTime = deltaTime;
-			task.startIndex = itemIndex;
-			task.endIndex = std::min(itemIndex + itemsPerTask - 1, itemCount - 1);
-			AddTask(task);
+	// Runs all nodes of a built graph in dependency order and waits until all are done
+	inline ThreadPoolWaitStatistics RunGraph(ThreadPoolGraph &graph) {
+		ThreadPoolWaitStatistics result = {};
+		if (graph.nodeCount == 0) return(result);
+		assert(graph.readyCount > 0);
+		fplTimestamp startTime = fplTimestampQuery();
+		for (size_t nodeIndex = 0; nodeIndex < graph.nodeCount; ++nodeIndex) {
+			graph.nodes[nodeIndex].remainingCount = graph.nodes[nodeIndex].dependencyCount;
 		}
-		fplAtomicFetchAndAddU64(&_state.pendingCount, tasks_added);
-		fplMutexUnlock(&_state.queueMutex);
+		ThreadPoolBatch *batch = BeginBatch();
+		batch->graph = &graph;
+		batch->invoke = nullptr;
+		batch->context = nullptr;
+		batch->itemCount = graph.nodeCount;
+		batch->taskCount = graph.readyCount;
+		batch->deltaTime = 0.0f;
+		EndBatch(batch, graph.nodeCount);
+		result = WaitUntilDone();
+		_state.parallelTime += fplTimestampElapsed(startTime, fplTimestampQuery()) * 1000.0;
+		return(result);
+	}
+
+	// Number of chunks a range of count items is split into, when each chunk should have at least grain items
+	inline size_t GetChunkCount(const size_t count, const size_t grain) {
+		size_t result = (count + fplMax(grain, 1) - 1) / fplMax(grain, 1);
+		result = fplMin(result, GetMaxChunkCount());
+		return(result);
+	}
+
+	// Upper bound of GetChunkCount() for any count
+	inline size_t GetMaxChunkCount() {
+		return _state.workerCount * THREADPOOL_TASKS_PER_THREAD;
+	}
+
+	// Number of WaitUntilDone() calls which had to join at least one batch
+	inline size_t GetBarrierCount() {
+		return _state.barrierCount;
+	}
+
+	// Total time in ms the caller spent inside ParallelFor() and RunGraph() calls which ran on the workers
+	inline double GetParallelTime() {
+		return _state.parallelTime;
 	}
 
 	inline size_t GetThreadCount() {
@@ -138,4 +763,4 @@ public:
 	}
 };
 
-#endif
\ No newline at end of file
+#endif
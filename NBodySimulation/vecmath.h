@@ -290,8 +290,8 @@ inline Vec2f Vec2MultMat2(const Mat2f &A, const Vec2f &v) {
 }
 
 inline float Vec2DistanceSquared(const Vec2f &a, const Vec2f &b) {
-	float f = (b.x - a.x) * (b.y - a.y);
-	float result = f * f;
+	Vec2f d = b - a;
+	float result = d.x * d.x + d.y * d.y;
 	return(result);
 }
 